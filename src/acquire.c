@@ -0,0 +1,182 @@
+/*
+ ============================================================================
+ Name        : acquire.c
+ Description : Sensor acquisition stage with per-source deadlines
+ ============================================================================
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "acquire.h"
+#include "ctl.h"
+#include "util.h"
+
+typedef struct {
+    acquire_source_config config;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int period_ms;              /* config values, or as set later */
+    int stale_ms;
+    acquire_sample sample;
+    uint64_t read_started_us;   /* 0 while no read is in flight */
+    uint64_t last_duration_us;
+    unsigned long reads;
+    unsigned long errors;
+    unsigned long overruns;     /* reads that blew their deadline */
+} acquire_source;
+
+static acquire_source sources[ACQUIRE_MAX_SOURCES];
+static int source_count = 0;
+
+static void* acquire_thread(void* arg);
+static void acquire_command(const char* args, FILE* out);
+
+int acquire_add(const acquire_source_config* config) {
+    if (source_count >= ACQUIRE_MAX_SOURCES)
+        return -1;
+    acquire_source* s = &sources[source_count];
+    memset(s, 0, sizeof(*s));
+    s->config = *config;
+    s->period_ms = config->period_ms;
+    s->stale_ms = config->stale_ms;
+    pthread_mutex_init(&s->lock, NULL);
+    return source_count++;
+}
+
+int acquire_start(void) {
+    for (int i = 0; i < source_count; i++) {
+        if (pthread_create(&sources[i].thread, NULL, &acquire_thread,
+                &sources[i]) != 0) {
+            printf("unable to start acquisition of %s\n", sources[i].config.name);
+            return -1;
+        }
+        pthread_detach(sources[i].thread);
+    }
+    return 0;
+}
+
+int acquire_get(int id, acquire_sample* sample) {
+    if (id < 0 || id >= source_count) {
+        memset(sample, 0, sizeof(*sample));
+        sample->stale = 1;
+        return -1;
+    }
+    acquire_source* s = &sources[id];
+    uint64_t now = util_now_us();
+    pthread_mutex_lock(&s->lock);
+    *sample = s->sample;
+    int overdue = s->config.timeout_ms > 0 && s->read_started_us != 0
+            && now - s->read_started_us > (uint64_t) s->config.timeout_ms * 1000;
+    int stale_ms = s->stale_ms;
+    pthread_mutex_unlock(&s->lock);
+    sample->age_us = sample->valid ? now - sample->time_us : 0;
+    sample->stale = !sample->valid || overdue
+            || sample->age_us > (uint64_t) stale_ms * 1000;
+    return sample->stale ? -1 : 0;
+}
+
+double acquire_extrapolate(const acquire_sample* sample, int index,
+        int horizon_ms, double max_delta) {
+    double value = sample->values[index];
+    if (!sample->valid || sample->prev_time_us == 0
+            || sample->time_us <= sample->prev_time_us)
+        return value;
+    double slope = (value - sample->prev_values[index])
+            / (double) (sample->time_us - sample->prev_time_us);
+    uint64_t ahead = sample->age_us;
+    if (ahead > (uint64_t) horizon_ms * 1000)
+        ahead = (uint64_t) horizon_ms * 1000;
+    double delta = slope * ahead;
+    if (delta > max_delta)
+        delta = max_delta;
+    if (delta < -max_delta)
+        delta = -max_delta;
+    return value + delta;
+}
+
+void acquire_set_period(int id, int period_ms) {
+    if (id < 0 || id >= source_count || period_ms <= 0)
+        return;
+    acquire_source* s = &sources[id];
+    pthread_mutex_lock(&s->lock);
+    s->period_ms = period_ms;
+    // a slower source gets the same margin before it counts as stale
+    s->stale_ms = s->config.stale_ms;
+    if (period_ms > s->config.period_ms)
+        s->stale_ms += period_ms - s->config.period_ms;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void acquire_register(void) {
+    ctl_register("sources", "acquisition sources with age and deadline overruns",
+            &acquire_command);
+}
+
+static void* acquire_thread(void* arg) {
+    acquire_source* s = arg;
+    for (;;) {
+        double values[ACQUIRE_MAX_VALUES];
+        uint64_t start = util_now_us();
+        pthread_mutex_lock(&s->lock);
+        s->read_started_us = start;
+        pthread_mutex_unlock(&s->lock);
+
+        int count = s->config.read(values, s->config.arg);
+
+        uint64_t end = util_now_us();
+        pthread_mutex_lock(&s->lock);
+        s->read_started_us = 0;
+        s->last_duration_us = end - start;
+        s->reads++;
+        if (s->config.timeout_ms > 0
+                && end - start > (uint64_t) s->config.timeout_ms * 1000)
+            s->overruns++;
+        if (count > 0) {
+            if (count > ACQUIRE_MAX_VALUES)
+                count = ACQUIRE_MAX_VALUES;
+            if (s->sample.valid) {
+                memcpy(s->sample.prev_values, s->sample.values,
+                        sizeof(s->sample.values));
+                s->sample.prev_time_us = s->sample.time_us;
+            }
+            memcpy(s->sample.values, values, sizeof(double) * count);
+            s->sample.count = count;
+            s->sample.valid = 1;
+            s->sample.time_us = end;
+        } else if (count == ACQUIRE_EOF) {
+            s->sample.ended = 1;
+        } else {
+            s->errors++;
+        }
+        int period_ms = s->period_ms;
+        pthread_mutex_unlock(&s->lock);
+        if (count == ACQUIRE_EOF)
+            break;
+        if (period_ms > 0)
+            usleep(period_ms * 1000);
+    }
+    printf("acquisition of %s ended\n", s->config.name);
+    return NULL;
+}
+
+static void acquire_command(const char* args, FILE* out) {
+    uint64_t now = util_now_us();
+    for (int i = 0; i < source_count; i++) {
+        acquire_source* s = &sources[i];
+        acquire_sample sample;
+        acquire_get(i, &sample);
+        pthread_mutex_lock(&s->lock);
+        uint64_t in_flight = s->read_started_us != 0 ? now - s->read_started_us : 0;
+        fprintf(out, "%s age_ms %llu stale %d reads %lu errors %lu overruns %lu "
+                "last_read_us %llu in_flight_ms %llu%s\n", s->config.name,
+                (unsigned long long) sample.age_us / 1000, sample.stale,
+                s->reads, s->errors, s->overruns,
+                (unsigned long long) s->last_duration_us,
+                (unsigned long long) in_flight / 1000,
+                sample.ended ? " ended" : "");
+        pthread_mutex_unlock(&s->lock);
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ ============================================================================
+ Name        : acquire.h
+ Description : Sensor acquisition stage with per-source deadlines
+ ============================================================================
+
+ Each source (EC registers, the GPU temperature stream on stdin, the extra
+ hwmon sensors, ...) runs its read function on its own thread and publishes
+ the values with the time they were taken. The control loop never waits
+ for a source: acquire_get() hands out the freshest values together with
+ their age, and flags a source as stale once its newest values are older
+ than stale_ms, or a read has been in flight for longer than timeout_ms. The
+ controller then falls back to something conservative instead of blocking
+ on a slow EC or a sleeping NVMe drive.
+ */
+
+#ifndef CLEVO_ACQUIRE_H
+#define CLEVO_ACQUIRE_H
+
+#include <stdint.h>
+
+#define ACQUIRE_MAX_SOURCES 8
+#define ACQUIRE_MAX_VALUES 4
+
+/* Read function results besides a value count. */
+#define ACQUIRE_ERROR -1
+#define ACQUIRE_EOF -2
+
+/* Fill values[] and return how many were read, ACQUIRE_ERROR, or
+ * ACQUIRE_EOF to stop the source for good. */
+typedef int (*acquire_fn)(double* values, void* arg);
+
+typedef struct {
+    const char* name;
+    acquire_fn read;
+    void* arg;
+    int period_ms;      /* pause between reads, 0 for blocking streams */
+    int timeout_ms;     /* deadline of one read, 0 for none */
+    int stale_ms;       /* values older than this are stale */
+} acquire_source_config;
+
+typedef struct {
+    double values[ACQUIRE_MAX_VALUES];
+    int count;
+    int valid;          /* at least one successful read */
+    int stale;
+    int ended;          /* the read function returned ACQUIRE_EOF */
+    uint64_t time_us;   /* util_now_us() when the values were taken */
+    uint64_t age_us;
+    double prev_values[ACQUIRE_MAX_VALUES];
+    uint64_t prev_time_us;  /* 0 until there were two samples */
+} acquire_sample;
+
+/* Add a source before acquire_start(). Returns its id or -1. */
+int acquire_add(const acquire_source_config* config);
+
+int acquire_start(void);
+
+/* Latest values of a source. Returns 0 when they are valid and fresh. */
+int acquire_get(int id, acquire_sample* sample);
+
+/* Change the pause between reads of a periodic source; its staleness
+ * limit grows by as much as the period does. */
+void acquire_set_period(int id, int period_ms);
+
+/* Value <index> projected to now along the trend of the last two samples.
+ * The projection covers at most horizon_ms past the newest sample and moves
+ * at most max_delta away from it. */
+double acquire_extrapolate(const acquire_sample* sample, int index,
+        int horizon_ms, double max_delta);
+
+/* Register the "sources" socket command. */
+void acquire_register(void);
+
+#endif
@@ -0,0 +1,377 @@
+/*
+ ============================================================================
+ Name        : analytics.c
+ Description : Vectorised kernels over history columns
+ ============================================================================
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "analytics.h"
+#include "history.h"
+#include "util.h"
+
+#define ANALYTICS_BLOCK 4096    /* vector steps before 16-bit lane counts could overflow */
+/* Copies of every histogram bin: neighbouring slots usually hold the same
+ * value, and spreading them over four counters keeps one increment from
+ * waiting for the store of the one before. */
+#define ANALYTICS_COPIES 4
+
+typedef int16_t v16hi __attribute__((vector_size(32)));
+typedef uint16_t v16hu __attribute__((vector_size(32)));
+typedef int16_t v8hi __attribute__((vector_size(16)));
+typedef int32_t v8si __attribute__((vector_size(32)));
+typedef uint32_t v8su __attribute__((vector_size(32)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef int64_t v4di __attribute__((vector_size(32)));
+
+/* Start times in [from, to] as one signed compare: (t - from) <= (to - from)
+ * unsigned, with the sign bit flipped, since x86 has no unsigned vector
+ * compares. */
+#define ANALYTICS_SIGN 0x80000000u
+
+/* The vector kernels use 256-bit AVX2 registers; the compiler would split
+ * anything wider than the target's registers into single lanes, so there
+ * is no generic vector build and CPUs without AVX2 get the scalar twins,
+ * which the compiler is told not to vectorise, as does the benchmark. */
+#define ANALYTICS_SCALAR __attribute__((optimize("no-tree-vectorize")))
+#define ANALYTICS_AVX2 __attribute__((target("avx2")))
+#define ANALYTICS_INLINE_AVX2 static inline __attribute__((always_inline, target("avx2")))
+
+typedef void (*analytics_histogram_fn)(const uint32_t* times, const int16_t* values, int n,
+        uint32_t from, uint32_t to, int min, int max, uint32_t* bins);
+
+static int analytics_avx2(void);
+ANALYTICS_INLINE_AVX2 v16hi analytics_window16(const uint32_t* times, uint32_t from, int32_t window);
+ANALYTICS_AVX2 static void analytics_summarize_avx2(const uint32_t* times, const int16_t* values, int n,
+        uint32_t from, uint32_t to, int threshold, analytics_summary* s);
+ANALYTICS_AVX2 static void analytics_histogram_avx2(const uint32_t* times, const int16_t* values,
+        int n, uint32_t from, uint32_t to, int min, int max, uint32_t* bins);
+ANALYTICS_AVX2 static void analytics_correlate_avx2(const uint32_t* times, const int16_t* x,
+        const int16_t* y, int n, uint32_t from, uint32_t to, analytics_moments* m);
+static void analytics_summarize_scalar(const uint32_t* times, const int16_t* values, int n,
+        uint32_t from, uint32_t to, int threshold, analytics_summary* s);
+static void analytics_histogram_scalar(const uint32_t* times, const int16_t* values, int n,
+        uint32_t from, uint32_t to, int min, int max, uint32_t* bins);
+static void analytics_correlate_scalar(const uint32_t* times, const int16_t* x, const int16_t* y,
+        int n, uint32_t from, uint32_t to, analytics_moments* m);
+static int analytics_ranks(analytics_histogram_fn histogram, const analytics_span* spans,
+        int span_count, uint32_t from, uint32_t to, const analytics_summary* s, const int* pcts,
+        int* results, int count);
+static int16_t analytics_clamp16(int value);
+
+void analytics_summary_init(analytics_summary* s) {
+    memset(s, 0, sizeof(*s));
+    s->min = INT_MAX;
+    s->max = INT_MIN;
+}
+
+void analytics_summarize(const uint32_t* times, const int16_t* values, int n,
+        uint32_t from, uint32_t to, int threshold, analytics_summary* s) {
+    if (analytics_avx2())
+        analytics_summarize_avx2(times, values, n, from, to, threshold, s);
+    else
+        analytics_summarize_scalar(times, values, n, from, to, threshold, s);
+}
+
+int analytics_percentiles(const analytics_span* spans, int span_count, uint32_t from, uint32_t to,
+        const analytics_summary* s, const int* pcts, int* results, int count) {
+    return analytics_ranks(analytics_avx2() ? &analytics_histogram_avx2 : &analytics_histogram_scalar,
+            spans, span_count, from, to, s, pcts, results, count);
+}
+
+void analytics_correlate(const uint32_t* times, const int16_t* x, const int16_t* y, int n,
+        uint32_t from, uint32_t to, analytics_moments* m) {
+    if (analytics_avx2())
+        analytics_correlate_avx2(times, x, y, n, from, to, m);
+    else
+        analytics_correlate_scalar(times, x, y, n, from, to, m);
+}
+
+double analytics_pearson(const analytics_moments* m) {
+    if (m->count < 2)
+        return NAN;
+    double n = m->count;
+    double mx = m->sx / n, my = m->sy / n;
+    double cov = m->sxy / n - mx * my;
+    double vx = m->sxx / n - mx * mx, vy = m->syy / n - my * my;
+    return vx > 0 && vy > 0 ? cov / sqrt(vx * vy) : NAN;
+}
+
+int analytics_bench(int days, FILE* out) {
+    long n = days * 86400L;
+    uint32_t* times = malloc(n * sizeof(uint32_t));
+    int16_t* temp = malloc(n * sizeof(int16_t));
+    int16_t* duty = malloc(n * sizeof(int16_t));
+    if (times == NULL || temp == NULL || duty == NULL) {
+        fprintf(out, "unable to allocate %d days of samples\n", days);
+        free(times);
+        free(temp);
+        free(duty);
+        return -1;
+    }
+    // a daily temperature cycle with noise peaking above 85°C, a duty
+    // following it, a gap now and then, and a period leaving out the first
+    // tenth
+    uint32_t start = 1700000000;
+    uint32_t seed = 1;
+    for (long i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        int noise = (seed >> 16) % 61 - 30;
+        int t = 550 + (int) (350 * sin(i * (2 * M_PI / 86400))) + noise;
+        times[i] = start + i;
+        temp[i] = i % 977 == 0 ? HISTORY_MISSING : t;
+        duty[i] = t < 450 ? 0 : t - 400 > 1000 ? 1000 : t - 400 + noise / 3;
+    }
+    uint32_t from = start + n / 10, to = start + n - 1;
+    fprintf(out, "%d days, %ld per-second slots, %s kernels\n", days, n,
+            analytics_avx2() ? "AVX2" : "scalar (no AVX2)");
+
+    analytics_summary a, b;
+    analytics_summary_init(&a);
+    analytics_summary_init(&b);
+    uint64_t t0 = util_now_us();
+    analytics_summarize_scalar(times, temp, n, from, to, 850, &a);
+    uint64_t t1 = util_now_us();
+    analytics_summarize(times, temp, n, from, to, 850, &b);
+    uint64_t t2 = util_now_us();
+    int same = memcmp(&a, &b, sizeof(a)) == 0;
+    fprintf(out, "summary      scalar %8.2f ms  vector %8.2f ms  %5.1fx%s\n", (t1 - t0) / 1000.0,
+            (t2 - t1) / 1000.0, (double) (t1 - t0) / (t2 - t1 ? t2 - t1 : 1), same ? "" : "  MISMATCH");
+
+    fprintf(out, "above 85     scalar %ld s  vector %ld s%s\n", a.above, b.above,
+            a.above == b.above ? "" : "  MISMATCH");
+
+    static const int pcts[] = { 50, 95, 99 };
+    int ps[3], pv[3];
+    analytics_span span = { times, temp, n };
+    t0 = util_now_us();
+    analytics_ranks(&analytics_histogram_scalar, &span, 1, from, to, &a, pcts, ps, 3);
+    t1 = util_now_us();
+    analytics_percentiles(&span, 1, from, to, &b, pcts, pv, 3);
+    t2 = util_now_us();
+    same = memcmp(ps, pv, sizeof(ps)) == 0;
+    fprintf(out, "p50/p95/p99  scalar %8.2f ms  vector %8.2f ms  %5.1fx%s\n", (t1 - t0) / 1000.0,
+            (t2 - t1) / 1000.0, (double) (t1 - t0) / (t2 - t1 ? t2 - t1 : 1), same ? "" : "  MISMATCH");
+
+    analytics_moments ma, mb;
+    memset(&ma, 0, sizeof(ma));
+    memset(&mb, 0, sizeof(mb));
+    t0 = util_now_us();
+    analytics_correlate_scalar(times, duty, temp, n, from, to, &ma);
+    t1 = util_now_us();
+    analytics_correlate(times, duty, temp, n, from, to, &mb);
+    t2 = util_now_us();
+    same = memcmp(&ma, &mb, sizeof(ma)) == 0;
+    fprintf(out, "correlation  scalar %8.2f ms  vector %8.2f ms  %5.1fx%s\n", (t1 - t0) / 1000.0,
+            (t2 - t1) / 1000.0, (double) (t1 - t0) / (t2 - t1 ? t2 - t1 : 1), same ? "" : "  MISMATCH");
+    fprintf(out, "mean %.1f min %.1f max %.1f p50 %.1f p95 %.1f p99 %.1f above 85: %ld s, "
+            "r(duty, temp) %.3f\n", (double) b.sum / b.count / 10, b.min / 10.0, b.max / 10.0,
+            pv[0] / 10.0, pv[1] / 10.0, pv[2] / 10.0, b.above, analytics_pearson(&mb));
+    free(times);
+    free(temp);
+    free(duty);
+    return 0;
+}
+
+static int analytics_avx2(void) {
+    static int supported = -1;
+    if (supported < 0)
+        supported = __builtin_cpu_supports("avx2") != 0;
+    return supported;
+}
+
+/* -1 in the 16-bit lanes of the 16 slots from times that start in the period. */
+ANALYTICS_INLINE_AVX2 v16hi analytics_window16(const uint32_t* times, uint32_t from, int32_t window) {
+    v8su lo, hi;
+    memcpy(&lo, times, sizeof(lo));
+    memcpy(&hi, times + 8, sizeof(hi));
+    v8hi a = __builtin_convertvector((v8si) ((lo - from) ^ ANALYTICS_SIGN) <= window, v8hi);
+    v8hi b = __builtin_convertvector((v8si) ((hi - from) ^ ANALYTICS_SIGN) <= window, v8hi);
+    return __builtin_shufflevector(a, b, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+}
+
+ANALYTICS_AVX2
+static void analytics_summarize_avx2(const uint32_t* times, const int16_t* values, int n,
+        uint32_t from, uint32_t to, int threshold, analytics_summary* s) {
+    const int16_t limit = analytics_clamp16(threshold);
+    const int32_t window = (to - from) ^ ANALYTICS_SIGN;
+    v16hi vmin = (v16hi) {} + (int16_t) INT16_MAX;
+    v16hi vmax = (v16hi) {} + (int16_t) INT16_MIN;
+    int i = 0;
+    while (i + 16 <= n) {
+        // counts in 16-bit lanes and sums in 32-bit ones, added up per block
+        v16hi vcount = {}, vabove = {};
+        v8si vsum = {};
+        for (int b = 0; b < ANALYTICS_BLOCK && i + 16 <= n; b++, i += 16) {
+            v16hi v;
+            memcpy(&v, values + i, sizeof(v));
+            v16hi m = analytics_window16(times + i, from, window) & (v != (int16_t) HISTORY_MISSING);
+            v16hi lower = m & (v < vmin), higher = m & (v > vmax);
+            vmin = (v & lower) | (vmin & ~lower);
+            vmax = (v & higher) | (vmax & ~higher);
+            v16hi kept = v & m;
+            vsum += __builtin_convertvector(__builtin_shufflevector(kept, kept, 0, 1, 2, 3, 4, 5, 6, 7), v8si)
+                    + __builtin_convertvector(__builtin_shufflevector(kept, kept, 8, 9, 10, 11, 12, 13, 14, 15), v8si);
+            vcount -= m;
+            vabove -= m & (v > limit);
+        }
+        for (int k = 0; k < 16; k++) {
+            s->count += vcount[k];
+            s->above += vabove[k];
+        }
+        for (int k = 0; k < 8; k++)
+            s->sum += vsum[k];
+    }
+    // lanes that saw nothing hold the extremes of the type, which lose
+    // against anything recorded
+    for (int k = 0; k < 16; k++) {
+        if (vmin[k] < s->min)
+            s->min = vmin[k];
+        if (vmax[k] > s->max && vmax[k] != INT16_MIN)
+            s->max = vmax[k];
+    }
+    analytics_summarize_scalar(times + i, values + i, n - i, from, to, threshold, s);
+}
+
+/* The mask of a slot is worked out 16 at a time; AVX2 has no scatter, so
+ * the increments stay scalar, but without a branch: a slot that doesn't
+ * count adds 0 to bin 0. */
+ANALYTICS_AVX2
+static void analytics_histogram_avx2(const uint32_t* times, const int16_t* values, int n,
+        uint32_t from, uint32_t to, int min, int max, uint32_t* bins) {
+    const int32_t window = (to - from) ^ ANALYTICS_SIGN;
+    const int16_t lo = analytics_clamp16(min), hi = analytics_clamp16(max);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        v16hi v;
+        memcpy(&v, values + i, sizeof(v));
+        v16hi m = analytics_window16(times + i, from, window)
+                & (v != (int16_t) HISTORY_MISSING) & (v >= lo) & (v <= hi);
+        v16hu bin = ((v16hu) v - (uint16_t) lo) & (v16hu) m;
+        for (int k = 0; k < 16; k++)
+            bins[bin[k] * ANALYTICS_COPIES + k % ANALYTICS_COPIES] -= m[k];
+    }
+    analytics_histogram_scalar(times + i, values + i, n - i, from, to, min, max, bins);
+}
+
+ANALYTICS_AVX2
+static void analytics_correlate_avx2(const uint32_t* times, const int16_t* x, const int16_t* y,
+        int n, uint32_t from, uint32_t to, analytics_moments* m) {
+    // products need 32 bits and their sums 64, so 8 slots at a time
+    const int32_t window = (to - from) ^ ANALYTICS_SIGN;
+    int i = 0;
+    while (i + 8 <= n) {
+        v8si vcount = {}, sx = {}, sy = {};
+        v4di sxx = {}, syy = {}, sxy = {};
+        for (int b = 0; b < ANALYTICS_BLOCK && i + 8 <= n; b++, i += 8) {
+            v8su t;
+            v8hi vx, vy;
+            memcpy(&t, times + i, sizeof(t));
+            memcpy(&vx, x + i, sizeof(vx));
+            memcpy(&vy, y + i, sizeof(vy));
+            v8hi mask = __builtin_convertvector((v8si) ((t - from) ^ ANALYTICS_SIGN) <= window, v8hi)
+                    & (vx != (int16_t) HISTORY_MISSING) & (vy != (int16_t) HISTORY_MISSING);
+            v8si xs = __builtin_convertvector(vx & mask, v8si);
+            v8si ys = __builtin_convertvector(vy & mask, v8si);
+            v8si xx = xs * xs, yy = ys * ys, xy = xs * ys;
+            vcount -= __builtin_convertvector(mask, v8si);
+            sx += xs;
+            sy += ys;
+            sxx += __builtin_convertvector(__builtin_shufflevector(xx, xx, 0, 1, 2, 3), v4di)
+                    + __builtin_convertvector(__builtin_shufflevector(xx, xx, 4, 5, 6, 7), v4di);
+            syy += __builtin_convertvector(__builtin_shufflevector(yy, yy, 0, 1, 2, 3), v4di)
+                    + __builtin_convertvector(__builtin_shufflevector(yy, yy, 4, 5, 6, 7), v4di);
+            sxy += __builtin_convertvector(__builtin_shufflevector(xy, xy, 0, 1, 2, 3), v4di)
+                    + __builtin_convertvector(__builtin_shufflevector(xy, xy, 4, 5, 6, 7), v4di);
+        }
+        for (int k = 0; k < 8; k++) {
+            m->count += vcount[k];
+            m->sx += sx[k];
+            m->sy += sy[k];
+        }
+        for (int k = 0; k < 4; k++) {
+            m->sxx += sxx[k];
+            m->syy += syy[k];
+            m->sxy += sxy[k];
+        }
+    }
+    analytics_correlate_scalar(times + i, x + i, y + i, n - i, from, to, m);
+}
+
+ANALYTICS_SCALAR
+static void analytics_summarize_scalar(const uint32_t* times, const int16_t* values, int n,
+        uint32_t from, uint32_t to, int threshold, analytics_summary* s) {
+    for (int i = 0; i < n; i++) {
+        int v = values[i];
+        if (times[i] < from || times[i] > to || v == HISTORY_MISSING)
+            continue;
+        if (v < s->min)
+            s->min = v;
+        if (v > s->max)
+            s->max = v;
+        s->sum += v;
+        s->count++;
+        if (v > threshold)
+            s->above++;
+    }
+}
+
+ANALYTICS_SCALAR
+static void analytics_histogram_scalar(const uint32_t* times, const int16_t* values, int n,
+        uint32_t from, uint32_t to, int min, int max, uint32_t* bins) {
+    for (int i = 0; i < n; i++) {
+        int v = values[i];
+        if (times[i] >= from && times[i] <= to && v != HISTORY_MISSING && v >= min && v <= max)
+            bins[(v - min) * ANALYTICS_COPIES]++;
+    }
+}
+
+ANALYTICS_SCALAR
+static void analytics_correlate_scalar(const uint32_t* times, const int16_t* x, const int16_t* y,
+        int n, uint32_t from, uint32_t to, analytics_moments* m) {
+    for (int i = 0; i < n; i++) {
+        if (times[i] < from || times[i] > to || x[i] == HISTORY_MISSING || y[i] == HISTORY_MISSING)
+            continue;
+        m->count++;
+        m->sx += x[i];
+        m->sy += y[i];
+        m->sxx += x[i] * x[i];
+        m->syy += y[i] * y[i];
+        m->sxy += x[i] * y[i];
+    }
+}
+
+/* One histogram over [min, max] of s, then one walk over it for every
+ * rank: the smallest value with at least pct% of the values at or below. */
+static int analytics_ranks(analytics_histogram_fn histogram, const analytics_span* spans,
+        int span_count, uint32_t from, uint32_t to, const analytics_summary* s, const int* pcts,
+        int* results, int count) {
+    for (int p = 0; p < count; p++)
+        results[p] = HISTORY_MISSING;
+    if (s->count == 0)
+        return 0;
+    long range = (long) s->max - s->min + 1;
+    uint32_t* bins = calloc(range * ANALYTICS_COPIES, sizeof(uint32_t));
+    if (bins == NULL)
+        return -1;
+    for (int i = 0; i < span_count; i++)
+        histogram(spans[i].times, spans[i].values, spans[i].n, from, to, s->min, s->max, bins);
+    long seen = 0;
+    int p = 0;
+    for (long b = 0; b < range && p < count; b++) {
+        for (int k = 0; k < ANALYTICS_COPIES; k++)
+            seen += bins[b * ANALYTICS_COPIES + k];
+        while (p < count && seen >= (s->count * pcts[p] + 99) / 100)
+            results[p++] = s->min + b;
+    }
+    free(bins);
+    return 0;
+}
+
+static int16_t analytics_clamp16(int value) {
+    return value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : value;
+}
@@ -0,0 +1,74 @@
+/*
+ ============================================================================
+ Name        : analytics.h
+ Description : Vectorised kernels over history columns
+ ============================================================================
+
+ "clevo-indicator history --stats" summarises a period of the history: the
+ minimum, maximum, mean and percentiles of each column, the time spent
+ above a temperature and how closely each fan's duty follows its
+ temperature. The history keeps every column as a contiguous array of
+ 16-bit tenths next to an array of slot start times, so each of those is
+ one pass over plain arrays, done here 16 slots at a time with GCC vector
+ extensions. A slot counts when its start time lies in the period and its
+ value isn't HISTORY_MISSING, worked out as a lane mask rather than a
+ branch.
+
+ The kernels use AVX2 when the CPU has it and plain loops otherwise,
+ checked on first use. Percentiles come from one histogram pass over the
+ value range the summary found, which every requested rank is then read
+ from. "clevo-indicator bench-history [days]" runs the kernels and the
+ scalar loops over that many days of made-up per-second data.
+ */
+
+#ifndef CLEVO_ANALYTICS_H
+#define CLEVO_ANALYTICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Sums to add up over the pieces of a period; values in tenths. */
+typedef struct {
+    long count;
+    int min;
+    int max;
+    int64_t sum;
+    long above;         /* values over the threshold */
+} analytics_summary;
+
+typedef struct {
+    long count;
+    int64_t sx, sy, sxx, syy, sxy;
+} analytics_moments;
+
+/* A run of consecutive slots; a period that wraps around the end of a
+ * tier is two. */
+typedef struct {
+    const uint32_t* times;
+    const int16_t* values;
+    int n;
+} analytics_span;
+
+void analytics_summary_init(analytics_summary* s);
+
+/* Add the n slots from times/values with a start time in [from, to] to s. */
+void analytics_summarize(const uint32_t* times, const int16_t* values, int n,
+        uint32_t from, uint32_t to, int threshold, analytics_summary* s);
+
+/* The pcts[i]-th percentiles (ascending) of the spans' values in
+ * [from, to], whose count, minimum and maximum are in s, into results;
+ * HISTORY_MISSING when there are none. Returns -1 when out of memory. */
+int analytics_percentiles(const analytics_span* spans, int span_count, uint32_t from, uint32_t to,
+        const analytics_summary* s, const int* pcts, int* results, int count);
+
+/* Add the slots where both x and y were recorded to m. */
+void analytics_correlate(const uint32_t* times, const int16_t* x, const int16_t* y, int n,
+        uint32_t from, uint32_t to, analytics_moments* m);
+
+/* Pearson correlation of the moments, NaN when undefined. */
+double analytics_pearson(const analytics_moments* m);
+
+/* Time the kernels against scalar loops over days of per-second data. */
+int analytics_bench(int days, FILE* out);
+
+#endif
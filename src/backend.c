@@ -0,0 +1,426 @@
+/*
+ ============================================================================
+ Name        : backend.c
+ Description : Fan and temperature access with failover between backends
+ ============================================================================
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/io.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "ctl.h"
+#include "ec.h"
+#include "hwmon.h"
+#include "util.h"
+
+#define BACKEND_MAX_READS 16
+#define BACKEND_EC_SYS_PATH "/sys/kernel/debug/ec/ec0/io"
+#define BACKEND_EC_SYS_GAP 2
+#define BACKEND_EC_SYS_RETIRED 4
+#define BACKEND_HWMON_CHIP "clevo_xsm_wmi"
+
+#define BIT(value) (1u << (value))
+#define BACKEND_ALL_VALUES (BIT(BACKEND_VALUE_COUNT) - 1)
+
+typedef struct {
+    const char* name;
+    unsigned values;            /* readable backend_values */
+    int (*probe)(void);
+    int (*read)(const backend_value* what, int* values, int count);
+    int (*write_duty)(int fan, int duty_percentage);    /* NULL: read-only */
+    int healthy;
+    int failures;               /* in a row */
+    uint64_t last_probe_us;
+    unsigned long reads;
+    unsigned long read_errors;
+    unsigned long writes;
+    unsigned long write_errors;
+    unsigned long downs;
+} backend;
+
+static int ports_probe(void);
+static int ports_read(const backend_value* what, int* values, int count);
+static int ports_write_duty(int fan, int duty_percentage);
+static int ec_sys_probe(void);
+static int ec_sys_read(const backend_value* what, int* values, int count);
+static int hwmon_probe(void);
+static int hwmon_backend_read(const backend_value* what, int* values, int count);
+static int hwmon_write_duty(int fan, int duty_percentage);
+static void backend_result(backend* b, int ok, int write);
+static void backend_command(const char* args, FILE* out);
+
+static backend backends[BACKEND_COUNT] = {
+        { "ports", BACKEND_ALL_VALUES, &ports_probe, &ports_read,
+                &ports_write_duty },
+        { "ec_sys", BACKEND_ALL_VALUES, &ec_sys_probe, &ec_sys_read, NULL },
+        { "hwmon", BACKEND_ALL_VALUES & ~BIT(BACKEND_GPU_TEMP), &hwmon_probe,
+                &hwmon_backend_read, &hwmon_write_duty },
+};
+
+static backend_id backend_read_order[BACKEND_COUNT] = {
+        BACKEND_PORTS, BACKEND_EC_SYS, BACKEND_HWMON
+};
+static backend_id backend_write_order[BACKEND_COUNT] = {
+        BACKEND_PORTS, BACKEND_EC_SYS, BACKEND_HWMON
+};
+
+/* Guards the health state and the ec_sys fd; the I/O itself runs
+ * unlocked. */
+static pthread_mutex_t backend_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ports_permitted = 0;
+static int ec_sys_fd = -1;
+/* A re-probe may replace ec_sys_fd while a read is still using the old
+ * one; replaced fds are closed by the last reader to finish. */
+static int ec_sys_readers = 0;
+static int ec_sys_retired[BACKEND_EC_SYS_RETIRED];
+static int ec_sys_retired_count = 0;
+static hwmon_ref hwmon_refs[BACKEND_VALUE_COUNT];
+
+static const uint8_t ec_value_regs[BACKEND_VALUE_COUNT] = {
+        EC_REG_CPU_TEMP, EC_REG_GPU_TEMP,
+        EC_REG_CPU_FAN_DUTY, EC_REG_GPU_FAN_DUTY,
+        EC_REG_CPU_FAN_RPMS_HI, EC_REG_GPU_FAN_RPMS_HI
+};
+
+int backend_init(int flags) {
+    // hwmon first if preferred, then ec_sys for reads if asked, then ports
+    int n = 0;
+    if (flags & BACKEND_PREFER_HWMON)
+        backend_read_order[n++] = BACKEND_HWMON;
+    if (flags & BACKEND_KERNEL_READS)
+        backend_read_order[n++] = BACKEND_EC_SYS;
+    backend_read_order[n++] = BACKEND_PORTS;
+    if (!(flags & BACKEND_KERNEL_READS))
+        backend_read_order[n++] = BACKEND_EC_SYS;
+    if (!(flags & BACKEND_PREFER_HWMON))
+        backend_read_order[n++] = BACKEND_HWMON;
+    if (flags & BACKEND_PREFER_HWMON) {
+        backend_write_order[0] = BACKEND_HWMON;
+        backend_write_order[1] = BACKEND_PORTS;
+        backend_write_order[2] = BACKEND_EC_SYS;
+    }
+    hwmon_ref_init(&hwmon_refs[BACKEND_CPU_TEMP], BACKEND_HWMON_CHIP, 0, HWMON_TEMP, 1);
+    hwmon_ref_init(&hwmon_refs[BACKEND_CPU_DUTY], BACKEND_HWMON_CHIP, 0, HWMON_PWM, 1);
+    hwmon_ref_init(&hwmon_refs[BACKEND_GPU_DUTY], BACKEND_HWMON_CHIP, 0, HWMON_PWM, 2);
+    hwmon_ref_init(&hwmon_refs[BACKEND_CPU_RPMS], BACKEND_HWMON_CHIP, 0, HWMON_FAN, 1);
+    hwmon_ref_init(&hwmon_refs[BACKEND_GPU_RPMS], BACKEND_HWMON_CHIP, 0, HWMON_FAN, 2);
+
+    int usable = 0;
+    uint64_t now = util_now_us();
+    for (int i = 0; i < BACKEND_COUNT; i++) {
+        backend* b = &backends[backend_read_order[i]];
+        b->healthy = b->probe() == 0;
+        b->last_probe_us = now;
+        usable |= b->healthy;
+        printf("EC backend %s: %s\n", b->name, b->healthy ? "ok" : "unavailable");
+    }
+    return usable ? 0 : -1;
+}
+
+int backend_read(const backend_value* what, int* values, int count) {
+    int tried[BACKEND_COUNT] = { 0 };
+    int done[BACKEND_MAX_READS] = { 0 };
+    if (count > BACKEND_MAX_READS)
+        count = BACKEND_MAX_READS;
+    for (int i = 0; i < count; i++)
+        values[i] = -1;
+    for (;;) {
+        // the first value still missing picks the backend for this round
+        backend* b = NULL;
+        pthread_mutex_lock(&backend_lock);
+        for (int i = 0; i < count && b == NULL; i++) {
+            if (done[i])
+                continue;
+            for (int j = 0; j < BACKEND_COUNT; j++) {
+                backend* candidate = &backends[backend_read_order[j]];
+                if (!tried[backend_read_order[j]] && candidate->healthy
+                        && (candidate->values & BIT(what[i]))) {
+                    b = candidate;
+                    tried[backend_read_order[j]] = 1;
+                    break;
+                }
+            }
+        }
+        pthread_mutex_unlock(&backend_lock);
+        if (b == NULL)
+            break;
+
+        backend_value sub_what[BACKEND_MAX_READS];
+        int sub_values[BACKEND_MAX_READS];
+        int index[BACKEND_MAX_READS];
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            if (!done[i] && (b->values & BIT(what[i]))) {
+                sub_what[n] = what[i];
+                index[n++] = i;
+            }
+        }
+        int ok = b->read(sub_what, sub_values, n) == 0;
+        backend_result(b, ok, 0);
+        if (!ok)
+            continue;
+        for (int i = 0; i < n; i++) {
+            values[index[i]] = sub_values[i];
+            done[index[i]] = 1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (!done[i])
+            return -1;
+    }
+    return 0;
+}
+
+int backend_read_one(backend_value what, int* value) {
+    return backend_read(&what, value, 1);
+}
+
+int backend_write_duty(int fan, int duty_percentage) {
+    for (int i = 0; i < BACKEND_COUNT; i++) {
+        backend* b = &backends[backend_write_order[i]];
+        pthread_mutex_lock(&backend_lock);
+        int usable = b->healthy && b->write_duty != NULL;
+        pthread_mutex_unlock(&backend_lock);
+        if (!usable)
+            continue;
+        int ok = b->write_duty(fan, duty_percentage) == 0;
+        backend_result(b, ok, 1);
+        if (ok)
+            return 0;
+    }
+    return -1;
+}
+
+void backend_check(void) {
+    uint64_t now = util_now_us();
+    for (int i = 0; i < BACKEND_COUNT; i++) {
+        backend* b = &backends[i];
+        pthread_mutex_lock(&backend_lock);
+        int due = !b->healthy
+                && now - b->last_probe_us >= (uint64_t) BACKEND_PROBE_MS * 1000;
+        if (due)
+            b->last_probe_us = now;
+        pthread_mutex_unlock(&backend_lock);
+        if (!due || b->probe() != 0)
+            continue;
+        pthread_mutex_lock(&backend_lock);
+        b->healthy = 1;
+        b->failures = 0;
+        pthread_mutex_unlock(&backend_lock);
+        printf("EC backend %s recovered\n", b->name);
+    }
+}
+
+const char* backend_active_name(void) {
+    const char* name = "none";
+    pthread_mutex_lock(&backend_lock);
+    for (int i = 0; i < BACKEND_COUNT; i++) {
+        backend* b = &backends[backend_read_order[i]];
+        if (b->healthy && (b->values & BIT(BACKEND_CPU_TEMP))) {
+            name = b->name;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&backend_lock);
+    return name;
+}
+
+void backend_register(void) {
+    ctl_register("backend", "EC access backends, their health and failovers",
+            &backend_command);
+}
+
+static void backend_result(backend* b, int ok, int write) {
+    pthread_mutex_lock(&backend_lock);
+    if (write) {
+        b->writes++;
+        b->write_errors += !ok;
+    } else {
+        b->reads++;
+        b->read_errors += !ok;
+    }
+    if (ok) {
+        b->failures = 0;
+    } else if (++b->failures >= BACKEND_FAIL_LIMIT && b->healthy) {
+        b->healthy = 0;
+        b->downs++;
+        b->last_probe_us = util_now_us();
+        printf("EC backend %s failed %d times, failing over\n", b->name,
+                b->failures);
+    }
+    pthread_mutex_unlock(&backend_lock);
+}
+
+static int ports_probe(void) {
+    if (!ports_permitted) {
+        if (ioperm(EC_DATA, 1, 1) != 0 || ioperm(EC_SC, 1, 1) != 0)
+            return -1;
+        ports_permitted = 1;
+    }
+    uint8_t value;
+    return ec_read(EC_REG_CPU_TEMP, &value) == EC_OK ? 0 : -1;
+}
+
+static int ports_read(const backend_value* what, int* values, int count) {
+    uint8_t regs[BACKEND_MAX_READS * 2] = { 0 };
+    uint8_t raw[BACKEND_MAX_READS * 2];
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        regs[n++] = ec_value_regs[what[i]];
+        if (what[i] == BACKEND_CPU_RPMS || what[i] == BACKEND_GPU_RPMS)
+            regs[n++] = ec_value_regs[what[i]] + 1;
+    }
+    if (ec_read_batch(regs, raw, n) != EC_OK)
+        return -1;
+    n = 0;
+    for (int i = 0; i < count; i++) {
+        if (what[i] == BACKEND_CPU_RPMS || what[i] == BACKEND_GPU_RPMS) {
+            values[i] = ec_fan_rpms(raw[n], raw[n + 1]);
+            n += 2;
+        } else if (what[i] == BACKEND_CPU_DUTY || what[i] == BACKEND_GPU_DUTY) {
+            values[i] = ec_fan_duty(raw[n++]);
+        } else {
+            values[i] = raw[n++];
+        }
+    }
+    return 0;
+}
+
+static int ports_write_duty(int fan, int duty_percentage) {
+    return ec_write(EC_CMD_FAN_DUTY, fan + 1, ec_fan_duty_raw(duty_percentage))
+            == EC_OK ? 0 : -1;
+}
+
+static int ec_sys_probe(void) {
+    char path[UTIL_PATH_MAX];
+    util_path(path, sizeof(path), BACKEND_EC_SYS_PATH);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    uint8_t value;
+    if (fd < 0)
+        return -1;
+    if (pread(fd, &value, 1, EC_REG_CPU_TEMP) != 1) {
+        close(fd);
+        return -1;
+    }
+    pthread_mutex_lock(&backend_lock);
+    int old_fd = ec_sys_fd;
+    if (old_fd >= 0 && ec_sys_readers > 0) {
+        if (ec_sys_retired_count == BACKEND_EC_SYS_RETIRED) {
+            // reads stuck on every fd so far, try again at the next probe
+            pthread_mutex_unlock(&backend_lock);
+            close(fd);
+            return -1;
+        }
+        ec_sys_retired[ec_sys_retired_count++] = old_fd;
+        old_fd = -1;
+    }
+    ec_sys_fd = fd;
+    pthread_mutex_unlock(&backend_lock);
+    if (old_fd >= 0)
+        close(old_fd);
+    return 0;
+}
+
+/* One pread() per run of nearby registers. ec_sys turns every byte into an
+ * EC transaction of its own, serialised with the kernel's EC traffic, so
+ * runs only bridge gaps of up to BACKEND_EC_SYS_GAP unwanted bytes. */
+static int ec_sys_read(const backend_value* what, int* values, int count) {
+    pthread_mutex_lock(&backend_lock);
+    int fd = ec_sys_fd;
+    ec_sys_readers++;
+    pthread_mutex_unlock(&backend_lock);
+
+    int result = 0;
+    uint8_t raw[EC_REG_SIZE];
+    uint8_t wanted[EC_REG_SIZE] = { 0 };
+    for (int i = 0; i < count; i++) {
+        int reg = ec_value_regs[what[i]];
+        wanted[reg] = 1;
+        if (what[i] == BACKEND_CPU_RPMS || what[i] == BACKEND_GPU_RPMS)
+            wanted[reg + 1] = 1;
+    }
+    for (int reg = 0; reg < EC_REG_SIZE && result == 0; reg++) {
+        if (!wanted[reg])
+            continue;
+        int end = reg, gap = 0;
+        for (int next = reg + 1; next < EC_REG_SIZE && gap <= BACKEND_EC_SYS_GAP; next++) {
+            if (wanted[next]) {
+                end = next;
+                gap = 0;
+            } else {
+                gap++;
+            }
+        }
+        ssize_t size = end - reg + 1;
+        if (pread(fd, raw + reg, size, reg) != size)
+            result = -1;
+        reg = end;
+    }
+
+    pthread_mutex_lock(&backend_lock);
+    if (--ec_sys_readers == 0) {
+        for (int i = 0; i < ec_sys_retired_count; i++)
+            close(ec_sys_retired[i]);
+        ec_sys_retired_count = 0;
+    }
+    pthread_mutex_unlock(&backend_lock);
+    if (result != 0)
+        return result;
+    for (int i = 0; i < count; i++) {
+        int reg = ec_value_regs[what[i]];
+        if (what[i] == BACKEND_CPU_RPMS || what[i] == BACKEND_GPU_RPMS)
+            values[i] = ec_fan_rpms(raw[reg], raw[reg + 1]);
+        else if (what[i] == BACKEND_CPU_DUTY || what[i] == BACKEND_GPU_DUTY)
+            values[i] = ec_fan_duty(raw[reg]);
+        else
+            values[i] = raw[reg];
+    }
+    return 0;
+}
+
+static int hwmon_probe(void) {
+    long value;
+    hwmon_check();
+    return hwmon_ref_read(&hwmon_refs[BACKEND_CPU_TEMP], &value);
+}
+
+static int hwmon_backend_read(const backend_value* what, int* values,
+        int count) {
+    for (int i = 0; i < count; i++) {
+        long value;
+        if (hwmon_ref_read(&hwmon_refs[what[i]], &value) != 0)
+            return -1;
+        if (what[i] == BACKEND_CPU_TEMP)
+            values[i] = value / 1000;
+        else if (what[i] == BACKEND_CPU_DUTY || what[i] == BACKEND_GPU_DUTY)
+            values[i] = ec_fan_duty(value);
+        else
+            values[i] = value;
+    }
+    return 0;
+}
+
+static int hwmon_write_duty(int fan, int duty_percentage) {
+    return hwmon_ref_write(&hwmon_refs[fan ? BACKEND_GPU_DUTY : BACKEND_CPU_DUTY],
+            ec_fan_duty_raw(duty_percentage));
+}
+
+static void backend_command(const char* args, FILE* out) {
+    fprintf(out, "active %s\n", backend_active_name());
+    pthread_mutex_lock(&backend_lock);
+    for (int i = 0; i < BACKEND_COUNT; i++) {
+        backend* b = &backends[backend_read_order[i]];
+        fprintf(out, "%s healthy %d failures %d reads %lu read_errors %lu "
+                "writes %lu write_errors %lu downs %lu%s\n", b->name,
+                b->healthy, b->failures, b->reads, b->read_errors, b->writes,
+                b->write_errors, b->downs, b->write_duty == NULL ? " read-only" : "");
+    }
+    pthread_mutex_unlock(&backend_lock);
+}
@@ -0,0 +1,72 @@
+/*
+ ============================================================================
+ Name        : backend.h
+ Description : Fan and temperature access with failover between backends
+ ============================================================================
+
+ Three backends reach the same EC, in order of preference:
+
+ 1. port I/O: the EC protocol on ports 0x62/0x66 (needs ioperm), reads and
+    the 0x99 fan duty command;
+ 2. ec_sys: /sys/kernel/debug/ec/ec0/io, register reads only;
+ 3. hwmon: the clevo_xsm_wmi driver, CPU temperature, fan duties and RPMs.
+
+ Auto mode reads through ec_sys first (BACKEND_KERNEL_READS): the kernel's
+ ACPI EC driver then serialises our reads with its own traffic, and a
+ pread() of the kept-open file covers a whole run of registers. Raw ports
+ remain for the 0x99 fan duty command, which ec_sys cannot send.
+
+ Every read and write goes to the first healthy backend that supports it.
+ A backend that fails BACKEND_FAIL_LIMIT times in a row is marked down and
+ the same call is repeated on the next one, so control carries on without a
+ blind tick. backend_check() probes the backends that are down every
+ BACKEND_PROBE_MS; once one answers it is healthy again and, being earlier
+ in the order, takes over again (fail-back).
+ */
+
+#ifndef CLEVO_BACKEND_H
+#define CLEVO_BACKEND_H
+
+typedef enum {
+    BACKEND_PORTS = 0, BACKEND_EC_SYS, BACKEND_HWMON, BACKEND_COUNT
+} backend_id;
+
+typedef enum {
+    BACKEND_CPU_TEMP = 0,   /* °C */
+    BACKEND_GPU_TEMP,       /* °C */
+    BACKEND_CPU_DUTY,       /* % */
+    BACKEND_GPU_DUTY,       /* % */
+    BACKEND_CPU_RPMS,
+    BACKEND_GPU_RPMS,
+    BACKEND_VALUE_COUNT
+} backend_value;
+
+#define BACKEND_FAIL_LIMIT 3
+#define BACKEND_PROBE_MS 5000
+
+/* backend_init() flags */
+#define BACKEND_PREFER_HWMON 1  /* hwmon first for everything (USE_HWMON=1) */
+#define BACKEND_KERNEL_READS 2  /* ec_sys before ports for reads (auto mode) */
+
+/* Probe every backend. Returns 0 when at least one backend works. */
+int backend_init(int flags);
+
+/* Read count values, each from the first healthy backend providing it.
+ * Values no backend could provide are set to -1. Returns 0 when every value
+ * was read, -1 otherwise. */
+int backend_read(const backend_value* what, int* values, int count);
+int backend_read_one(backend_value what, int* value);
+
+/* fan 0 is the CPU fan, 1 the GPU fan. Returns 0 or -1. */
+int backend_write_duty(int fan, int duty_percentage);
+
+/* Probe backends that are down; call every few hundred milliseconds. */
+void backend_check(void);
+
+/* Name of the backend that currently serves the CPU temperature. */
+const char* backend_active_name(void);
+
+/* Register the "backend" socket command. */
+void backend_register(void);
+
+#endif
@@ -34,6 +34,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -42,67 +43,110 @@
 #include <sys/io.h>
 #include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <libappindicator/app-indicator.h>
 
-#define NAME "clevo-indicator"
-
-#define EC_SC 0x66
-#define EC_DATA 0x62
+#include "acquire.h"
+#include "analytics.h"
+#include "backend.h"
+#include "ctl.h"
+#include "ec.h"
+#include "expr.h"
+#include "fantable.h"
+#include "governor.h"
+#include "headroom.h"
+#include "history.h"
+#include "heat.h"
+#include "hwmon.h"
+#include "pipeline.h"
+#include "residency.h"
+#include "resume.h"
+#include "power.h"
+#include "procwatch.h"
+#include "quantile.h"
+#include "rpmtarget.h"
+#include "sensors.h"
+#include "shed.h"
+#include "trace.h"
+#include "util.h"
 
-#define IBF 1
-#define OBF 0
-#define EC_SC_READ_CMD 0x80
-
-/* EC registers can be read by EC_SC_READ_CMD or /sys/kernel/debug/ec/ec0/io:
- *
- * 1. modprobe ec_sys
- * 2. od -Ax -t x1 /sys/kernel/debug/ec/ec0/io
- */
+#define NAME "clevo-indicator"
 
-#define P775DM3 //THIS IS THE MODEL DEFINITION, TO FIND THE ADDRESSES IN THE EC
+#define TEMP_FAIL_THRESHOLD 15
 
-#define EC_REG_SIZE 0x100
+/* Acquisition deadlines: the GPU stream comes from "nvidia-smi -l 3". */
+#define ACQ_EC_PERIOD_MS 500
+#define ACQ_EC_STALE_MS 2000
+#define ACQ_GPU_STALE_MS 4500
+#define ACQ_GPU_MISSING_MS 6000
+#define ACQ_GPU_MAX_EXTRAPOLATION 5.0
+#define ACQ_SENSORS_PERIOD_MS 1000
+#define ACQ_SENSORS_STALE_MS 5000
+#define ACQ_STALE_DUTY 70
 
-#define EC_REG_CPU_FAN_DUTY 0xCE
-#define EC_REG_CPU_TEMP 0x07
-#define EC_REG_CPU_FAN_RPMS_HI 0xD0
-#define EC_REG_CPU_FAN_RPMS_LO 0xD1
-#define EC_REG_GPU_FAN_RPMS_HI 0xD2
-#define EC_REG_GPU_FAN_RPMS_LO 0xD3
-#define EC_REG_GPU_TEMP 0xCD
-#define EC_REG_GPU_FAN_DUTY 0xCF
+/* Auto mode pipeline: one frame per tick, queues of a few ticks. */
+#define PIPE_TICK_MS 1000
+#define PIPE_FRAMES 4
+#define PIPE_COMMANDS 8
 
-#define MAX_FAN_RPM 4400.0
-
-#define TEMP_FAIL_THRESHOLD 15
+#define HEAT_RAMP_STEP 10
+#define HEAT_RAMP_LOG_INTERVAL 30
 
 typedef enum {
     NA = 0, AUTO = 1, MANUAL = 2
 } MenuItemType;
 
-int use_hwmon_interface = 0;
-int hwmon_interface_num = 0;
+/* Acquisition -> control: the freshest values of every source. */
+typedef struct {
+    acquire_sample ec;
+    acquire_sample gpu;
+    acquire_sample extra;
+    int ec_fresh;
+    int gpu_fresh;
+    int extra_fresh;
+    uint64_t time_us;
+} auto_frame;
+
+/* Control -> actuation: fan duties to write and verify. */
+typedef struct {
+    int duty[2];
+    int set[2];
+    uint32_t trace[2];
+    uint64_t time_us;
+} auto_command;
+
+/* Variables of the fan rules, then one per extra sensor. */
+enum {
+    RULE_CPU = 0, RULE_GPU, RULE_CPU_PKG, RULE_AC, RULE_BATTERY, RULE_HEAVY, RULE_VARS
+};
+
+int use_perf_governor = 0;
+int use_heat_attribution = 0;
 
 static void main_init_share(void);
 static int main_ec_worker(void);
 static void main_ui_worker(int argc, char** argv);
 static void main_on_sigchld(int signum);
 static void main_on_sigterm(int signum);
+static void auto_on_sigterm(int signum);
 static int main_dump_fan(void);
 static int main_test_cpu_fan(int duty_percentage);
 static int main_test_gpu_fan(int duty_percentage);
+static int main_characterize(void);
+static void characterize_on_sigterm(int signum);
 static gboolean ui_update(gpointer user_data);
 static void ui_command_set_fan(long fan_duty);
 static void ui_command_quit(gchar* command);
 static void ui_toggle_menuitems(int fan_duty);
 static void ec_on_sigterm(int signum);
-static int ec_init(void);
 static int ec_auto_duty_adjust(void);
+static int ec_query(backend_value what);
 static int ec_query_cpu_temp(void);
 static int ec_query_gpu_temp(void);
 static int ec_query_cpu_fan_duty(void);
@@ -111,16 +155,38 @@ static int ec_query_gpu_fan_duty(void);
 static int ec_query_gpu_fan_rpms(void);
 static int ec_write_cpu_fan_duty(int duty_percentage);
 static int ec_write_gpu_fan_duty(int duty_percentage);
-static int ec_io_wait(const uint32_t port, const uint32_t flag,
-        const char value);
-static uint8_t ec_io_read(const uint32_t port);
-static int ec_io_do(const uint32_t cmd, const uint32_t port,
-        const uint8_t value);
-static int calculate_fan_duty(int raw_duty);
-static int calculate_fan_rpms(int raw_rpm_high, int raw_rpm_low);
 static int check_proc_instances(const char* proc_name);
+static int load_ec_sys(void);
 static void get_time_string(char* buffer, size_t max, const char* format);
 static void signal_term(__sighandler_t handler);
+static int auto_read_ec(double* values, void* arg);
+static int auto_read_gpu(double* values, void* arg);
+static int auto_read_sensors(double* values, void* arg);
+static void* auto_acquire_stage(void* arg);
+static void* auto_actuate_stage(void* arg);
+static void auto_write_duty(int fan, int duty, uint32_t trace);
+static void auto_wait_settled(int fan, int duty, uint32_t trace);
+static void auto_fan_command(const char* args, FILE* out);
+static void auto_trim_rpm(const int* target_rpm, int* duty);
+static void auto_rules_compile(const char (*text)[256], expr_env* env, const sensor_config* sensors, int sensor_count);
+static void auto_rules_command(const char* args, FILE* out);
+
+static int auto_ec_id = -1;
+static int auto_gpu_id = -1;
+static int auto_sensors_id = -1;
+static pipeline_queue auto_frames;
+static pipeline_queue auto_commands;
+static int auto_stage_acquire = -1;
+static int auto_stage_control = -1;
+static int auto_stage_actuate = -1;
+static int auto_socket_duty[2] = { -1, -1 };
+static uint32_t auto_socket_trace[2] = { 0, 0 };
+static expr_env auto_rule_env;
+static expr_program auto_rules[2];
+static char auto_rule_text[2][256];
+static int auto_rule_sensor[SENSORS_MAX];     /* variable of each sensor, -1 for none */
+static double auto_rule_vars[EXPR_MAX_VARS];
+static double auto_rule_value[2];
 
 static AppIndicator* indicator = NULL;
 
@@ -155,6 +221,7 @@ struct {
     volatile int auto_duty_val;
     volatile int manual_next_fan_duty;
     volatile int manual_prev_fan_duty;
+    volatile uint64_t manual_trace_us;
 }static *share_info = NULL;
 
 static pid_t parent_pid = 0;
@@ -174,13 +241,9 @@ void autoset_cpu_gpu()
     double lastCPU = 0., lastGPU = 0.;
     int repeatCheck[2] = {0, 0};
     int lastfail = 0;
-    int missing = 0;
-
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
+    uint64_t gpu_seen_us = util_now_us();
+    int gpu_from_ec = 0;
+    int rpm_mode = 0;
     FILE* ctrl_file = NULL;
 
     static int ctrl_setting_offset_cpu = 0;
@@ -189,33 +252,130 @@ void autoset_cpu_gpu()
     static int ctrl_setting_min_gpu = 0;
     static int ctrl_setting_force_cpu = -1;
     static int ctrl_setting_force_gpu = -1;
+    static governor_config ctrl_setting_governor = GOVERNOR_DEFAULT_CONFIG;
+    static shed_config ctrl_setting_shed = SHED_DEFAULT_CONFIG;
+    static sensor_config ctrl_setting_sensors[SENSORS_MAX];
+    static int ctrl_setting_sensor_count = 0;
+    static ec_policy ctrl_setting_ec = EC_DEFAULT_POLICY;
+    static int ctrl_setting_rpm_full = 0;
+    static power_profile ctrl_setting_power[POWER_SOURCES] = { POWER_DEFAULT_AC, POWER_DEFAULT_BATTERY };
+    static procwatch_config ctrl_setting_procwatch = PROCWATCH_DEFAULT_CONFIG;
+    static char ctrl_setting_rule[2][256];
+    static expr_env ctrl_setting_rule_env;
+    int power_applied = -1, power_sample_ms = 0;
+
+    if (use_perf_governor && governor_init(&ctrl_setting_governor) == 0) atexit(governor_release);
+    atexit(shed_release);
+    if (fantable_load(fantable_path()) == 0) printf("using fan table %s\n", fantable_path());
+    signal_term(&auto_on_sigterm);
+    if (ctl_open() == 0)
+    {
+        atexit(ctl_close);
+        headroom_register();
+        hwmon_register();
+        sensors_register();
+        ec_register();
+        backend_register();
+        fantable_register();
+        rpmtarget_register();
+        trace_register();
+        power_register();
+        procwatch_register();
+        residency_register();
+        quantile_register();
+        ctl_register("rules", "fan rules, their bytecode and last values", &auto_rules_command);
+        ctl_register("fan", "<cpu|gpu|both> <duty|auto> set fan duty, overriding the curves", &auto_fan_command);
+    }
+    if (use_heat_attribution && heat_init() == 0) heat_register();
+    if (power_init() == 0) atexit(power_close);
+    if (history_open(history_path()) == 0) atexit(history_close);
+    resume_init();
+
+    acquire_source_config ec_source = { "ec", &auto_read_ec, NULL, ACQ_EC_PERIOD_MS, ACQ_EC_PERIOD_MS, ACQ_EC_STALE_MS };
+    acquire_source_config gpu_source = { "gpu", &auto_read_gpu, NULL, 0, 0, ACQ_GPU_STALE_MS };
+    acquire_source_config sensors_source = { "sensors", &auto_read_sensors, NULL, ACQ_SENSORS_PERIOD_MS, ACQ_SENSORS_PERIOD_MS, ACQ_SENSORS_STALE_MS };
+    auto_ec_id = acquire_add(&ec_source);
+    auto_gpu_id = acquire_add(&gpu_source);
+    auto_sensors_id = acquire_add(&sensors_source);
+    if (acquire_start() != 0) exit(EXIT_FAILURE);
+    acquire_register();
+
+    // acquisition and actuation run on their own threads, this one controls
+    pthread_t acquire_thread, actuate_thread;
+    if (pipeline_queue_init(&auto_frames, sizeof(auto_frame), PIPE_FRAMES) != 0 || pipeline_queue_init(&auto_commands, sizeof(auto_command), PIPE_COMMANDS) != 0) exit(EXIT_FAILURE);
+    auto_stage_acquire = pipeline_stage_add("acquisition");
+    auto_stage_control = pipeline_stage_add("control");
+    auto_stage_actuate = pipeline_stage_add("actuation");
+    if (pthread_create(&acquire_thread, NULL, &auto_acquire_stage, NULL) != 0 || pthread_create(&actuate_thread, NULL, &auto_actuate_stage, NULL) != 0)
+    {
+        printf("unable to start pipeline stages: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(acquire_thread);
+    pthread_detach(actuate_thread);
+    pipeline_register();
 
     while (1)
     {
-        //printf("Checking\n");
-        if (missing > 5)
+        uint64_t slept_us, resumed_us;
+        if (!initial && resume_check(&slept_us, &resumed_us))
+        {
+            // the EC may be back at its firmware defaults, don't wait for the next decision
+            printf("Resumed after %llu s asleep (noticed within %llu ms), re-applying duties %d %d\n", (unsigned long long) slept_us / 1000000, (unsigned long long) resumed_us / 1000, current[0], current[1]);
+            auto_command command = { { current[0], current[1] }, { 1, 1 }, { 0, 0 }, util_now_us() };
+            for (int i = 0;i < 2;i++) command.trace[i] = trace_begin(TRACE_RESUME, command.time_us);
+            if (pipeline_push(&auto_commands, &command) != 0)
+            {
+                for (int i = 0;i < 2;i++) trace_drop(command.trace[i]);
+                pipeline_stage_drop(auto_stage_control);
+            }
+        }
+        auto_frame frame;
+        if (pipeline_pop(&auto_frames, &frame) != 0)
+        {
+            ctl_wait_fd(pipeline_fd(&auto_frames), PIPE_TICK_MS);
+            pipeline_wait(&auto_frames, 0);
+            continue;
+        }
+        uint64_t control_start = util_now_us();
+        power_update();
+        power_profile* profile = &ctrl_setting_power[power_get()];
+        if ((int) power_get() != power_applied || profile->sample_ms != power_sample_ms)
+        {
+            // a new power source takes effect with this very frame
+            acquire_set_period(auto_ec_id, profile->sample_ms);
+            acquire_set_period(auto_sensors_id, MAX(ACQ_SENSORS_PERIOD_MS, profile->sample_ms));
+            printf("Power source %s: offset %d, sampling %d ms\n", power_name(power_get()), profile->offset, profile->sample_ms);
+            power_applied = power_get();
+            power_sample_ms = profile->sample_ms;
+        }
+        acquire_sample ec = frame.ec, gpu = frame.gpu, extra = frame.extra;
+        int ec_fresh = frame.ec_fresh;
+        int gpu_fresh = frame.gpu_fresh;
+        int extra_fresh = frame.extra_fresh;
+
+        // the EC's own GPU register stands in while nvidia-smi is quiet
+        int ec_gpu_usable = ec_fresh && ec.values[3] >= TEMP_FAIL_THRESHOLD && ec.values[3] < 120;
+        if (gpu.valid) gpu_seen_us = gpu.time_us;
+        if (!ec_gpu_usable && util_now_us() - gpu_seen_us > ACQ_GPU_MISSING_MS * 1000ULL)
         {
             ec_write_gpu_fan_duty(70);
             ec_write_cpu_fan_duty(70);
             exit(1);
         }
+        if (!gpu_fresh && ec_gpu_usable && !gpu_from_ec) printf("GPU temperature stream stale (%llu ms), using EC register\n", (unsigned long long) gpu.age_us / 1000);
+        if (gpu_fresh && gpu_from_ec) printf("GPU temperature stream resumed\n");
+        gpu_from_ec = !gpu_fresh && ec_gpu_usable;
+        int gpu_usable = gpu_fresh || gpu_from_ec;
 
-        char buffer[10];
-        double gputemp;
-        int found = 0;
-        while (!feof(stdin))
-        {
-            FD_SET(STDIN_FILENO, &readfds);
-            if (!select(1, &readfds, NULL, NULL, &timeout)) break;
-            int nRead = read(STDIN_FILENO, buffer, 3);
-            //printf("Read %d\n", nRead);
-            if (nRead == 0) break;
-            found = 1;
-            gputemp = atoi(buffer);
-        };
-
-        if (found)
+        if (gpu.valid || gpu_from_ec)
         {
+            // between stream samples, follow the trend of the last two
+            double gputemp;
+            if (gpu_fresh) gputemp = acquire_extrapolate(&gpu, 0, ACQ_GPU_STALE_MS, ACQ_GPU_MAX_EXTRAPOLATION);
+            else if (gpu_from_ec) gputemp = ec.values[3];
+            else gputemp = gpu.values[0];
+            if (use_heat_attribution) heat_sample();
             static int ctrl_check = 0;
             if (ctrl_check++ >= 3)
             {
@@ -223,31 +383,105 @@ void autoset_cpu_gpu()
                 ctrl_file = fopen("/tmp/clevo_fan_ctrl", "r");
                 if (ctrl_file != NULL)
                 {
-                    while (!feof(ctrl_file))
+                    ctrl_setting_shed.target_count = 0;
+                    ctrl_setting_sensor_count = 0;
+                    ctrl_setting_procwatch.patterns[0] = '\0';
+                    ctrl_setting_rule[0][0] = ctrl_setting_rule[1][0] = '\0';
+                    memset(&ctrl_setting_rule_env, 0, sizeof(ctrl_setting_rule_env));
+                    curve stock;
+                    curve_parse(&stock, EXPR_STOCK_CURVE);
+                    expr_env_curve(&ctrl_setting_rule_env, "curve", &stock);
+                    // cpu.max is written as root, so only a file nobody else can write may name cgroups
+                    struct stat ctrl_stat;
+                    int ctrl_trusted = fstat(fileno(ctrl_file), &ctrl_stat) == 0 && ctrl_stat.st_uid == 0 && (ctrl_stat.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+                    char buffer[1024];
+                    while (fgets(buffer, sizeof(buffer), ctrl_file) != NULL)
                     {
-                        char buffer[1024];
-                        fgets(buffer, 1023, ctrl_file);
                         if (strncmp(buffer, "offset_cpu", 10) == 0) sscanf(buffer, "offset_cpu %d", &ctrl_setting_offset_cpu);
                         if (strncmp(buffer, "offset_gpu", 10) == 0) sscanf(buffer, "offset_gpu %d", &ctrl_setting_offset_gpu);
                         if (strncmp(buffer, "min_cpu", 7) == 0) sscanf(buffer, "min_cpu %d", &ctrl_setting_min_cpu);
                         if (strncmp(buffer, "min_gpu", 7) == 0) sscanf(buffer, "min_gpu %d", &ctrl_setting_min_gpu);
                         if (strncmp(buffer, "force_cpu", 7) == 0) sscanf(buffer, "force_cpu %d", &ctrl_setting_force_cpu);
                         if (strncmp(buffer, "force_gpu", 7) == 0) sscanf(buffer, "force_gpu %d", &ctrl_setting_force_gpu);
+                        if (strncmp(buffer, "gov_trip", 8) == 0) sscanf(buffer, "gov_trip %d", &ctrl_setting_governor.trip_temp);
+                        if (strncmp(buffer, "gov_release", 11) == 0) sscanf(buffer, "gov_release %d", &ctrl_setting_governor.release_temp);
+                        if (strncmp(buffer, "gov_step", 8) == 0) sscanf(buffer, "gov_step %d", &ctrl_setting_governor.step_pct);
+                        if (strncmp(buffer, "gov_floor", 9) == 0) sscanf(buffer, "gov_floor %d", &ctrl_setting_governor.floor_pct);
+                        if (strncmp(buffer, "throttle_temp", 13) == 0)
+                        {
+                            int throttle_temp;
+                            if (sscanf(buffer, "throttle_temp %d", &throttle_temp) == 1) headroom_set_throttle_temp(throttle_temp);
+                        }
+                        if (strncmp(buffer, "shed_trip", 9) == 0) sscanf(buffer, "shed_trip %d", &ctrl_setting_shed.trip_temp);
+                        if (strncmp(buffer, "shed_release", 12) == 0) sscanf(buffer, "shed_release %d", &ctrl_setting_shed.release_temp);
+                        if (strncmp(buffer, "shed_step", 9) == 0) sscanf(buffer, "shed_step %d", &ctrl_setting_shed.step_pct);
+                        if (strncmp(buffer, "ec_retries", 10) == 0) sscanf(buffer, "ec_retries %d", &ctrl_setting_ec.retries);
+                        if (strncmp(buffer, "ec_backoff_ms", 13) == 0) sscanf(buffer, "ec_backoff_ms %d", &ctrl_setting_ec.backoff_ms);
+                        if (strncmp(buffer, "ec_backoff_max_ms", 17) == 0) sscanf(buffer, "ec_backoff_max_ms %d", &ctrl_setting_ec.backoff_max_ms);
+                        if (strncmp(buffer, "ac_offset", 9) == 0) sscanf(buffer, "ac_offset %d", &ctrl_setting_power[POWER_AC].offset);
+                        if (strncmp(buffer, "ac_sample_ms", 12) == 0) sscanf(buffer, "ac_sample_ms %d", &ctrl_setting_power[POWER_AC].sample_ms);
+                        if (strncmp(buffer, "battery_offset", 14) == 0) sscanf(buffer, "battery_offset %d", &ctrl_setting_power[POWER_BATTERY].offset);
+                        if (strncmp(buffer, "battery_sample_ms", 17) == 0) sscanf(buffer, "battery_sample_ms %d", &ctrl_setting_power[POWER_BATTERY].sample_ms);
+                        if (strncmp(buffer, "heavy_duty", 10) == 0) sscanf(buffer, "heavy_duty %d", &ctrl_setting_procwatch.duty);
+                        if (strncmp(buffer, "heavy_hold_s", 12) == 0) sscanf(buffer, "heavy_hold_s %d", &ctrl_setting_procwatch.hold_s);
+                        if (strncmp(buffer, "heavy ", 6) == 0)
+                        {
+                            // several heavy lines add up
+                            size_t used = strlen(ctrl_setting_procwatch.patterns);
+                            snprintf(ctrl_setting_procwatch.patterns + used, sizeof(ctrl_setting_procwatch.patterns) - used, "%.*s ", (int) strcspn(buffer + 6, "\r\n"), buffer + 6);
+                        }
+                        if (strncmp(buffer, "cpu_fan", 7) == 0) sscanf(buffer, "cpu_fan = %255[^\n]", ctrl_setting_rule[0]);
+                        if (strncmp(buffer, "gpu_fan", 7) == 0) sscanf(buffer, "gpu_fan = %255[^\n]", ctrl_setting_rule[1]);
+                        if (strncmp(buffer, "curve ", 6) == 0)
+                        {
+                            char name[EXPR_NAME_MAX];
+                            int consumed;
+                            curve c;
+                            if (sscanf(buffer, "curve %31s %n", name, &consumed) != 1 || curve_parse(&c, buffer + consumed) != 0 || expr_env_curve(&ctrl_setting_rule_env, name, &c) < 0) printf("Invalid curve setting: %s", buffer);
+                        }
+                        if (strncmp(buffer, "rpm_full", 8) == 0) sscanf(buffer, "rpm_full %d", &ctrl_setting_rpm_full);
+                        if (strncmp(buffer, "sensor ", 7) == 0 && ctrl_setting_sensor_count < SENSORS_MAX)
+                        {
+                            if (sensor_config_parse(&ctrl_setting_sensors[ctrl_setting_sensor_count], buffer + 7) == 0) ctrl_setting_sensor_count++;
+                            else printf("Invalid sensor setting: %s", buffer);
+                        }
+                        if (strncmp(buffer, "shed_cgroup", 11) == 0 && !ctrl_trusted)
+                            printf("Ignoring shed_cgroup: /tmp/clevo_fan_ctrl must be owned by root and not group or world writable\n");
+                        else if (strncmp(buffer, "shed_cgroup", 11) == 0 && ctrl_setting_shed.target_count < SHED_MAX_TARGETS)
+                        {
+                            shed_target_config* target = &ctrl_setting_shed.targets[ctrl_setting_shed.target_count];
+                            target->floor_pct = SHED_DEFAULT_FLOOR;
+                            if (sscanf(buffer, "shed_cgroup %255s %d", target->cgroup, &target->floor_pct) >= 1) ctrl_setting_shed.target_count++;
+                        }
+                    }
+                    shed_configure(&ctrl_setting_shed);
+                    ec_configure(&ctrl_setting_ec);
+                    rpmtarget_configure(ctrl_setting_rpm_full);
+                    if (rpmtarget_enabled() != rpm_mode)
+                    {
+                        // switching between duties and RPM targets re-sends both fans
+                        rpm_mode = rpmtarget_enabled();
+                        initial = 1;
+                        printf("RPM targeting %s (rpm_full %d)\n", rpm_mode ? "on" : "off", ctrl_setting_rpm_full);
+                    }
+                    sensors_configure(ctrl_setting_sensors, ctrl_setting_sensor_count);
+                    auto_rules_compile(ctrl_setting_rule, &ctrl_setting_rule_env, ctrl_setting_sensors, ctrl_setting_sensor_count);
+                    procwatch_configure(&ctrl_setting_procwatch);
+                    printf("Control settings: Offset CPU %d, Offset GPU %d, Min CPU %d, Min GPU %d, Force CPU %d, Force GPU %d (backend %s)\n", ctrl_setting_offset_cpu, ctrl_setting_offset_gpu, ctrl_setting_min_cpu, ctrl_setting_min_gpu, ctrl_setting_force_cpu, ctrl_setting_force_gpu, backend_active_name());
+                    if (use_perf_governor)
+                    {
+                        governor_configure(&ctrl_setting_governor);
+                        printf("Governor settings: Trip %d, Release %d, Step %d, Floor %d\n", ctrl_setting_governor.trip_temp, ctrl_setting_governor.release_temp, ctrl_setting_governor.step_pct, ctrl_setting_governor.floor_pct);
                     }
-                    printf("Control settings: Offset CPU %d, Offset GPU %d, Min CPU %d, Min GPU %d, Force CPU %d, Force GPU %d (hwmon %d)\n", ctrl_setting_offset_cpu, ctrl_setting_offset_gpu, ctrl_setting_min_cpu, ctrl_setting_min_gpu, ctrl_setting_force_cpu, ctrl_setting_force_gpu, use_hwmon_interface);
                     fclose(ctrl_file);
                 }
             }
-            double cputemp;
-            for (int tries = 0;tries < 3;tries++)
-            {
-                cputemp = ec_query_cpu_temp();
-                if (cputemp < 100 || cputemp < lastCPU + 20) break;
-            }
-            if (cputemp < lastCPU - 10) cputemp = lastCPU - 10;
+            // a stale EC reads as a failed sensor; the CPU fan is then held at ACQ_STALE_DUTY or more below
+            double cputemp = ec_fresh ? ec.values[0] : 0;
+            if (ec_fresh && cputemp < lastCPU - 10) cputemp = lastCPU - 10;
 
-            int cur_cpu_setting = ec_query_cpu_fan_duty();
-            int cur_gpu_setting = ec_query_gpu_fan_duty();
+            int cur_cpu_setting = ec_fresh ? ec.values[1] : current[0];
+            int cur_gpu_setting = ec_fresh ? ec.values[2] : current[1];
 
             double gputemptmp;
             if (gputemp <= 65) gputemptmp = gputemp - 10;
@@ -255,7 +489,13 @@ void autoset_cpu_gpu()
             else gputemptmp = gputemp;
 
             double avg[2];
-            if (cputemp > gputemptmp)
+            if (!ec_fresh)
+            {
+                // nothing to mix the GPU with, and the CPU side holds its last average
+                avg[0] = lastCPU;
+                avg[1] = gputemptmp;
+            }
+            else if (cputemp > gputemptmp)
             {
                 avg[0] = cputemp;
                 avg[1] = (2 * gputemptmp + cputemp) / 3;
@@ -279,15 +519,56 @@ void autoset_cpu_gpu()
                 else if (avg[i] <= 90) setDuty[i] = (avg[i] - 75) * 3 + 45;
                 else setDuty[i] = 100;
             }
+            if (auto_rule_text[0][0] != '\0' || auto_rule_text[1][0] != '\0')
+            {
+                double* vars = auto_rule_vars;
+                vars[RULE_CPU] = avg[0];
+                vars[RULE_GPU] = avg[1];
+                vars[RULE_CPU_PKG] = cputemp;
+                vars[RULE_AC] = power_get() == POWER_AC;
+                vars[RULE_BATTERY] = power_get() == POWER_BATTERY;
+                vars[RULE_HEAVY] = procwatch_duty();
+                for (int i = 0;i < ctrl_setting_sensor_count;i++) if (auto_rule_sensor[i] >= 0) vars[auto_rule_sensor[i]] = sensors_temp(i);
+                for (int i = 0;i < 2;i++)
+                {
+                    if (auto_rule_text[i][0] == '\0') continue;
+                    // NaN from a division by zero fails the comparison and reads as 0
+                    auto_rule_value[i] = expr_eval(&auto_rules[i], vars);
+                    setDuty[i] = auto_rule_value[i] >= 100 ? 100 : auto_rule_value[i] > 0 ? (int) (auto_rule_value[i] + 0.5) : 0;
+                }
+            }
 
             if (ctrl_setting_offset_cpu) setDuty[0] += ctrl_setting_offset_cpu;
             if (ctrl_setting_offset_gpu) setDuty[1] += ctrl_setting_offset_gpu;
+            for (int i = 0;i < 2;i++) if (setDuty[i] > 0) setDuty[i] = MAX(setDuty[i] + profile->offset, 0);
+            // stale extra sensors keep their last request rather than dropping it
+            if (extra.valid)
+            {
+                setDuty[0] = MAX(setDuty[0], (int) extra.values[0]);
+                setDuty[1] = MAX(setDuty[1], (int) extra.values[1]);
+            }
+            int heavy = procwatch_duty();
+            if (heavy)
+            {
+                setDuty[0] = MAX(setDuty[0], heavy);
+                setDuty[1] = MAX(setDuty[1], heavy);
+            }
             if (ctrl_setting_min_cpu > setDuty[0]) setDuty[0] = ctrl_setting_min_cpu;
             if (ctrl_setting_min_gpu > setDuty[1]) setDuty[1] = ctrl_setting_min_gpu;
             if (ctrl_setting_force_cpu != -1) setDuty[0] = ctrl_setting_force_cpu;
             if (ctrl_setting_force_gpu != -1) setDuty[1] = ctrl_setting_force_gpu;
+            for (int i = 0;i < 2;i++) if (auto_socket_duty[i] != -1) setDuty[i] = auto_socket_duty[i];
+            if (!ec_fresh) setDuty[0] = MAX(setDuty[0], ACQ_STALE_DUTY);
+            if (!gpu_usable) setDuty[1] = MAX(setDuty[1], ACQ_STALE_DUTY);
             for (int i = 0;i < 2;i++) if (setDuty[i] > 100) setDuty[i] = 100;
 
+            if (cputemp >= TEMP_FAIL_THRESHOLD)
+            {
+                headroom_update(cputemp, MAX(setDuty[0], setDuty[1]));
+                shed_update(cputemp, setDuty[0]);
+                if (use_perf_governor) governor_update(cputemp, setDuty[0]);
+            }
+
             int doSet[2] = {0, 0};
             for (int i = 0;i < 2;i++)
             {
@@ -311,7 +592,8 @@ void autoset_cpu_gpu()
                 doSet[0] = doSet[1] = 1;
                 initial = 0;
             }
-            else if (cur_cpu_setting != current[0] || cur_gpu_setting != current[1])
+            // the RPM loop owns the duty registers and puts back changed ones itself
+            else if (!rpmtarget_enabled() && pipeline_pending(&auto_commands) == 0 && (cur_cpu_setting != current[0] || cur_gpu_setting != current[1]))
             {
                 doSet[0] = doSet[1] = 1;
                 for (int i = 0;i < 2;i++) if (setDuty[i] < current[i]) setDuty[i] = current[i];
@@ -336,41 +618,103 @@ void autoset_cpu_gpu()
                 lastfail = 0;
             }
 
+            for (int i = 0;i < 2;i++) if (auto_socket_trace[i]) doSet[i] = 1;
+
             printf("Temperatures C: %f G: %f --> %f %f --> New Duty: %d (%d) %d (%d) - Activate %d %d\n", cputemp, gputemp, avg[0], avg[1], setDuty[0], cur_cpu_setting, setDuty[1], cur_gpu_setting, doSet[0], doSet[1]);
+            if (!ec_fresh || !gpu_usable || !extra_fresh) printf("Stale sources: EC %d (%llu ms) GPU %d (%llu ms) sensors %d (%llu ms)\n", !ec_fresh, (unsigned long long) ec.age_us / 1000, !gpu_usable, (unsigned long long) gpu.age_us / 1000, !extra_fresh, (unsigned long long) extra.age_us / 1000);
 
-            for (int i = 0;i < 2;i++)
+            if (use_heat_attribution && ((doSet[0] && setDuty[0] >= current[0] + HEAT_RAMP_STEP) || (doSet[1] && setDuty[1] >= current[1] + HEAT_RAMP_STEP)))
             {
-                if (doSet[i])
+                static time_t last_heat_log = 0;
+                if (time(NULL) - last_heat_log >= HEAT_RAMP_LOG_INTERVAL)
                 {
-                    current[i] = setDuty[i];
-                    int retVal;
-                    for (int j = 0;j < 3;j++)
-                    {
-                        if (i) retVal = ec_write_gpu_fan_duty(setDuty[1]);
-                        else retVal = ec_write_cpu_fan_duty(setDuty[0]);
-                        if (retVal == EXIT_SUCCESS)
-                        {
-                            usleep(1100000);
-                            int new_setting = i ? ec_query_gpu_fan_duty() : ec_query_cpu_fan_duty();
-                            if (new_setting == setDuty[i]) break;
-                            printf("Mismatch %d : %d v.s. %d\n", i, new_setting, setDuty[i]);
-                        }
-                        printf("Error setting speed, retrying...\n");
-                        usleep(50000);
-                    }
+                    last_heat_log = time(NULL);
+                    printf("Fans ramping, top heat sources:\n");
+                    heat_print_top(stdout, 5);
                 }
             }
-            missing = 0;
-        }
-        else
-        {
-            missing++;
+
+            if (doSet[0] || doSet[1])
+            {
+                auto_command command = { { setDuty[0], setDuty[1] }, { doSet[0], doSet[1] }, { 0, 0 }, util_now_us() };
+                for (int i = 0;i < 2;i++)
+                {
+                    // a socket request keeps the trace it was given on arrival
+                    if (doSet[i]) command.trace[i] = auto_socket_trace[i] ? auto_socket_trace[i] : trace_begin(TRACE_CONTROL, command.time_us);
+                    auto_socket_trace[i] = 0;
+                }
+                if (pipeline_push(&auto_commands, &command) == 0)
+                {
+                    for (int i = 0;i < 2;i++) if (doSet[i]) current[i] = setDuty[i];
+                }
+                else
+                {
+                    for (int i = 0;i < 2;i++) trace_drop(command.trace[i]);
+                    pipeline_stage_drop(auto_stage_control);
+                    printf("Actuation queue full, duty change deferred\n");
+                }
+            }
+            double sample[HISTORY_COLUMNS] = { ec_fresh && cputemp >= TEMP_FAIL_THRESHOLD ? cputemp : NAN, gpu_usable && gputemp >= TEMP_FAIL_THRESHOLD ? gputemp : NAN, current[0], current[1] };
+            history_record(sample);
+            residency_update(sample);
+            for (int i = 0;i < HISTORY_COLUMNS;i++) quantile_add((quantile_series) i, sample[i]);
         }
-        usleep(1000000);
+        pipeline_stage_record(auto_stage_control, control_start - frame.time_us, util_now_us() - control_start);
     };
 }
 
 int main(int argc, char* argv[]) {
+    if (argc > 2 && strcmp(argv[1], "query") == 0) {
+        // talks to the auto mode daemon, no EC access needed
+        setuid(getuid());
+        char command[512] = "";
+        for (int i = 2; i < argc; i++) {
+            if (i > 2) strncat(command, " ", sizeof(command) - strlen(command) - 1);
+            strncat(command, argv[i], sizeof(command) - strlen(command) - 1);
+        }
+        return ctl_query(command, stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc > 1 && strcmp(argv[1], "top-heat") == 0) {
+        setuid(getuid());
+        char command[64];
+        snprintf(command, sizeof(command), "top-heat %s", argc > 2 ? argv[2] : "");
+        return ctl_query(command, stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc > 1 && strcmp(argv[1], "history") == 0) {
+        setuid(getuid());
+        const char* since = "1h";
+        const char* tier = NULL;
+        int stats = 0;
+        double above = 85;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--stats") == 0) stats = 1;
+            else if (i + 1 == argc) break;
+            else if (strcmp(argv[i], "--since") == 0) since = argv[++i];
+            else if (strcmp(argv[i], "--tier") == 0) tier = argv[++i];
+            else if (strcmp(argv[i], "--above") == 0) above = atof(argv[++i]);
+        }
+        return history_query(history_path(), since, tier, stats, above, stdout) == 0 ?
+                EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    // the benchmarks work on synthetic data and sysfs, no EC access needed
+    if (argc > 1 && strcmp(argv[1], "bench-history") == 0) {
+        setuid(getuid());
+        int days = argc > 2 ? atoi(argv[2]) : 365;
+        return analytics_bench(days > 0 && days <= 3650 ? days : 365, stdout) == 0 ?
+                EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-expr") == 0) {
+        setuid(getuid());
+        int iterations = argc > 2 ? atoi(argv[2]) : 1000000;
+        return expr_bench(argc > 3 ? argv[3] : NULL, iterations > 0 ? iterations : 1000000,
+                stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-acquire") == 0) {
+        setuid(getuid());
+        int iterations = argc > 2 ? atoi(argv[2]) : 10000;
+        return hwmon_bench(iterations > 0 ? iterations : 10000, stdout) == 0 ?
+                EXIT_SUCCESS : EXIT_FAILURE;
+    }
     printf("Simple fan control utility for Clevo laptops\n");
     if (check_proc_instances(NAME) > 1) {
         printf("Multiple running instances!\n");
@@ -388,8 +732,16 @@ int main(int argc, char* argv[]) {
         }
         return EXIT_FAILURE;
     }
-    if (ec_init() != EXIT_SUCCESS) {
-        printf("unable to control EC: %s\n", strerror(errno));
+    hwmon_scan();
+    int backend_flags = 0;
+    if (getenv("USE_HWMON") && strcmp(getenv("USE_HWMON"), "1") == 0)
+        backend_flags |= BACKEND_PREFER_HWMON;
+    if (argc > 1 && strcmp(argv[1], "auto") == 0) {
+        load_ec_sys();
+        backend_flags |= BACKEND_KERNEL_READS;
+    }
+    if (backend_init(backend_flags) != 0) {
+        printf("unable to control EC: no port I/O, ec_sys or clevo_xsm_wmi access\n");
         return EXIT_FAILURE;
     }
     if (argc <= 1 || strcmp(argv[1], "help") == 0) {
@@ -401,6 +753,14 @@ Dump/Control fan duty on Clevo laptops. Display indicator by default.\n\
 \n\
 Arguments:\n\
   [fan-duty-percentage]\t\tTarget fan duty in percentage, from 60 to 100\n\
+  query <command>\t\tQuery the auto mode daemon, 'query help' lists commands\n\
+  top-heat [count]\t\tProcesses by attributed package power (TOP_HEAT=1)\n\
+  history [--since 7d]\t\tRecorded temperatures and duties\n\
+  history --stats [--above 85]\tMin/max/mean/percentiles of them\n\
+  bench-history [days]\t\tTime history analytics against scalar loops\n\
+  bench-acquire [iterations]\tCompare pread and io_uring hwmon acquisition\n\
+  bench-expr [iters] [rule]\tTime the evaluation of a fan rule\n\
+  characterize\t\t\tMeasure fan response and save it for the auto mode\n\
   -?\t\t\t\tDisplay this help and exit\n\
 \n\
 Without arguments this program should attempt to display an indicator in\n\
@@ -478,6 +838,8 @@ DO NOT MANIPULATE OR QUERY EC I/O PORTS WHILE THIS PROGRAM IS RUNNING.\n\
         }
     } else if (strcmp(argv[1], "dump") == 0) {
         return main_dump_fan();
+    } else if (strcmp(argv[1], "characterize") == 0) {
+        return main_characterize();
     } else if (strcmp(argv[1], "dumpall") == 0) {
         int io_fd = open("/sys/kernel/debug/ec/ec0/io", O_RDONLY, 0);
         if (io_fd < 0) {
@@ -512,31 +874,12 @@ DO NOT MANIPULATE OR QUERY EC I/O PORTS WHILE THIS PROGRAM IS RUNNING.\n\
         close(io_fd);
     }
     else if (strcmp(argv[1], "auto") == 0) {
-        if (getenv("USE_HWMON") && strcmp(getenv("USE_HWMON"), "1") == 0)
-        {
-            use_hwmon_interface = 1;
-            int i = 0;
-            int foundif = 0;
-            while (1)
-            {
-                FILE* fp;
-                char name[1024];
-                sprintf(name, "/sys/class/hwmon/hwmon%d/name", i);
-                fp = fopen(name, "rb");
-                if (fp == 0) break;
-                fgets(name, 1023, fp);
-                fclose(fp);
-                if (strcmp(name, "clevo_xsm_wmi\n") == 0)
-                {
-                    printf("Found clevo interface %d %s", i, name);
-                    hwmon_interface_num = i;
-                    foundif = 1;
-                    break;
-                }
-                i++;
-            };
-            if (!foundif) return EXIT_FAILURE;
-        }
+        if (getenv("PERF_GOVERNOR") && strcmp(getenv("PERF_GOVERNOR"), "1") == 0)
+            use_perf_governor = 1;
+        if (getenv("TOP_HEAT") && strcmp(getenv("TOP_HEAT"), "1") == 0)
+            use_heat_attribution = 1;
+        if (getenv("USE_IO_URING") && strcmp(getenv("USE_IO_URING"), "1") == 0)
+            hwmon_use_io_uring(1);
         autoset_cpu_gpu();
     }
 
@@ -556,28 +899,59 @@ static void main_init_share(void) {
     share_info->auto_duty_val = 0;
     share_info->manual_next_fan_duty = 0;
     share_info->manual_prev_fan_duty = 0;
+    share_info->manual_trace_us = 0;
 }
 
 static int main_ec_worker(void) {
     setuid(0);
-    system("modprobe ec_sys");
+    load_ec_sys();
     FILE* io_fd = fopen("/sys/kernel/debug/ec/ec0/io", "r");
     if (io_fd <= 0)
     {
         printf("unable to read EC from sysfs: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
+    fantable_load(fantable_path());
+    if (ctl_open() == 0) {
+        atexit(ctl_close);
+        trace_register();
+    }
+    uint32_t trace = 0;
+    resume_init();
     while (share_info->exit == 0 && io_fd > 0) {
         // check parent
         if (parent_pid != 0 && kill(parent_pid, 0) == -1) {
             printf("worker on parent death\n");
             break;
         }
+        // write EC again after a resume, the EC may be back at its defaults
+        uint64_t slept_us, resumed_us;
+        int resume_duty = share_info->auto_duty ? share_info->auto_duty_val : share_info->manual_prev_fan_duty;
+        if (resume_check(&slept_us, &resumed_us) && resume_duty != 0) {
+            printf("resumed after %llu s asleep (noticed within %llu ms), fan duty to %d%%\n",
+                    (unsigned long long) slept_us / 1000000,
+                    (unsigned long long) resumed_us / 1000, resume_duty);
+            trace_drop(trace);
+            trace = trace_begin(TRACE_RESUME, util_now_us());
+            if (ec_write_cpu_fan_duty(resume_duty) == EXIT_SUCCESS) {
+                trace_written(trace, 0, resume_duty, fantable_rpm(0, resume_duty));
+            } else {
+                trace_drop(trace);
+                trace = 0;
+            }
+        }
         // write EC
         int new_fan_duty = share_info->manual_next_fan_duty;
         if (new_fan_duty != 0
                 && new_fan_duty != share_info->manual_prev_fan_duty) {
-            ec_write_cpu_fan_duty(new_fan_duty);
+            trace_drop(trace);
+            trace = trace_begin(TRACE_UI, share_info->manual_trace_us);
+            if (ec_write_cpu_fan_duty(new_fan_duty) == EXIT_SUCCESS) {
+                trace_written(trace, 0, new_fan_duty, fantable_rpm(0, new_fan_duty));
+            } else {
+                trace_drop(trace);
+                trace = 0;
+            }
             share_info->manual_prev_fan_duty = new_fan_duty;
         }
         // read EC
@@ -590,9 +964,11 @@ static int main_ec_worker(void) {
         case 0x100:
             share_info->cpu_temp = buf[EC_REG_CPU_TEMP];
             share_info->gpu_temp = buf[EC_REG_GPU_TEMP];
-            share_info->fan_duty = calculate_fan_duty(buf[EC_REG_CPU_FAN_DUTY]);
-            share_info->fan_rpms = calculate_fan_rpms(buf[EC_REG_CPU_FAN_RPMS_HI],
+            share_info->fan_duty = ec_fan_duty(buf[EC_REG_CPU_FAN_DUTY]);
+            share_info->fan_rpms = ec_fan_rpms(buf[EC_REG_CPU_FAN_RPMS_HI],
                     buf[EC_REG_CPU_FAN_RPMS_LO]);
+            if (trace != 0 && trace_sample(trace, share_info->fan_rpms))
+                trace = 0;
             break;
         default:
             printf("wrong EC size from sysfs: %ld\n", len);
@@ -605,13 +981,20 @@ static int main_ec_worker(void) {
                 get_time_string(s_time, 256, "%m/%d %H:%M:%S");
                 printf("%s CPU=%d°C, GPU=%d°C, auto fan duty to %d%%\n", s_time,
                         share_info->cpu_temp, share_info->gpu_temp, next_duty);
-                ec_write_cpu_fan_duty(next_duty);
+                trace_drop(trace);
+                trace = trace_begin(TRACE_CONTROL, util_now_us());
+                if (ec_write_cpu_fan_duty(next_duty) == EXIT_SUCCESS) {
+                    trace_written(trace, 0, next_duty, fantable_rpm(0, next_duty));
+                } else {
+                    trace_drop(trace);
+                    trace = 0;
+                }
                 share_info->auto_duty_val = next_duty;
             }
         }
         //
         fclose(io_fd);
-        usleep(200 * 1000);
+        ctl_wait(200);
         io_fd = fopen("/sys/kernel/debug/ec/ec0/io", "r");
     }
     if (io_fd > 0)
@@ -671,6 +1054,11 @@ static void main_on_sigterm(int signum) {
     exit(EXIT_SUCCESS);
 }
 
+static void auto_on_sigterm(int signum) {
+    printf("auto on signal: %s\n", strsignal(signum));
+    exit(EXIT_SUCCESS);
+}
+
 static int main_dump_fan(void) {
     printf("Dump fan information\n");
     printf("  CPU Temp: %d°C\n", ec_query_cpu_temp());
@@ -698,6 +1086,30 @@ static int main_test_gpu_fan(int duty_percentage) {
     return EXIT_SUCCESS;
 }
 
+static int main_characterize(void) {
+    // writes a root-owned file, so unlike set/dump not for the adm group
+    if (getuid() != 0) {
+        printf("characterize has to be run by root\n");
+        return EXIT_FAILURE;
+    }
+    printf("Characterize fan response, this takes a few minutes\n");
+    signal_term(&characterize_on_sigterm);
+    if (fantable_characterize(stdout) != 0) {
+        printf("characterization failed\n");
+        return EXIT_FAILURE;
+    }
+    const char* path = fantable_path();
+    if (fantable_save(path) != 0)
+        return EXIT_FAILURE;
+    printf("\nSaved to %s:\n", path);
+    fantable_print(stdout);
+    return EXIT_SUCCESS;
+}
+
+static void characterize_on_sigterm(int signum) {
+    fantable_abort();
+}
+
 static gboolean ui_update(gpointer user_data) {
     char label[256];
     sprintf(label, "%d℃ %d℃", share_info->cpu_temp, share_info->gpu_temp);
@@ -716,6 +1128,7 @@ static void ui_command_set_fan(long fan_duty) {
         printf("clicked on fan duty: %d\n", fan_duty_val);
         share_info->auto_duty = 0;
         share_info->auto_duty_val = 0;
+        share_info->manual_trace_us = util_now_us();
         share_info->manual_next_fan_duty = fan_duty_val;
     }
     ui_toggle_menuitems(fan_duty_val);
@@ -740,14 +1153,6 @@ static void ui_toggle_menuitems(int fan_duty) {
     }
 }
 
-static int ec_init(void) {
-    if (ioperm(EC_DATA, 1, 1) != 0)
-        return EXIT_FAILURE;
-    if (ioperm(EC_SC, 1, 1) != 0)
-        return EXIT_FAILURE;
-    return EXIT_SUCCESS;
-}
-
 static void ec_on_sigterm(int signum) {
     printf("ec on signal: %s\n", strsignal(signum));
     if (share_info != NULL)
@@ -793,99 +1198,34 @@ static int ec_auto_duty_adjust(void) {
     return 100;
 }
 
+static int ec_query(backend_value what) {
+    int value;
+    if (backend_read_one(what, &value) != 0) return 99;
+    return value;
+}
+
 static int ec_query_cpu_temp(void) {
-    if (use_hwmon_interface)
-    {
-        char name[1024];
-        sprintf(name, "/sys/class/hwmon/hwmon%d/temp1_input", hwmon_interface_num);
-        FILE* fp;
-        fp = fopen(name, "rb");
-        if (fp == 0) return 99;
-        fgets(name, 1023, fp);
-        fclose(fp);
-        int val;
-        sscanf(name, "%d\n", &val);
-        return(val / 1000);
-    }
-    return ec_io_read(EC_REG_CPU_TEMP);
+    return ec_query(BACKEND_CPU_TEMP);
 }
 
 static int ec_query_gpu_temp(void) {
-    return ec_io_read(EC_REG_GPU_TEMP);
+    return ec_query(BACKEND_GPU_TEMP);
 }
 
 static int ec_query_cpu_fan_duty(void) {
-    if (use_hwmon_interface)
-    {
-        char name[1024];
-        sprintf(name, "/sys/class/hwmon/hwmon%d/pwm1", hwmon_interface_num);
-        FILE* fp;
-        fp = fopen(name, "rb");
-        if (fp == 0) return 99;
-        fgets(name, 1023, fp);
-        fclose(fp);
-        int val;
-        sscanf(name, "%d\n", &val);
-        return calculate_fan_duty(val);
-    }
-    int raw_duty = ec_io_read(EC_REG_CPU_FAN_DUTY);
-    return calculate_fan_duty(raw_duty);
+    return ec_query(BACKEND_CPU_DUTY);
 }
 
 static int ec_query_cpu_fan_rpms(void) {
-    if (use_hwmon_interface)
-    {
-        char name[1024];
-        sprintf(name, "/sys/class/hwmon/hwmon%d/fan1_input", hwmon_interface_num);
-        FILE* fp;
-        fp = fopen(name, "rb");
-        if (fp == 0) return 99;
-        fgets(name, 1023, fp);
-        fclose(fp);
-        int val;
-        sscanf(name, "%d\n", &val);
-        return val;
-    }
-    int raw_rpm_hi = ec_io_read(EC_REG_CPU_FAN_RPMS_HI);
-    int raw_rpm_lo = ec_io_read(EC_REG_CPU_FAN_RPMS_LO);
-    return calculate_fan_rpms(raw_rpm_hi, raw_rpm_lo);
+    return ec_query(BACKEND_CPU_RPMS);
 }
 
 static int ec_query_gpu_fan_duty(void) {
-    if (use_hwmon_interface)
-    {
-        char name[1024];
-        sprintf(name, "/sys/class/hwmon/hwmon%d/pwm2", hwmon_interface_num);
-        FILE* fp;
-        fp = fopen(name, "rb");
-        if (fp == 0) return 99;
-        fgets(name, 1023, fp);
-        fclose(fp);
-        int val;
-        sscanf(name, "%d\n", &val);
-        return calculate_fan_duty(val);
-    }
-    int raw_duty = ec_io_read(EC_REG_GPU_FAN_DUTY);
-     return calculate_fan_duty(raw_duty);
+    return ec_query(BACKEND_GPU_DUTY);
 }
 
 static int ec_query_gpu_fan_rpms(void) {
-    if (use_hwmon_interface)
-    {
-        char name[1024];
-        sprintf(name, "/sys/class/hwmon/hwmon%d/fan2_input", hwmon_interface_num);
-        FILE* fp;
-        fp = fopen(name, "rb");
-        if (fp == 0) return 99;
-        fgets(name, 1023, fp);
-        fclose(fp);
-        int val;
-        sscanf(name, "%d\n", &val);
-        return val;
-    }
-    int raw_rpm_hi = ec_io_read(EC_REG_GPU_FAN_RPMS_HI);
-    int raw_rpm_lo = ec_io_read(EC_REG_GPU_FAN_RPMS_LO);
-    return calculate_fan_rpms(raw_rpm_hi, raw_rpm_lo);
+    return ec_query(BACKEND_GPU_RPMS);
 }
 
 static int ec_write_cpu_fan_duty(int duty_percentage) {
@@ -893,20 +1233,7 @@ static int ec_write_cpu_fan_duty(int duty_percentage) {
         printf("Wrong fan duty to write: %d\n", duty_percentage);
         return EXIT_FAILURE;
     }
-    double v_d = ((double) duty_percentage) / 100.0 * 255.0 + 0.5;
-    int v_i = (int) v_d;
-    if (use_hwmon_interface)
-    {
-        char name[1024];
-        sprintf(name, "/sys/class/hwmon/hwmon%d/pwm1", hwmon_interface_num);
-        FILE* fp;
-        fp = fopen(name, "wb");
-        if (fp == 0) return 99;
-        fprintf(fp, "%d\n", v_i);
-        fclose(fp);
-        return 0;
-    }
-    return ec_io_do(0x99, 0x01, v_i);
+    return backend_write_duty(0, duty_percentage) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 static int ec_write_gpu_fan_duty(int duty_percentage) {
@@ -914,73 +1241,42 @@ static int ec_write_gpu_fan_duty(int duty_percentage) {
         printf("Wrong fan duty to write: %d\n", duty_percentage);
         return EXIT_FAILURE;
     }
-    double v_d = ((double) duty_percentage) / 100.0 * 255.0 + 0.5;
-    int v_i = (int) v_d;
-    if (use_hwmon_interface)
-    {
-        char name[1024];
-        sprintf(name, "/sys/class/hwmon/hwmon%d/pwm2", hwmon_interface_num);
-        FILE* fp;
-        fp = fopen(name, "wb");
-        if (fp == 0) return 99;
-        fprintf(fp, "%d\n", v_i);
-        fclose(fp);
-        return 0;
-    }
-    return ec_io_do(0x99, 0x02, v_i);
+    return backend_write_duty(1, duty_percentage) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-static int ec_io_wait(const uint32_t port, const uint32_t flag,
-        const char value) {
-    uint8_t data = inb(port);
-    int i = 0;
-    while ((((data >> flag) & 0x1) != value) && (i++ < 100)) {
-        usleep(1000);
-        data = inb(port);
+/* Run /sbin/modprobe ec_sys as root with a fixed environment: no shell and
+ * nothing of the caller's PATH, which setuid root mustn't trust. */
+static int load_ec_sys(void) {
+    static char* const argv[] = { "modprobe", "ec_sys", NULL };
+    static char* const envp[] = { "PATH=/sbin:/usr/sbin:/bin:/usr/bin", NULL };
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("unable to load ec_sys: %s\n", strerror(errno));
+        return -1;
     }
-    if (i >= 1000) {
-        printf("wait_ec error on port 0x%x, data=0x%x, flag=0x%x, value=0x%x\n",
-                port, data, flag, value);
-        return EXIT_FAILURE;
+    if (pid == 0) {
+        // the real uid is still the caller's, modprobe would run unprivileged
+        if (setuid(0) == 0)
+            execve("/sbin/modprobe", argv, envp);
+        printf("unable to run /sbin/modprobe: %s\n", strerror(errno));
+        fflush(stdout);
+        _exit(127);
     }
-    return EXIT_SUCCESS;
-}
-
-static uint8_t ec_io_read(const uint32_t port) {
-    ec_io_wait(EC_SC, IBF, 0);
-    outb(EC_SC_READ_CMD, EC_SC);
-
-    ec_io_wait(EC_SC, IBF, 0);
-    outb(port, EC_DATA);
-
-    //wait_ec(EC_SC, EC_SC_IBF_FREE);
-    ec_io_wait(EC_SC, OBF, 1);
-    uint8_t value = inb(EC_DATA);
-
-    return value;
-}
-
-static int ec_io_do(const uint32_t cmd, const uint32_t port,
-        const uint8_t value) {
-    ec_io_wait(EC_SC, IBF, 0);
-    outb(cmd, EC_SC);
-
-    ec_io_wait(EC_SC, IBF, 0);
-    outb(port, EC_DATA);
-
-    ec_io_wait(EC_SC, IBF, 0);
-    outb(value, EC_DATA);
-
-    return ec_io_wait(EC_SC, IBF, 0);
-}
-
-static int calculate_fan_duty(int raw_duty) {
-    return (int) ((double) raw_duty / 255.0 * 100.0 + 0.5);
-}
-
-static int calculate_fan_rpms(int raw_rpm_high, int raw_rpm_low) {
-    int raw_rpm = (raw_rpm_high << 8) + raw_rpm_low;
-    return raw_rpm > 0 ? (2156220 / raw_rpm) : 0;
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            printf("unable to load ec_sys: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return 0;
+    if (WIFEXITED(status))
+        printf("unable to load ec_sys: modprobe exited with %d\n", WEXITSTATUS(status));
+    else
+        printf("unable to load ec_sys: modprobe killed by signal %d\n", WTERMSIG(status));
+    return -1;
 }
 
 static int check_proc_instances(const char* proc_name) {
@@ -1026,6 +1322,257 @@ static void get_time_string(char* buffer, size_t max, const char* format) {
     strftime(buffer, max, format, &tm_info);
 }
 
+/* Any failed read fails the whole sample, so the control loop sees a stale
+ * source instead of a made-up reading. */
+static int auto_read_ec(double* values, void* arg) {
+    static double last_cpu_temp = 0;
+    static const backend_value what[4] = { BACKEND_CPU_TEMP, BACKEND_CPU_DUTY,
+            BACKEND_GPU_DUTY, BACKEND_GPU_TEMP };
+    int raw[4];
+    backend_check();
+    backend_read(what, raw, 4);
+    // the GPU register only stands in for the GPU stream, -1 when missing
+    if (raw[0] < 0 || raw[1] < 0 || raw[2] < 0)
+        return ACQUIRE_ERROR;
+    for (int tries = 1; tries < 3 && raw[0] >= 100 && raw[0] >= last_cpu_temp + 20; tries++)
+        if (backend_read_one(BACKEND_CPU_TEMP, &raw[0]) != 0)
+            return ACQUIRE_ERROR;
+    last_cpu_temp = raw[0];
+    for (int i = 0; i < 4; i++)
+        values[i] = raw[i];
+    return 4;
+}
+
+static void* auto_acquire_stage(void* arg) {
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (;;) {
+        auto_frame frame;
+        uint64_t start = util_now_us();
+        // how late this tick woke up against its absolute schedule
+        quantile_add(QUANTILE_LOOP_JITTER, start - ((uint64_t) next.tv_sec * 1000000 + next.tv_nsec / 1000));
+        frame.ec_fresh = acquire_get(auto_ec_id, &frame.ec) == 0;
+        frame.gpu_fresh = acquire_get(auto_gpu_id, &frame.gpu) == 0;
+        frame.extra_fresh = acquire_get(auto_sensors_id, &frame.extra) == 0;
+        frame.time_us = util_now_us();
+        if (pipeline_push(&auto_frames, &frame) != 0)
+            pipeline_stage_drop(auto_stage_acquire);
+        // the EC values had been waiting this long for the frame
+        pipeline_stage_record(auto_stage_acquire, frame.ec.age_us,
+                frame.time_us - start);
+        next.tv_sec += PIPE_TICK_MS / 1000;
+        next.tv_nsec += (PIPE_TICK_MS % 1000) * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+static void* auto_actuate_stage(void* arg) {
+    int target_rpm[2] = { -1, -1 };
+    int duty[2] = { 0, 0 };
+    uint64_t trimmed_us = 0;
+    for (;;) {
+        auto_command command, newer;
+        if (pipeline_pop(&auto_commands, &command) != 0) {
+            pipeline_wait(&auto_commands, rpmtarget_enabled() ? RPMTARGET_PERIOD_MS : -1);
+            if (rpmtarget_enabled() && util_now_us() - trimmed_us >= RPMTARGET_PERIOD_MS * 1000ULL) {
+                auto_trim_rpm(target_rpm, duty);
+                trimmed_us = util_now_us();
+            }
+            continue;
+        }
+        uint64_t start = util_now_us();
+        // a backlog collapses into its newest duty per fan
+        int popped = 1;
+        while (pipeline_pop(&auto_commands, &newer) == 0) {
+            for (int i = 0; i < 2; i++) {
+                if (newer.set[i]) {
+                    if (command.set[i])
+                        trace_drop(command.trace[i]);
+                    command.set[i] = 1;
+                    command.duty[i] = newer.duty[i];
+                    command.trace[i] = newer.trace[i];
+                }
+            }
+            popped++;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (!command.set[i])
+                continue;
+            // with RPM targeting the curve duty names an RPM, seeded from the fan table
+            target_rpm[i] = rpmtarget_enabled() ? rpmtarget_rpm(command.duty[i]) : -1;
+            duty[i] = target_rpm[i] >= 0 ? rpmtarget_seed(i, target_rpm[i]) : command.duty[i];
+            auto_write_duty(i, duty[i], command.trace[i]);
+        }
+        trimmed_us = util_now_us();
+        pipeline_stage_record(auto_stage_actuate, start - command.time_us,
+                trimmed_us - start);
+        while (popped-- > 0)
+            pipeline_done(&auto_commands);
+    }
+    return NULL;
+}
+
+/* Write and verify one duty, waiting for the fan to settle before reading
+ * it back. */
+static void auto_write_duty(int fan, int duty, uint32_t trace) {
+    for (int j = 0; j < 3; j++) {
+        int retVal = fan ? ec_write_gpu_fan_duty(duty) : ec_write_cpu_fan_duty(duty);
+        if (retVal == EXIT_SUCCESS) {
+            trace_written(trace, fan, duty, fantable_rpm(fan, duty));
+            auto_wait_settled(fan, duty, j == 0 ? trace : 0);
+            int new_setting = fan ? ec_query_gpu_fan_duty() : ec_query_cpu_fan_duty();
+            if (new_setting == duty)
+                return;
+            printf("Mismatch %d : %d v.s. %d\n", fan, new_setting, duty);
+        }
+        printf("Error setting speed, retrying...\n");
+        usleep(50000);
+    }
+    trace_drop(trace);
+}
+
+/* A traced write watches the RPM until it settles, otherwise the measured
+ * settle time of the duty is waited out. */
+static void auto_wait_settled(int fan, int duty, uint32_t trace) {
+    if (trace == 0) {
+        usleep(fantable_settle_ms(fan, duty) * 1000);
+        return;
+    }
+    uint64_t start = util_now_us();
+    do {
+        usleep(FANTABLE_SAMPLE_MS * 1000);
+        int rpm;
+        if (backend_read_one(fan ? BACKEND_GPU_RPMS : BACKEND_CPU_RPMS, &rpm) == 0 && trace_sample(trace, rpm))
+            return;
+    } while (util_now_us() - start < TRACE_SETTLE_TIMEOUT_MS * 1000ULL);
+    trace_drop(trace);
+}
+
+/* "fan <cpu|gpu|both> <duty|auto>": runs on the control thread, which picks
+ * the duty up with the next frame. */
+static void auto_fan_command(const char* args, FILE* out) {
+    if (!ctl_privileged(out))
+        return;
+    char which[8], value[8];
+    if (sscanf(args, "%7s %7s", which, value) != 2) {
+        fprintf(out, "error usage: fan <cpu|gpu|both> <duty|auto>\n");
+        return;
+    }
+    int duty = strcmp(value, "auto") == 0 ? -1 : atoi(value);
+    if (duty < -1 || duty > 100 || (duty == 0 && strcmp(value, "0") != 0)) {
+        fprintf(out, "error invalid duty %s\n", value);
+        return;
+    }
+    uint64_t now = util_now_us();
+    for (int i = 0; i < 2; i++) {
+        if (strcmp(which, "both") != 0 && strcmp(which, i ? "gpu" : "cpu") != 0)
+            continue;
+        auto_socket_duty[i] = duty;
+        trace_drop(auto_socket_trace[i]);
+        auto_socket_trace[i] = duty >= 0 ? trace_begin(TRACE_SOCKET, now) : 0;
+        fprintf(out, "%s %s trace %u\n", i ? "gpu" : "cpu", value, auto_socket_trace[i]);
+    }
+}
+
+/* One step of the RPM loop: move each fan's duty towards its target RPM,
+ * and put back a duty that was changed behind our back. */
+static void auto_trim_rpm(const int* target_rpm, int* duty) {
+    for (int i = 0; i < 2; i++) {
+        if (target_rpm[i] < 0)
+            continue;
+        int rpm, setting;
+        if (backend_read_one(i ? BACKEND_GPU_RPMS : BACKEND_CPU_RPMS, &rpm) != 0
+                || backend_read_one(i ? BACKEND_GPU_DUTY : BACKEND_CPU_DUTY, &setting) != 0)
+            continue;
+        int next = rpmtarget_trim(i, target_rpm[i], duty[i], rpm);
+        if (next != duty[i] || setting != duty[i]) {
+            if (next != duty[i])
+                printf("RPM %d: %d for %d, duty %d -> %d\n", i, rpm, target_rpm[i], duty[i], next);
+            duty[i] = next;
+            auto_write_duty(i, duty[i], 0);
+        }
+    }
+}
+
+/* Compile the cpu_fan and gpu_fan rules of the control file against the
+ * loop's variables and the configured sensors. A rule that doesn't compile
+ * leaves its fan on the stock curve. */
+static void auto_rules_compile(const char (*text)[256], expr_env* env, const sensor_config* sensors, int sensor_count) {
+    static const char* names[RULE_VARS] = { "cpu", "gpu", "cpu_pkg", "ac", "battery", "heavy" };
+    static char reported[2][256];
+    for (int i = 0; i < RULE_VARS; i++)
+        expr_env_var(env, names[i]);
+    for (int i = 0; i < sensor_count; i++) {
+        // a sensor is its chip's name, or chip_channel for a second channel
+        char name[EXPR_NAME_MAX];
+        snprintf(name, sizeof(name), "%.*s", (int) sizeof(name) - 1, sensors[i].chip);
+        auto_rule_sensor[i] = expr_env_var(env, name);
+        if (auto_rule_sensor[i] < 0) {
+            snprintf(name, sizeof(name), "%.15s_%.15s", sensors[i].chip, sensors[i].channel);
+            auto_rule_sensor[i] = expr_env_var(env, name);
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        char error[128];
+        int changed = strcmp(text[i], reported[i]) != 0;
+        snprintf(reported[i], sizeof(reported[i]), "%.*s", (int) sizeof(reported[i]) - 1, text[i]);
+        if (text[i][0] == '\0') {
+            if (changed)
+                printf("%s fan back on the stock curve\n", i ? "GPU" : "CPU");
+            auto_rule_text[i][0] = '\0';
+        } else if (expr_compile(&auto_rules[i], env, text[i], error, sizeof(error)) != 0) {
+            if (changed)
+                printf("Invalid %s_fan rule: %s\n", i ? "gpu" : "cpu", error);
+            auto_rule_text[i][0] = '\0';
+        } else {
+            if (changed)
+                printf("%s fan rule: %s (%d instructions)\n", i ? "GPU" : "CPU", text[i], auto_rules[i].length);
+            snprintf(auto_rule_text[i], sizeof(auto_rule_text[i]), "%.*s", (int) sizeof(auto_rule_text[i]) - 1, text[i]);
+        }
+    }
+    auto_rule_env = *env;
+}
+
+static void auto_rules_command(const char* args, FILE* out) {
+    fprintf(out, "vars");
+    for (int i = 0; i < auto_rule_env.var_count; i++)
+        fprintf(out, " %s %.1f", auto_rule_env.vars[i], auto_rule_vars[i]);
+    fprintf(out, "\n");
+    for (int i = 0; i < 2; i++) {
+        if (auto_rule_text[i][0] == '\0') {
+            fprintf(out, "%s_fan stock\n", i ? "gpu" : "cpu");
+            continue;
+        }
+        fprintf(out, "%s_fan %s\n", i ? "gpu" : "cpu", auto_rule_text[i]);
+        fprintf(out, "value %.1f instructions %d stack %d\n", auto_rule_value[i],
+                auto_rules[i].length, auto_rules[i].stack);
+        expr_dump(&auto_rules[i], &auto_rule_env, out);
+    }
+}
+
+static int auto_read_gpu(double* values, void* arg) {
+    char line[64];
+    if (fgets(line, sizeof(line), stdin) == NULL)
+        return feof(stdin) ? ACQUIRE_EOF : ACQUIRE_ERROR;
+    values[0] = atoi(line);
+    return 1;
+}
+
+static int auto_read_sensors(double* values, void* arg) {
+    hwmon_check();
+    hwmon_prefetch();
+    sensors_sample();
+    values[0] = sensors_duty(SENSOR_FAN_CPU);
+    values[1] = sensors_duty(SENSOR_FAN_GPU);
+    return 2;
+}
+
 static void signal_term(__sighandler_t handler) {
     signal(SIGHUP, handler);
     signal(SIGINT, handler);
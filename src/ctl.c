@@ -0,0 +1,342 @@
+/*
+ ============================================================================
+ Name        : ctl.c
+ Description : Unix socket query API of the auto mode daemon
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "util.h"
+
+#define CTL_REQUEST_MAX 512
+#define CTL_CLIENT_TIMEOUT_MS 1000  /* to send the request and read the reply */
+#define CTL_MAX_CLIENTS 8
+#define CTL_MAX_GROUPS 64
+
+typedef struct {
+    int fd;                 /* -1 for a free slot */
+    int privileged;
+    uint64_t deadline_us;
+    char request[CTL_REQUEST_MAX];
+    size_t request_len;
+    char* reply;            /* NULL while the request is still coming in */
+    size_t reply_len;
+    size_t reply_sent;
+} ctl_client;
+
+static struct {
+    const char* name;
+    const char* help;
+    ctl_handler handler;
+} ctl_commands[CTL_MAX_COMMANDS];
+
+static int ctl_command_count = 0;
+static int ctl_fd = -1;
+static int ctl_client_privileged = 0;    /* of the request being served */
+static ctl_client ctl_clients[CTL_MAX_CLIENTS];
+
+static const char* ctl_socket_path(void);
+static void ctl_accept(void);
+static void ctl_client_io(ctl_client* c);
+static void ctl_client_close(ctl_client* c);
+static void ctl_serve(ctl_client* c);
+static int ctl_peer_privileged(int client_fd);
+static void ctl_help(const char* args, FILE* out);
+
+int ctl_open(void) {
+    const char* path = ctl_socket_path();
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        printf("unable to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+            || listen(fd, 8) != 0) {
+        printf("unable to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    // anyone may query, e.g. unprivileged job schedulers; commands that
+    // change anything check the peer with ctl_privileged()
+    chmod(path, 0666);
+    // a client hanging up early must not terminate the daemon
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < CTL_MAX_CLIENTS; i++)
+        ctl_clients[i].fd = -1;
+    ctl_fd = fd;
+    ctl_register("help", "list commands", &ctl_help);
+    printf("Listening on %s\n", path);
+    return 0;
+}
+
+void ctl_close(void) {
+    if (ctl_fd < 0)
+        return;
+    for (int i = 0; i < CTL_MAX_CLIENTS; i++)
+        ctl_client_close(&ctl_clients[i]);
+    close(ctl_fd);
+    unlink(ctl_socket_path());
+    ctl_fd = -1;
+}
+
+int ctl_register(const char* name, const char* help, ctl_handler handler) {
+    for (int i = 0; i < ctl_command_count; i++) {
+        if (strcmp(ctl_commands[i].name, name) == 0) {
+            ctl_commands[i].help = help;
+            ctl_commands[i].handler = handler;
+            return 0;
+        }
+    }
+    if (ctl_command_count >= CTL_MAX_COMMANDS)
+        return -1;
+    ctl_commands[ctl_command_count].name = name;
+    ctl_commands[ctl_command_count].help = help;
+    ctl_commands[ctl_command_count].handler = handler;
+    ctl_command_count++;
+    return 0;
+}
+
+int ctl_privileged(FILE* out) {
+    if (!ctl_client_privileged)
+        fprintf(out, "error permission denied, needs root or the %s group\n", CTL_GROUP);
+    return ctl_client_privileged;
+}
+
+void ctl_wait(int timeout_ms) {
+    ctl_wait_fd(-1, timeout_ms);
+}
+
+int ctl_wait_fd(int fd, int timeout_ms) {
+    if (ctl_fd < 0 && fd < 0) {
+        usleep(timeout_ms * 1000);
+        return 0;
+    }
+    uint64_t deadline = util_now_us() + (uint64_t) timeout_ms * 1000;
+    for (;;) {
+        uint64_t now = util_now_us();
+        if (now >= deadline)
+            break;
+        uint64_t wake = deadline;
+        // fd comes first, so a ready frame always wins over the clients
+        struct pollfd fds[CTL_MAX_CLIENTS + 2];
+        ctl_client* clients[CTL_MAX_CLIENTS + 2];
+        int count = 0;
+        if (fd >= 0) {
+            fds[count] = (struct pollfd) { fd, POLLIN, 0 };
+            clients[count++] = NULL;
+        }
+        if (ctl_fd >= 0) {
+            fds[count] = (struct pollfd) { ctl_fd, POLLIN, 0 };
+            clients[count++] = NULL;
+            for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+                ctl_client* c = &ctl_clients[i];
+                if (c->fd >= 0 && now >= c->deadline_us)
+                    ctl_client_close(c);
+                if (c->fd < 0)
+                    continue;
+                fds[count] = (struct pollfd) { c->fd, c->reply != NULL ? POLLOUT : POLLIN, 0 };
+                clients[count++] = c;
+                if (c->deadline_us < wake)
+                    wake = c->deadline_us;
+            }
+        }
+        int ready = poll(fds, count, (wake - now + 999) / 1000);
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready <= 0)
+            continue;
+        for (int i = 0; i < count; i++) {
+            if (fds[i].revents == 0)
+                continue;
+            if (fds[i].fd == fd)
+                return 1;
+            if (clients[i] == NULL)
+                ctl_accept();
+            else
+                ctl_client_io(clients[i]);
+        }
+    }
+    return 0;
+}
+
+int ctl_query(const char* command, FILE* out) {
+    const char* path = ctl_socket_path();
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        printf("unable to connect to %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    char request[CTL_REQUEST_MAX];
+    int len = snprintf(request, sizeof(request), "%s\n", command);
+    if (len >= (int) sizeof(request) || write(fd, request, len) != len) {
+        close(fd);
+        return -1;
+    }
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+        fwrite(buffer, 1, n, out);
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+static const char* ctl_socket_path(void) {
+    // root unlinks and creates the socket: not overridable when setuid
+    const char* path = secure_getenv("CLEVO_SOCKET");
+    return path != NULL && path[0] != '\0' ? path : CTL_SOCKET_PATH;
+}
+
+/* Clients are non-blocking and only served between control ticks, and a
+ * client that hasn't finished within CTL_CLIENT_TIMEOUT_MS is dropped, so
+ * no client can hold up the control loop. */
+static void ctl_accept(void) {
+    int client_fd = accept4(ctl_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (client_fd < 0)
+        return;
+    for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+        ctl_client* c = &ctl_clients[i];
+        if (c->fd >= 0)
+            continue;
+        c->fd = client_fd;
+        c->privileged = ctl_peer_privileged(client_fd);
+        c->deadline_us = util_now_us() + CTL_CLIENT_TIMEOUT_MS * 1000;
+        c->request_len = 0;
+        c->reply = NULL;
+        return;
+    }
+    // busy, the client sees the connection closed without a reply
+    close(client_fd);
+}
+
+static void ctl_client_io(ctl_client* c) {
+    if (c->reply == NULL) {
+        ssize_t n = read(c->fd, c->request + c->request_len, sizeof(c->request) - 1 - c->request_len);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (n < 0) {
+            ctl_client_close(c);
+            return;
+        }
+        c->request_len += n;
+        if (n > 0 && c->request_len < sizeof(c->request) - 1
+                && memchr(c->request, '\n', c->request_len) == NULL)
+            return;
+        c->request[c->request_len] = '\0';
+        ctl_serve(c);
+        if (c->reply == NULL)
+            return;
+    }
+    while (c->reply_sent < c->reply_len) {
+        ssize_t n = send(c->fd, c->reply + c->reply_sent, c->reply_len - c->reply_sent, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (n <= 0)
+            break;
+        c->reply_sent += n;
+    }
+    ctl_client_close(c);
+}
+
+static void ctl_client_close(ctl_client* c) {
+    if (c->fd < 0)
+        return;
+    close(c->fd);
+    free(c->reply);
+    c->fd = -1;
+    c->reply = NULL;
+}
+
+/* Run the command into a memory buffer, sent from ctl_client_io(). */
+static void ctl_serve(ctl_client* c) {
+    char* request = c->request;
+    request[strcspn(request, "\r\n")] = '\0';
+    FILE* out = open_memstream(&c->reply, &c->reply_len);
+    if (out == NULL) {
+        ctl_client_close(c);
+        return;
+    }
+    char* args = request + strcspn(request, " ");
+    if (*args != '\0')
+        *args++ = '\0';
+    ctl_client_privileged = c->privileged;
+    int found = 0;
+    for (int i = 0; i < ctl_command_count && !found; i++) {
+        if (strcmp(ctl_commands[i].name, request) == 0) {
+            ctl_commands[i].handler(args, out);
+            found = 1;
+        }
+    }
+    if (!found)
+        fprintf(out, "error unknown command '%s'\n", request);
+    if (fclose(out) != 0) {
+        ctl_client_close(c);
+        return;
+    }
+    c->reply_sent = 0;
+}
+
+/* Root, or a member of CTL_GROUP, going by the credentials the peer had
+ * when it connected. */
+static int ctl_peer_privileged(int client_fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return 0;
+    if (cred.uid == 0)
+        return 1;
+    char buffer[4096];
+    struct group group, *found_group;
+    if (getgrnam_r(CTL_GROUP, &group, buffer, sizeof(buffer), &found_group) != 0 || found_group == NULL)
+        return 0;
+    gid_t gid = group.gr_gid;
+    if (cred.gid == gid)
+        return 1;
+    struct passwd passwd, *found_passwd;
+    if (getpwuid_r(cred.uid, &passwd, buffer, sizeof(buffer), &found_passwd) != 0 || found_passwd == NULL)
+        return 0;
+    gid_t groups[CTL_MAX_GROUPS];
+    int count = CTL_MAX_GROUPS;
+    if (getgrouplist(passwd.pw_name, passwd.pw_gid, groups, &count) < 0)
+        count = CTL_MAX_GROUPS;
+    for (int i = 0; i < count; i++)
+        if (groups[i] == gid)
+            return 1;
+    return 0;
+}
+
+static void ctl_help(const char* args, FILE* out) {
+    for (int i = 0; i < ctl_command_count; i++)
+        fprintf(out, "%s %s\n", ctl_commands[i].name, ctl_commands[i].help);
+}
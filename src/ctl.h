@@ -0,0 +1,52 @@
+/*
+ ============================================================================
+ Name        : ctl.h
+ Description : Unix socket query API of the auto mode daemon
+ ============================================================================
+
+ The daemon listens on CTL_SOCKET_PATH (override with $CLEVO_SOCKET). A
+ client connects, writes one line "<command> [args]\n" and reads the reply
+ until the daemon closes the connection. Replies are "key value" lines, or
+ a single "error <message>" line.
+
+ Modules register their commands with ctl_register(); the control loop
+ serves requests from ctl_wait() instead of sleeping between ticks, so
+ handlers run on the control thread. Clients are non-blocking, the reply is
+ built in memory and sent as the client reads it, and a client that hasn't
+ finished within a second is dropped: a slow or stuck client never delays
+ a tick. The socket is open to every local user; a command that changes anything
+ calls ctl_privileged() first, which only lets root and members of
+ CTL_GROUP through (SO_PEERCRED). $CLEVO_SOCKET is ignored when setuid.
+ */
+
+#ifndef CLEVO_CTL_H
+#define CLEVO_CTL_H
+
+#include <stdio.h>
+
+#define CTL_SOCKET_PATH "/run/clevo-indicator.sock"
+#define CTL_MAX_COMMANDS 32
+#define CTL_GROUP "adm"     /* the group the binary is installed for */
+
+typedef void (*ctl_handler)(const char* args, FILE* out);
+
+int ctl_open(void);
+void ctl_close(void);
+int ctl_register(const char* name, const char* help, ctl_handler handler);
+
+/* From a handler: whether the client may change anything. If not, an
+ * error line has been written to out. */
+int ctl_privileged(FILE* out);
+
+/* Serve requests for up to timeout_ms milliseconds. Without an open socket
+ * this is a plain sleep. */
+void ctl_wait(int timeout_ms);
+
+/* Like ctl_wait(), but return 1 as soon as fd becomes readable, 0 on
+ * timeout. */
+int ctl_wait_fd(int fd, int timeout_ms);
+
+/* Client side: send one command and copy the reply to out. */
+int ctl_query(const char* command, FILE* out);
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ ============================================================================
+ Name        : curve.c
+ Description : Piecewise-linear temperature to fan duty curves
+ ============================================================================
+ */
+
+#include <stdlib.h>
+
+#include "curve.h"
+
+int curve_parse(curve* c, const char* text) {
+    c->count = 0;
+    const char* p = text;
+    for (;;) {
+        while (*p == ' ' || *p == ',' || *p == '\t')
+            p++;
+        if (*p == '\0' || *p == '\n' || *p == '#')
+            break;
+        if (c->count >= CURVE_MAX_POINTS)
+            return -1;
+        char* end;
+        double temp = strtod(p, &end);
+        if (end == p || *end != ':')
+            return -1;
+        p = end + 1;
+        double duty = strtod(p, &end);
+        if (end == p || duty < 0 || duty > 100)
+            return -1;
+        p = end;
+        if (c->count > 0 && temp <= c->points[c->count - 1].temp)
+            return -1;
+        c->points[c->count].temp = temp;
+        c->points[c->count].duty = duty;
+        c->count++;
+    }
+    return c->count > 0 ? 0 : -1;
+}
+
+double curve_eval(const curve* c, double temp) {
+    if (c->count == 0)
+        return 0;
+    if (temp <= c->points[0].temp)
+        return c->points[0].duty;
+    for (int i = 1; i < c->count; i++) {
+        if (temp <= c->points[i].temp) {
+            double t0 = c->points[i - 1].temp, d0 = c->points[i - 1].duty;
+            double t1 = c->points[i].temp, d1 = c->points[i].duty;
+            return d0 + (d1 - d0) * (temp - t0) / (t1 - t0);
+        }
+    }
+    return c->points[c->count - 1].duty;
+}
@@ -0,0 +1,28 @@
+/*
+ ============================================================================
+ Name        : curve.h
+ Description : Piecewise-linear temperature to fan duty curves
+ ============================================================================
+ */
+
+#ifndef CLEVO_CURVE_H
+#define CLEVO_CURVE_H
+
+#define CURVE_MAX_POINTS 8
+
+typedef struct {
+    int count;
+    struct {
+        double temp;
+        double duty;
+    } points[CURVE_MAX_POINTS];
+} curve;
+
+/* Parse "temp:duty" pairs separated by spaces or commas, e.g.
+ * "55:0 65:40 72:100". Temperatures must increase. Returns 0 on success. */
+int curve_parse(curve* c, const char* text);
+
+/* Duty for a temperature: linear between points, flat beyond the ends. */
+double curve_eval(const curve* c, double temp);
+
+#endif
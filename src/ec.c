@@ -0,0 +1,336 @@
+/*
+ ============================================================================
+ Name        : ec.c
+ Description : Resumable EC port transactions
+ ============================================================================
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/io.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "ec.h"
+#include "quantile.h"
+#include "util.h"
+
+/* ec_result() while the transaction is still queued. */
+#define EC_PENDING 1
+
+typedef enum {
+    EC_STEP_WAIT_IBF_CLEAR,
+    EC_STEP_WAIT_OBF_SET,
+    EC_STEP_OUT_CMD,
+    EC_STEP_OUT_REG,
+    EC_STEP_OUT_VALUE,
+    EC_STEP_IN_VALUE,
+    EC_STEP_END
+} ec_step;
+
+static const ec_step ec_read_steps[] = {
+        EC_STEP_WAIT_IBF_CLEAR, EC_STEP_OUT_CMD,
+        EC_STEP_WAIT_IBF_CLEAR, EC_STEP_OUT_REG,
+        EC_STEP_WAIT_OBF_SET, EC_STEP_IN_VALUE,
+        EC_STEP_END
+};
+
+static const ec_step ec_write_steps[] = {
+        EC_STEP_WAIT_IBF_CLEAR, EC_STEP_OUT_CMD,
+        EC_STEP_WAIT_IBF_CLEAR, EC_STEP_OUT_REG,
+        EC_STEP_WAIT_IBF_CLEAR, EC_STEP_OUT_VALUE,
+        EC_STEP_WAIT_IBF_CLEAR,
+        EC_STEP_END
+};
+
+typedef struct {
+    const ec_step* steps;
+    int step;
+    uint8_t cmd;
+    uint8_t reg;
+    uint8_t value;              /* written, or read back */
+    uint8_t write_value;        /* kept for re-issuing a write */
+    uint64_t wait_started_us;   /* 0 while not waiting on a flag */
+    uint64_t not_before_us;     /* backoff before a retry */
+    uint64_t submitted_us;
+    int attempt;
+    int drain;                  /* our last attempt timed out */
+    int status;
+    int busy;                   /* submitted and result not yet collected */
+} ec_xfer;
+
+static struct {
+    unsigned long transactions;
+    unsigned long ok;
+    unsigned long retries;
+    unsigned long recovered;    /* retries that then succeeded */
+    unsigned long timeouts_ibf;
+    unsigned long timeouts_obf;
+    unsigned long drained;      /* stale bytes read off the output buffer */
+    unsigned long failed;       /* errors handed to the caller */
+    unsigned long busy;
+} ec_stats;
+
+/* Serialises the queue and the ports between the acquisition and actuation
+ * threads; held only while stepping, never across a wait. */
+static pthread_mutex_t ec_lock = PTHREAD_MUTEX_INITIALIZER;
+static ec_xfer ec_queue[EC_QUEUE_MAX];
+static unsigned long ec_head = 0;   /* oldest unfinished transaction */
+static unsigned long ec_tail = 0;   /* next ticket */
+static ec_policy ec_current_policy = EC_DEFAULT_POLICY;
+
+static long ec_submit_read(uint8_t reg);
+static long ec_submit_write(uint8_t cmd, uint8_t reg, uint8_t value);
+static long ec_submit(const ec_step* steps, uint8_t cmd, uint8_t reg,
+        uint8_t value);
+static int ec_poll(void);
+static int ec_result(long ticket, uint8_t* value);
+static ec_error ec_wait(long ticket, uint8_t* value);
+static int ec_advance(ec_xfer* x, uint64_t now);
+static int ec_drain(void);
+static void ec_command(const char* args, FILE* out);
+
+void ec_configure(const ec_policy* policy) {
+    pthread_mutex_lock(&ec_lock);
+    ec_current_policy = *policy;
+    if (ec_current_policy.retries < 0)
+        ec_current_policy.retries = 0;
+    if (ec_current_policy.backoff_ms < 0)
+        ec_current_policy.backoff_ms = 0;
+    if (ec_current_policy.backoff_max_ms < ec_current_policy.backoff_ms)
+        ec_current_policy.backoff_max_ms = ec_current_policy.backoff_ms;
+    pthread_mutex_unlock(&ec_lock);
+}
+
+/* Queue a register read or a command, return a ticket or -1 when the
+ * queue is full. */
+static long ec_submit_read(uint8_t reg) {
+    return ec_submit(ec_read_steps, EC_SC_READ_CMD, reg, 0);
+}
+
+static long ec_submit_write(uint8_t cmd, uint8_t reg, uint8_t value) {
+    return ec_submit(ec_write_steps, cmd, reg, value);
+}
+
+/* Advance queued transactions without waiting, return how many are still
+ * pending. */
+static int ec_poll(void) {
+    pthread_mutex_lock(&ec_lock);
+    uint64_t now = util_now_us();
+    while (ec_head != ec_tail) {
+        ec_xfer* x = &ec_queue[ec_head % EC_QUEUE_MAX];
+        if (now < x->not_before_us)
+            break;
+        int status = ec_advance(x, now);
+        if (status == EC_PENDING)
+            break;
+        if (status != EC_OK && x->attempt < ec_current_policy.retries) {
+            // re-issue the whole handshake after a backoff
+            int backoff_ms = ec_current_policy.backoff_ms << x->attempt;
+            if (backoff_ms > ec_current_policy.backoff_max_ms || backoff_ms < 0)
+                backoff_ms = ec_current_policy.backoff_max_ms;
+            x->attempt++;
+            x->step = 0;
+            x->wait_started_us = 0;
+            x->drain = status == EC_ERR_TIMEOUT;
+            x->value = x->write_value;
+            x->not_before_us = now + (uint64_t) backoff_ms * 1000;
+            ec_stats.retries++;
+            continue;
+        }
+        x->status = status;
+        // submission to outcome, retries and backoff included
+        quantile_add(QUANTILE_EC_LATENCY, now - x->submitted_us);
+        if (status == EC_OK) {
+            ec_stats.ok++;
+            if (x->attempt > 0)
+                ec_stats.recovered++;
+        } else {
+            ec_stats.failed++;
+            printf("EC transaction 0x%x/0x%x failed after %d attempts: %s\n",
+                    x->cmd, x->reg, x->attempt + 1, ec_strerror(status));
+        }
+        ec_head++;
+    }
+    int pending = ec_tail - ec_head;
+    pthread_mutex_unlock(&ec_lock);
+    return pending;
+}
+
+/* EC_PENDING, or the ec_error once; a finished ticket is released. */
+static int ec_result(long ticket, uint8_t* value) {
+    pthread_mutex_lock(&ec_lock);
+    ec_xfer* x = &ec_queue[ticket % EC_QUEUE_MAX];
+    int status = x->status;
+    if (status != EC_PENDING) {
+        if (value != NULL)
+            *value = x->value;
+        x->busy = 0;
+    }
+    pthread_mutex_unlock(&ec_lock);
+    return status;
+}
+
+/* Drive the queue until the ticket finishes, sleeping while the EC isn't
+ * ready. */
+static ec_error ec_wait(long ticket, uint8_t* value) {
+    if (ticket < 0)
+        return EC_ERR_BUSY;
+    for (;;) {
+        ec_poll();
+        int status = ec_result(ticket, value);
+        if (status != EC_PENDING)
+            return status;
+        usleep(EC_POLL_US);
+    }
+}
+
+ec_error ec_read(uint8_t reg, uint8_t* value) {
+    return ec_wait(ec_submit_read(reg), value);
+}
+
+ec_error ec_write(uint8_t cmd, uint8_t reg, uint8_t value) {
+    return ec_wait(ec_submit_write(cmd, reg, value), NULL);
+}
+
+ec_error ec_read_batch(const uint8_t* regs, uint8_t* values, int count) {
+    long tickets[EC_QUEUE_MAX];
+    if (count > EC_QUEUE_MAX)
+        count = EC_QUEUE_MAX;
+    for (int i = 0; i < count; i++)
+        tickets[i] = ec_submit_read(regs[i]);
+    ec_error result = EC_OK;
+    for (int i = 0; i < count; i++) {
+        ec_error error = ec_wait(tickets[i], &values[i]);
+        if (error != EC_OK && result == EC_OK)
+            result = error;
+    }
+    return result;
+}
+
+const char* ec_strerror(ec_error error) {
+    switch (error) {
+    case EC_OK:
+        return "ok";
+    case EC_ERR_TIMEOUT:
+        return "timeout";
+    case EC_ERR_BUSY:
+        return "queue full";
+    }
+    return "unknown error";
+}
+
+int ec_fan_duty(int raw_duty) {
+    return (int) ((double) raw_duty / 255.0 * 100.0 + 0.5);
+}
+
+int ec_fan_duty_raw(int duty_percentage) {
+    return (int) ((double) duty_percentage / 100.0 * 255.0 + 0.5);
+}
+
+int ec_fan_rpms(int raw_rpm_high, int raw_rpm_low) {
+    int raw_rpm = (raw_rpm_high << 8) + raw_rpm_low;
+    return raw_rpm > 0 ? (2156220 / raw_rpm) : 0;
+}
+
+void ec_register(void) {
+    ctl_register("ec", "EC transaction outcomes and retry policy", &ec_command);
+}
+
+static long ec_submit(const ec_step* steps, uint8_t cmd, uint8_t reg,
+        uint8_t value) {
+    pthread_mutex_lock(&ec_lock);
+    ec_xfer* x = &ec_queue[ec_tail % EC_QUEUE_MAX];
+    if (x->busy) {
+        ec_stats.busy++;
+        pthread_mutex_unlock(&ec_lock);
+        printf("EC queue full, dropping transaction 0x%x/0x%x\n", cmd, reg);
+        return -1;
+    }
+    memset(x, 0, sizeof(*x));
+    x->steps = steps;
+    x->cmd = cmd;
+    x->reg = reg;
+    x->value = value;
+    x->write_value = value;
+    x->status = EC_PENDING;
+    x->submitted_us = util_now_us();
+    x->busy = 1;
+    ec_stats.transactions++;
+    long ticket = ec_tail++;
+    pthread_mutex_unlock(&ec_lock);
+    return ticket;
+}
+
+/* Run steps until one has to wait for the EC. */
+static int ec_advance(ec_xfer* x, uint64_t now) {
+    if (x->step == 0 && x->drain) {
+        /* The answer to the attempt that timed out may have come in during
+         * the backoff and would be taken for this one's. Only after our own
+         * timeout: otherwise a full output buffer holds a byte the kernel's
+         * EC driver is about to collect. */
+        ec_stats.drained += ec_drain();
+        x->drain = 0;
+    }
+    for (;;) {
+        ec_step step = x->steps[x->step];
+        if (step == EC_STEP_WAIT_IBF_CLEAR || step == EC_STEP_WAIT_OBF_SET) {
+            uint32_t flag = step == EC_STEP_WAIT_IBF_CLEAR ? IBF : OBF;
+            int value = step == EC_STEP_WAIT_IBF_CLEAR ? 0 : 1;
+            uint8_t data = inb(EC_SC);
+            if (((data >> flag) & 0x1) != value) {
+                if (x->wait_started_us == 0)
+                    x->wait_started_us = now;
+                else if (now - x->wait_started_us > EC_STEP_TIMEOUT_US) {
+                    if (flag == IBF)
+                        ec_stats.timeouts_ibf++;
+                    else
+                        ec_stats.timeouts_obf++;
+                    return EC_ERR_TIMEOUT;
+                }
+                return EC_PENDING;
+            }
+            x->wait_started_us = 0;
+        } else if (step == EC_STEP_OUT_CMD) {
+            outb(x->cmd, EC_SC);
+        } else if (step == EC_STEP_OUT_REG) {
+            outb(x->reg, EC_DATA);
+        } else if (step == EC_STEP_OUT_VALUE) {
+            outb(x->value, EC_DATA);
+        } else if (step == EC_STEP_IN_VALUE) {
+            x->value = inb(EC_DATA);
+        } else {
+            return EC_OK;
+        }
+        x->step++;
+    }
+}
+
+/* Read stale bytes off the output buffer. Returns how many. */
+static int ec_drain(void) {
+    int count = 0;
+    while (count < EC_DRAIN_MAX && ((inb(EC_SC) >> OBF) & 0x1)) {
+        inb(EC_DATA);
+        count++;
+    }
+    return count;
+}
+
+static void ec_command(const char* args, FILE* out) {
+    pthread_mutex_lock(&ec_lock);
+    fprintf(out, "transactions %lu\n", ec_stats.transactions);
+    fprintf(out, "ok %lu\n", ec_stats.ok);
+    fprintf(out, "retries %lu\n", ec_stats.retries);
+    fprintf(out, "recovered %lu\n", ec_stats.recovered);
+    fprintf(out, "timeouts_ibf %lu\n", ec_stats.timeouts_ibf);
+    fprintf(out, "timeouts_obf %lu\n", ec_stats.timeouts_obf);
+    fprintf(out, "drained_bytes %lu\n", ec_stats.drained);
+    fprintf(out, "failed %lu\n", ec_stats.failed);
+    fprintf(out, "queue_full %lu\n", ec_stats.busy);
+    fprintf(out, "pending %lu\n", ec_tail - ec_head);
+    fprintf(out, "policy_retries %d\n", ec_current_policy.retries);
+    fprintf(out, "policy_backoff_ms %d\n", ec_current_policy.backoff_ms);
+    fprintf(out, "policy_backoff_max_ms %d\n", ec_current_policy.backoff_max_ms);
+    pthread_mutex_unlock(&ec_lock);
+}
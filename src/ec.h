@@ -0,0 +1,106 @@
+/*
+ ============================================================================
+ Name        : ec.h
+ Description : Resumable EC port transactions
+ ============================================================================
+
+ An EC transaction is a handshake on the command/status port EC_SC and the
+ data port EC_DATA: wait for the input buffer to drain (IBF clear), write a
+ byte, wait again, ... and, for reads, wait for the output buffer to fill
+ (OBF set) before reading the answer. Transactions go through one queue
+ shared by the acquisition and actuation threads, each stepped only as far
+ as the EC is ready. A caller blocks in ec_read(), ec_write() or
+ ec_read_batch(), advancing the queue and sleeping EC_POLL_US whenever the
+ EC isn't ready yet. Whichever thread is waiting drives everyone's
+ transactions, and only the oldest one ever touches the ports, so a batch
+ of reads and a fan write never interleave. ec_read_batch() queues all of
+ its reads up front, so they run back to back without a round trip
+ through the caller.
+
+ A transaction that fails is retried according to the ec_policy: the whole
+ handshake is re-issued after an exponential backoff. When the attempt
+ timed out, the late answer it may have left in the output buffer is
+ drained first; the buffer is left alone otherwise, as it can hold a byte
+ the kernel's own EC driver is waiting for. Only when the retries are used
+ up does the caller see the error. Every outcome is
+ counted; the "ec" socket command shows the counters.
+ */
+
+#ifndef CLEVO_EC_H
+#define CLEVO_EC_H
+
+#include <stdint.h>
+
+#define EC_SC 0x66
+#define EC_DATA 0x62
+
+#define IBF 1
+#define OBF 0
+#define EC_SC_READ_CMD 0x80
+
+/* EC registers can be read by EC_SC_READ_CMD or /sys/kernel/debug/ec/ec0/io:
+ *
+ * 1. modprobe ec_sys
+ * 2. od -Ax -t x1 /sys/kernel/debug/ec/ec0/io
+ */
+
+#define P775DM3 //THIS IS THE MODEL DEFINITION, TO FIND THE ADDRESSES IN THE EC
+
+#define EC_REG_SIZE 0x100
+
+#define EC_REG_CPU_FAN_DUTY 0xCE
+#define EC_REG_CPU_TEMP 0x07
+#define EC_REG_CPU_FAN_RPMS_HI 0xD0
+#define EC_REG_CPU_FAN_RPMS_LO 0xD1
+#define EC_REG_GPU_FAN_RPMS_HI 0xD2
+#define EC_REG_GPU_FAN_RPMS_LO 0xD3
+#define EC_REG_GPU_TEMP 0xCD
+#define EC_REG_GPU_FAN_DUTY 0xCF
+
+/* Command setting a fan duty: 0x99, fan (1 CPU, 2 GPU), raw duty 0-255. */
+#define EC_CMD_FAN_DUTY 0x99
+
+#define EC_QUEUE_MAX 32
+/* Sleep between polls while the EC isn't ready. */
+#define EC_POLL_US 1000
+/* Longest wait for a single IBF/OBF change. */
+#define EC_STEP_TIMEOUT_US 100000
+/* Bytes read off the output buffer after a timeout at most. */
+#define EC_DRAIN_MAX 16
+
+typedef enum {
+    EC_OK = 0,
+    EC_ERR_TIMEOUT = -1,    /* IBF never cleared or OBF never set */
+    EC_ERR_BUSY = -3        /* transaction queue full */
+} ec_error;
+
+typedef struct {
+    int retries;            /* re-issues after the first attempt */
+    int backoff_ms;         /* before the first retry, doubled each time */
+    int backoff_max_ms;
+} ec_policy;
+
+#define EC_DEFAULT_POLICY { 2, 5, 50 }
+
+void ec_configure(const ec_policy* policy);
+
+/* Read a register, or send a command with register and value such as the
+ * 0x99 fan duty write; block until done and return the ec_error.
+ * ec_read_batch() queues all reads before waiting for any of them and
+ * returns the first error. */
+ec_error ec_read(uint8_t reg, uint8_t* value);
+ec_error ec_write(uint8_t cmd, uint8_t reg, uint8_t value);
+ec_error ec_read_batch(const uint8_t* regs, uint8_t* values, int count);
+
+const char* ec_strerror(ec_error error);
+
+/* Raw duty register (0-255) to percent and back, and the RPM registers to
+ * RPM. */
+int ec_fan_duty(int raw_duty);
+int ec_fan_duty_raw(int duty_percentage);
+int ec_fan_rpms(int raw_rpm_high, int raw_rpm_low);
+
+/* Register the "ec" socket command. */
+void ec_register(void);
+
+#endif
@@ -0,0 +1,479 @@
+/*
+ ============================================================================
+ Name        : expr.c
+ Description : Fan rule expressions compiled to bytecode
+ ============================================================================
+ */
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+#include "util.h"
+
+typedef enum {
+    EXPR_CONST = 0, EXPR_LOAD, EXPR_ADD, EXPR_SUB, EXPR_MUL, EXPR_DIV, EXPR_NEG,
+    EXPR_MAX, EXPR_MIN, EXPR_CLAMP, EXPR_LT, EXPR_LE, EXPR_GT, EXPR_GE, EXPR_EQ,
+    EXPR_NE, EXPR_AND, EXPR_OR, EXPR_NOT, EXPR_CURVE, EXPR_ELSE, EXPR_OPS
+} expr_op;
+
+static const char* op_names[EXPR_OPS] = { "const", "load", "add", "sub", "mul", "div", "neg",
+        "max", "min", "clamp", "lt", "le", "gt", "ge", "eq", "ne", "and", "or", "not", "curve",
+        "else" };
+
+/* Compiler state: a recursive descent parser emitting code as it goes. */
+typedef struct {
+    const char* p;
+    const char* text;
+    const expr_env* env;
+    expr_program* program;
+    int depth;
+    int curve_map[EXPR_MAX_CURVES];     /* env curve -> program curve */
+    char* error;
+    size_t error_size;
+    int failed;
+} expr_parser;
+
+static void expr_fail(expr_parser* ps, const char* format, ...);
+static void expr_emit(expr_parser* ps, expr_op op, int arg, int pushes, int pops);
+static void expr_skip(expr_parser* ps);
+static int expr_accept(expr_parser* ps, const char* symbol);
+static int expr_keyword(expr_parser* ps, const char* word);
+static int expr_ident(expr_parser* ps, char* name);
+static void expr_cond(expr_parser* ps);
+static void expr_or(expr_parser* ps);
+static void expr_and(expr_parser* ps);
+static void expr_not(expr_parser* ps);
+static void expr_cmp(expr_parser* ps);
+static void expr_add(expr_parser* ps);
+static void expr_mul(expr_parser* ps);
+static void expr_unary(expr_parser* ps);
+static void expr_primary(expr_parser* ps);
+static void expr_call(expr_parser* ps, const char* name, const char* start);
+static int expr_find(const char (*names)[EXPR_NAME_MAX], int count, const char* name);
+
+int expr_env_var(expr_env* env, const char* name) {
+    if (env->var_count >= EXPR_MAX_VARS || strlen(name) >= EXPR_NAME_MAX
+            || expr_find(env->vars, env->var_count, name) >= 0)
+        return -1;
+    strcpy(env->vars[env->var_count], name);
+    return env->var_count++;
+}
+
+int expr_env_curve(expr_env* env, const char* name, const curve* c) {
+    int i = expr_find(env->curve_names, env->curve_count, name);
+    if (i >= 0) {
+        // a configured curve replaces a predefined one
+        env->curves[i] = *c;
+        return i;
+    }
+    if (env->curve_count >= EXPR_MAX_CURVES || strlen(name) >= EXPR_NAME_MAX)
+        return -1;
+    strcpy(env->curve_names[env->curve_count], name);
+    env->curves[env->curve_count] = *c;
+    return env->curve_count++;
+}
+
+int expr_compile(expr_program* program, const expr_env* env, const char* text,
+        char* error, size_t error_size) {
+    expr_parser ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.p = ps.text = text;
+    ps.env = env;
+    ps.program = program;
+    ps.error = error;
+    ps.error_size = error_size;
+    for (int i = 0; i < EXPR_MAX_CURVES; i++)
+        ps.curve_map[i] = -1;
+    memset(program, 0, sizeof(*program));
+    expr_cond(&ps);
+    expr_skip(&ps);
+    if (!ps.failed && *ps.p != '\0' && *ps.p != '#')
+        expr_fail(&ps, "unexpected input");
+    return ps.failed ? -1 : 0;
+}
+
+double expr_eval(const expr_program* program, const double* vars) {
+    double stack[EXPR_STACK];
+    int sp = 0;
+    for (int pc = 0; pc < program->length; pc++) {
+        const expr_insn* insn = &program->code[pc];
+        switch (insn->op) {
+        case EXPR_CONST: stack[sp++] = program->consts[insn->arg]; break;
+        case EXPR_LOAD: stack[sp++] = vars[insn->arg]; break;
+        case EXPR_ADD: sp--; stack[sp - 1] += stack[sp]; break;
+        case EXPR_SUB: sp--; stack[sp - 1] -= stack[sp]; break;
+        case EXPR_MUL: sp--; stack[sp - 1] *= stack[sp]; break;
+        case EXPR_DIV: sp--; stack[sp - 1] /= stack[sp]; break;
+        case EXPR_NEG: stack[sp - 1] = -stack[sp - 1]; break;
+        case EXPR_MAX: sp--; if (stack[sp] > stack[sp - 1]) stack[sp - 1] = stack[sp]; break;
+        case EXPR_MIN: sp--; if (stack[sp] < stack[sp - 1]) stack[sp - 1] = stack[sp]; break;
+        case EXPR_CLAMP:
+            sp -= 2;
+            if (stack[sp - 1] > stack[sp + 1]) stack[sp - 1] = stack[sp + 1];
+            if (stack[sp - 1] < stack[sp]) stack[sp - 1] = stack[sp];
+            break;
+        case EXPR_LT: sp--; stack[sp - 1] = stack[sp - 1] < stack[sp]; break;
+        case EXPR_LE: sp--; stack[sp - 1] = stack[sp - 1] <= stack[sp]; break;
+        case EXPR_GT: sp--; stack[sp - 1] = stack[sp - 1] > stack[sp]; break;
+        case EXPR_GE: sp--; stack[sp - 1] = stack[sp - 1] >= stack[sp]; break;
+        case EXPR_EQ: sp--; stack[sp - 1] = stack[sp - 1] == stack[sp]; break;
+        case EXPR_NE: sp--; stack[sp - 1] = stack[sp - 1] != stack[sp]; break;
+        case EXPR_AND: sp--; stack[sp - 1] = stack[sp - 1] != 0 && stack[sp] != 0; break;
+        case EXPR_OR: sp--; stack[sp - 1] = stack[sp - 1] != 0 || stack[sp] != 0; break;
+        case EXPR_NOT: stack[sp - 1] = stack[sp - 1] == 0; break;
+        case EXPR_CURVE:
+            stack[sp - 1] = curve_eval(&program->curves[insn->arg], stack[sp - 1]);
+            break;
+        case EXPR_ELSE:
+            // "a if c else b": a and c are on the stack, b follows
+            if (stack[--sp] != 0)
+                pc += insn->arg;
+            else
+                sp--;
+            break;
+        }
+    }
+    return sp > 0 ? stack[0] : 0;
+}
+
+void expr_dump(const expr_program* program, const expr_env* env, FILE* out) {
+    for (int pc = 0; pc < program->length; pc++) {
+        const expr_insn* insn = &program->code[pc];
+        fprintf(out, "  %3d %s", pc, op_names[insn->op]);
+        if (insn->op == EXPR_CONST)
+            fprintf(out, " %g", program->consts[insn->arg]);
+        else if (insn->op == EXPR_LOAD)
+            fprintf(out, " %s", env->vars[insn->arg]);
+        else if (insn->op == EXPR_CURVE)
+            fprintf(out, " #%d", insn->arg);
+        else if (insn->op == EXPR_ELSE)
+            fprintf(out, " +%d", insn->arg);
+        fprintf(out, "\n");
+    }
+}
+
+int expr_bench(const char* text, int iterations, FILE* out) {
+    expr_env env;
+    memset(&env, 0, sizeof(env));
+    curve stock, quiet;
+    curve_parse(&stock, EXPR_STOCK_CURVE);
+    curve_parse(&quiet, "50:0 60:20 80:60 90:100");
+    expr_env_curve(&env, "curve", &stock);
+    expr_env_curve(&env, "quiet", &quiet);
+    expr_env_var(&env, "cpu");
+    expr_env_var(&env, "gpu");
+    expr_env_var(&env, "nvme");
+    expr_env_var(&env, "ac");
+    if (text == NULL)
+        text = "max(curve(cpu), curve(nvme) + 10) if ac else quiet(cpu) - 5";
+    expr_program program;
+    char error[128];
+    if (expr_compile(&program, &env, text, error, sizeof(error)) != 0) {
+        fprintf(out, "%s\n", error);
+        return -1;
+    }
+    fprintf(out, "%s\n", text);
+    expr_dump(&program, &env, out);
+    // temperatures sweep 40..103°C and the power source flips, so neither
+    // the branches nor the curve segments are always the same
+    double vars[4];
+    volatile double sink = 0;
+    uint64_t start = util_now_us();
+    for (int i = 0; i < iterations; i++) {
+        vars[0] = 40 + (i & 63);
+        vars[1] = 40 + ((i >> 1) & 63);
+        vars[2] = 30 + ((i >> 2) & 63);
+        vars[3] = (i >> 3) & 1;
+        sink += expr_eval(&program, vars);
+    }
+    uint64_t elapsed = util_now_us() - start;
+    double ns = elapsed * 1000.0 / iterations;
+    fprintf(out, "%d instructions, stack %d, %.1f ns/eval (%s the 1 us budget)\n",
+            program.length, program.stack, ns, ns < 1000 ? "within" : "OVER");
+    return 0;
+}
+
+static void expr_fail(expr_parser* ps, const char* format, ...) {
+    if (ps->failed)
+        return;
+    ps->failed = 1;
+    char message[96];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    snprintf(ps->error, ps->error_size, "%s at column %d", message, (int) (ps->p - ps->text) + 1);
+}
+
+static void expr_emit(expr_parser* ps, expr_op op, int arg, int pushes, int pops) {
+    if (ps->failed)
+        return;
+    if (ps->program->length >= EXPR_MAX_CODE) {
+        expr_fail(ps, "expression too long");
+        return;
+    }
+    expr_insn* insn = &ps->program->code[ps->program->length++];
+    insn->op = op;
+    insn->arg = arg;
+    ps->depth += pushes - pops;
+    if (ps->depth > ps->program->stack)
+        ps->program->stack = ps->depth;
+    if (ps->depth > EXPR_STACK)
+        expr_fail(ps, "expression nested too deeply");
+}
+
+static void expr_skip(expr_parser* ps) {
+    while (isspace((unsigned char) *ps->p))
+        ps->p++;
+}
+
+static int expr_accept(expr_parser* ps, const char* symbol) {
+    expr_skip(ps);
+    size_t len = strlen(symbol);
+    if (strncmp(ps->p, symbol, len) != 0)
+        return 0;
+    // "<" must not take the first half of "<="
+    if (len == 1 && strchr("<>=!", symbol[0]) != NULL && ps->p[1] == '=')
+        return 0;
+    ps->p += len;
+    return 1;
+}
+
+static int expr_keyword(expr_parser* ps, const char* word) {
+    expr_skip(ps);
+    size_t len = strlen(word);
+    if (strncmp(ps->p, word, len) != 0 || isalnum((unsigned char) ps->p[len]) || ps->p[len] == '_')
+        return 0;
+    ps->p += len;
+    return 1;
+}
+
+static int expr_ident(expr_parser* ps, char* name) {
+    expr_skip(ps);
+    const char* p = ps->p;
+    if (!isalpha((unsigned char) *p) && *p != '_')
+        return 0;
+    int len = 0;
+    while (isalnum((unsigned char) p[len]) || p[len] == '_')
+        len++;
+    if (len >= EXPR_NAME_MAX) {
+        expr_fail(ps, "name too long");
+        return 0;
+    }
+    memcpy(name, p, len);
+    name[len] = '\0';
+    ps->p += len;
+    return 1;
+}
+
+/* cond := or [ "if" or "else" cond ] */
+static void expr_cond(expr_parser* ps) {
+    expr_or(ps);
+    if (!expr_keyword(ps, "if"))
+        return;
+    expr_or(ps);
+    if (!expr_keyword(ps, "else")) {
+        expr_fail(ps, "'if' without 'else'");
+        return;
+    }
+    int at = ps->program->length;
+    // the else branch starts from below the value of the then branch
+    expr_emit(ps, EXPR_ELSE, 0, 0, 2);
+    expr_cond(ps);
+    if (!ps->failed)
+        ps->program->code[at].arg = ps->program->length - at - 1;
+}
+
+static void expr_or(expr_parser* ps) {
+    expr_and(ps);
+    while (!ps->failed && expr_keyword(ps, "or")) {
+        expr_and(ps);
+        expr_emit(ps, EXPR_OR, 0, 1, 2);
+    }
+}
+
+static void expr_and(expr_parser* ps) {
+    expr_not(ps);
+    while (!ps->failed && expr_keyword(ps, "and")) {
+        expr_not(ps);
+        expr_emit(ps, EXPR_AND, 0, 1, 2);
+    }
+}
+
+static void expr_not(expr_parser* ps) {
+    if (expr_keyword(ps, "not")) {
+        expr_not(ps);
+        expr_emit(ps, EXPR_NOT, 0, 1, 1);
+    } else {
+        expr_cmp(ps);
+    }
+}
+
+static void expr_cmp(expr_parser* ps) {
+    static const struct {
+        const char* symbol;
+        expr_op op;
+    } comparisons[] = { { "<=", EXPR_LE }, { ">=", EXPR_GE }, { "==", EXPR_EQ },
+            { "!=", EXPR_NE }, { "<", EXPR_LT }, { ">", EXPR_GT } };
+    expr_add(ps);
+    for (int i = 0; i < 6 && !ps->failed; i++) {
+        if (expr_accept(ps, comparisons[i].symbol)) {
+            expr_add(ps);
+            expr_emit(ps, comparisons[i].op, 0, 1, 2);
+            break;
+        }
+    }
+}
+
+static void expr_add(expr_parser* ps) {
+    expr_mul(ps);
+    while (!ps->failed) {
+        if (expr_accept(ps, "+")) {
+            expr_mul(ps);
+            expr_emit(ps, EXPR_ADD, 0, 1, 2);
+        } else if (expr_accept(ps, "-")) {
+            expr_mul(ps);
+            expr_emit(ps, EXPR_SUB, 0, 1, 2);
+        } else {
+            break;
+        }
+    }
+}
+
+static void expr_mul(expr_parser* ps) {
+    expr_unary(ps);
+    while (!ps->failed) {
+        if (expr_accept(ps, "*")) {
+            expr_unary(ps);
+            expr_emit(ps, EXPR_MUL, 0, 1, 2);
+        } else if (expr_accept(ps, "/")) {
+            expr_unary(ps);
+            expr_emit(ps, EXPR_DIV, 0, 1, 2);
+        } else {
+            break;
+        }
+    }
+}
+
+static void expr_unary(expr_parser* ps) {
+    if (expr_accept(ps, "-")) {
+        expr_unary(ps);
+        expr_emit(ps, EXPR_NEG, 0, 1, 1);
+    } else {
+        expr_primary(ps);
+    }
+}
+
+static void expr_primary(expr_parser* ps) {
+    if (ps->failed)
+        return;
+    expr_skip(ps);
+    if (expr_accept(ps, "(")) {
+        expr_cond(ps);
+        if (!expr_accept(ps, ")"))
+            expr_fail(ps, "missing ')'");
+        return;
+    }
+    if (isdigit((unsigned char) *ps->p) || *ps->p == '.') {
+        char* end;
+        double value = strtod(ps->p, &end);
+        if (end == ps->p) {
+            expr_fail(ps, "bad number");
+            return;
+        }
+        ps->p = end;
+        expr_program* program = ps->program;
+        int i = 0;
+        while (i < program->const_count && program->consts[i] != value)
+            i++;
+        if (i == program->const_count) {
+            if (i >= EXPR_MAX_CONSTS) {
+                expr_fail(ps, "too many numbers");
+                return;
+            }
+            program->consts[program->const_count++] = value;
+        }
+        expr_emit(ps, EXPR_CONST, i, 1, 0);
+        return;
+    }
+    char name[EXPR_NAME_MAX];
+    const char* start = ps->p;
+    if (!expr_ident(ps, name)) {
+        expr_fail(ps, *ps->p ? "unexpected '%c'" : "unexpected end", *ps->p);
+        return;
+    }
+    static const char* keywords[] = { "if", "else", "and", "or", "not" };
+    for (int i = 0; i < 5; i++) {
+        if (strcmp(name, keywords[i]) == 0) {
+            ps->p = start;
+            expr_fail(ps, "unexpected '%s'", name);
+            return;
+        }
+    }
+    if (expr_accept(ps, "(")) {
+        expr_call(ps, name, start);
+        return;
+    }
+    int var = expr_find(ps->env->vars, ps->env->var_count, name);
+    if (var < 0) {
+        ps->p = start;
+        expr_fail(ps, "unknown variable '%s'", name);
+        return;
+    }
+    expr_emit(ps, EXPR_LOAD, var, 1, 0);
+}
+
+/* max(a, b, ...), min(a, b, ...), clamp(x, lo, hi) or <curve>(x), after the
+ * opening parenthesis; start is where the name began. */
+static void expr_call(expr_parser* ps, const char* name, const char* start) {
+    int args = 0;
+    if (!expr_accept(ps, ")")) {
+        do {
+            expr_cond(ps);
+            args++;
+        } while (!ps->failed && expr_accept(ps, ","));
+        if (!expr_accept(ps, ")"))
+            expr_fail(ps, "missing ')'");
+    }
+    if (ps->failed)
+        return;
+    if (strcmp(name, "max") == 0 || strcmp(name, "min") == 0) {
+        if (args == 0)
+            expr_fail(ps, "%s() needs arguments", name);
+        for (int i = 1; i < args; i++)
+            expr_emit(ps, name[1] == 'a' ? EXPR_MAX : EXPR_MIN, 0, 1, 2);
+        return;
+    }
+    if (strcmp(name, "clamp") == 0) {
+        if (args != 3)
+            expr_fail(ps, "clamp() takes 3 arguments");
+        expr_emit(ps, EXPR_CLAMP, 0, 1, 3);
+        return;
+    }
+    int c = expr_find(ps->env->curve_names, ps->env->curve_count, name);
+    if (c < 0) {
+        ps->p = start;
+        expr_fail(ps, "unknown function or curve '%s'", name);
+        return;
+    }
+    if (args != 1) {
+        expr_fail(ps, "%s() takes 1 argument", name);
+        return;
+    }
+    expr_program* program = ps->program;
+    if (ps->curve_map[c] < 0) {
+        ps->curve_map[c] = program->curve_count;
+        program->curves[program->curve_count++] = ps->env->curves[c];
+    }
+    expr_emit(ps, EXPR_CURVE, ps->curve_map[c], 1, 1);
+}
+
+static int expr_find(const char (*names)[EXPR_NAME_MAX], int count, const char* name) {
+    for (int i = 0; i < count; i++)
+        if (strcmp(names[i], name) == 0)
+            return i;
+    return -1;
+}
@@ -0,0 +1,87 @@
+/*
+ ============================================================================
+ Name        : expr.h
+ Description : Fan rule expressions compiled to bytecode
+ ============================================================================
+
+ A fan rule is an expression over the temperatures and state the control
+ loop knows, e.g.
+
+     max(curve(cpu), curve(nvme) + 10) if ac else quiet(cpu) - 5
+
+ with numbers, variables, + - * /, comparisons, and/or/not, "a if c else b",
+ max(), min(), clamp(x, lo, hi) and named curves called like functions.
+ The control file is parsed rarely, so a rule is compiled once into a small
+ stack machine program: variables become indices into an array the caller
+ fills every tick, curves are copied into the program, and the stack depth
+ is checked at compile time. Evaluating it then walks a few dozen fixed-size
+ instructions with a stack on the C stack, no allocation and no string
+ handling; "clevo-indicator bench-expr" measures it.
+ */
+
+#ifndef CLEVO_EXPR_H
+#define CLEVO_EXPR_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "curve.h"
+
+#define EXPR_MAX_CODE 128
+#define EXPR_MAX_CONSTS 32
+#define EXPR_MAX_CURVES 8
+#define EXPR_MAX_VARS 32
+#define EXPR_NAME_MAX 32
+#define EXPR_STACK 16
+
+/* The stock auto mode curve, as points, for rules that only want to bend
+ * it: 0 up to 40°C, 15 up to 45°C, then the temperature minus 30 up to
+ * 75°C, three times steeper up to 90°C and 100 beyond. */
+#define EXPR_STOCK_CURVE "40:0 40.1:15 45:15 75:45 90:90 90.1:100"
+
+/* Names a program can refer to. */
+typedef struct {
+    char vars[EXPR_MAX_VARS][EXPR_NAME_MAX];
+    int var_count;
+    char curve_names[EXPR_MAX_CURVES][EXPR_NAME_MAX];
+    curve curves[EXPR_MAX_CURVES];
+    int curve_count;
+} expr_env;
+
+typedef struct {
+    uint8_t op;
+    uint8_t unused;
+    uint16_t arg;
+} expr_insn;
+
+typedef struct {
+    expr_insn code[EXPR_MAX_CODE];
+    int length;
+    double consts[EXPR_MAX_CONSTS];
+    int const_count;
+    curve curves[EXPR_MAX_CURVES];
+    int curve_count;
+    int stack;      /* deepest the evaluation goes */
+} expr_program;
+
+/* Add a variable (its index in the values passed to expr_eval()) or a named
+ * curve. Returns the index, or -1 when full or already defined. */
+int expr_env_var(expr_env* env, const char* name);
+int expr_env_curve(expr_env* env, const char* name, const curve* c);
+
+/* Compile text against env. Returns 0 on success, or -1 with a message in
+ * error. */
+int expr_compile(expr_program* program, const expr_env* env, const char* text,
+        char* error, size_t error_size);
+
+/* Run a compiled program over the variable values. */
+double expr_eval(const expr_program* program, const double* vars);
+
+/* List the instructions of a program. */
+void expr_dump(const expr_program* program, const expr_env* env, FILE* out);
+
+/* Time iterations evaluations of text, or of an example rule when NULL,
+ * over made-up temperatures. */
+int expr_bench(const char* text, int iterations, FILE* out);
+
+#endif
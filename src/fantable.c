@@ -0,0 +1,354 @@
+/*
+ ============================================================================
+ Name        : fantable.c
+ Description : Measured fan response table of this machine
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "ctl.h"
+#include "fantable.h"
+#include "util.h"
+
+#define FANTABLE_STEP_SAMPLES (FANTABLE_STEP_MS / FANTABLE_SAMPLE_MS)
+
+static struct {
+    int valid;
+    char machine[64];
+    fantable_fan fans[FANTABLE_FANS];
+} table;
+
+static volatile sig_atomic_t fantable_stop = 0;
+static int fantable_hot = 0;
+
+static const char* fan_names[FANTABLE_FANS] = { "cpu", "gpu" };
+static const backend_value fan_rpms[FANTABLE_FANS] = { BACKEND_CPU_RPMS, BACKEND_GPU_RPMS };
+static const backend_value fan_duties[FANTABLE_FANS] = { BACKEND_CPU_DUTY, BACKEND_GPU_DUTY };
+
+static void fantable_machine(char* buffer, size_t max);
+static int fantable_fan_index(const char* name);
+static int fantable_step(int fan, int duty, fantable_point* point, FILE* out);
+static int fantable_measure(int fan, fantable_fan* result, FILE* out);
+static void fantable_command(const char* args, FILE* out);
+
+const char* fantable_path(void) {
+    // characterize writes it as root, never somewhere the caller picked
+    const char* path = secure_getenv("CLEVO_FAN_TABLE");
+    return path != NULL && *path != '\0' ? path : FANTABLE_DEFAULT_PATH;
+}
+
+int fantable_load(const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    char line[256], machine[64] = "", here[64], name[8];
+    fantable_fan fans[FANTABLE_FANS];
+    memset(fans, 0, sizeof(fans));
+    for (int i = 0; i < FANTABLE_FANS; i++)
+        fans[i].min_duty = -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        fantable_fan f;
+        fantable_point p;
+        int fan;
+        if (strncmp(line, "machine ", 8) == 0) {
+            snprintf(machine, sizeof(machine), "%.*s", (int) sizeof(machine) - 1,
+                    line + 8);
+            machine[strcspn(machine, "\n")] = '\0';
+        } else if (sscanf(line, "fan %7s min_duty %d max_rpm %d settle_ms %d",
+                name, &f.min_duty, &f.max_rpm, &f.settle_ms) == 4
+                && (fan = fantable_fan_index(name)) >= 0) {
+            fans[fan].min_duty = f.min_duty;
+            fans[fan].max_rpm = f.max_rpm;
+            fans[fan].settle_ms = f.settle_ms;
+        } else if (sscanf(line, "point %7s %d %d %d %d", name, &p.duty, &p.rpm,
+                &p.settle_ms, &p.overshoot_rpm) == 5
+                && (fan = fantable_fan_index(name)) >= 0
+                && fans[fan].count < FANTABLE_POINTS) {
+            fans[fan].points[fans[fan].count++] = p;
+        }
+    }
+    fclose(fp);
+    fantable_machine(here, sizeof(here));
+    if (strcmp(machine, here) != 0) {
+        printf("fan table %s was measured on '%s', not '%s', ignoring it\n",
+                path, machine, here);
+        return -1;
+    }
+    if (fans[0].count == 0 || fans[1].count == 0) {
+        printf("fan table %s is incomplete, ignoring it\n", path);
+        return -1;
+    }
+    snprintf(table.machine, sizeof(table.machine), "%s", machine);
+    memcpy(table.fans, fans, sizeof(fans));
+    table.valid = 1;
+    return 0;
+}
+
+int fantable_save(const char* path) {
+    char dir[256], tmp[280];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char* slash = strrchr(dir, '/');
+    if (slash != NULL && slash != dir) {
+        *slash = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            printf("unable to create %s: %s\n", dir, strerror(errno));
+            return -1;
+        }
+    }
+    // written aside and renamed, a running auto mode never sees half a table
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        printf("unable to write %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    fantable_print(fp);
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        printf("unable to write %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int fantable_characterize(FILE* out) {
+    int original[FANTABLE_FANS];
+    for (int i = 0; i < FANTABLE_FANS; i++) {
+        if (backend_read_one(fan_duties[i], &original[i]) != 0) {
+            fprintf(out, "unable to read the %s fan duty\n", fan_names[i]);
+            return -1;
+        }
+    }
+    fantable_stop = 0;
+    fantable_hot = 0;
+    fantable_fan fans[FANTABLE_FANS];
+    memset(fans, 0, sizeof(fans));
+    int result = 0;
+    for (int i = 0; i < FANTABLE_FANS && result == 0; i++)
+        result = fantable_measure(i, &fans[i], out);
+    if (!fantable_hot) {
+        for (int i = 0; i < FANTABLE_FANS; i++)
+            backend_write_duty(i, original[i]);
+    }
+    if (result != 0)
+        return -1;
+    fantable_machine(table.machine, sizeof(table.machine));
+    memcpy(table.fans, fans, sizeof(fans));
+    table.valid = 1;
+    return 0;
+}
+
+void fantable_abort(void) {
+    fantable_stop = 1;
+}
+
+const fantable_fan* fantable_get(int fan) {
+    if (!table.valid || fan < 0 || fan >= FANTABLE_FANS)
+        return NULL;
+    return &table.fans[fan];
+}
+
+int fantable_settle_ms(int fan, int duty_percentage) {
+    const fantable_fan* f = fantable_get(fan);
+    if (f == NULL || f->count == 0)
+        return FANTABLE_DEFAULT_SETTLE_MS;
+    const fantable_point* nearest = &f->points[0];
+    for (int i = 1; i < f->count; i++) {
+        if (abs(f->points[i].duty - duty_percentage) < abs(nearest->duty - duty_percentage))
+            nearest = &f->points[i];
+    }
+    // nothing faster than the sampling period was measured
+    return nearest->settle_ms > FANTABLE_SAMPLE_MS ? nearest->settle_ms : FANTABLE_SAMPLE_MS;
+}
+
+int fantable_max_rpm(int fan) {
+    const fantable_fan* f = fantable_get(fan);
+    return f != NULL && f->max_rpm > 0 ? f->max_rpm : FANTABLE_DEFAULT_MAX_RPM;
+}
+
+int fantable_rpm(int fan, int duty_percentage) {
+    const fantable_fan* f = fantable_get(fan);
+    if (f == NULL || f->count == 0)
+        return -1;
+    for (int i = 1; i < f->count; i++) {
+        const fantable_point* lo = &f->points[i - 1];
+        const fantable_point* hi = &f->points[i];
+        if (duty_percentage <= hi->duty) {
+            // a stopped fan stays stopped below its spin-up duty
+            if (duty_percentage < f->min_duty && lo->rpm == 0)
+                return 0;
+            if (duty_percentage <= lo->duty)
+                return lo->rpm;
+            // from a stopped point, RPM goes roughly with duty
+            if (lo->rpm == 0)
+                return hi->rpm * duty_percentage / hi->duty;
+            return lo->rpm + (hi->rpm - lo->rpm) * (duty_percentage - lo->duty)
+                    / (hi->duty - lo->duty);
+        }
+    }
+    return f->points[f->count - 1].rpm;
+}
+
+void fantable_print(FILE* out) {
+    if (!table.valid)
+        return;
+    fprintf(out, "machine %s\n", table.machine);
+    for (int i = 0; i < FANTABLE_FANS; i++) {
+        const fantable_fan* f = &table.fans[i];
+        fprintf(out, "fan %s min_duty %d max_rpm %d settle_ms %d\n", fan_names[i],
+                f->min_duty, f->max_rpm, f->settle_ms);
+        for (int j = 0; j < f->count; j++) {
+            const fantable_point* p = &f->points[j];
+            fprintf(out, "point %s %d %d %d %d\n", fan_names[i], p->duty, p->rpm,
+                    p->settle_ms, p->overshoot_rpm);
+        }
+    }
+}
+
+void fantable_register(void) {
+    ctl_register("fantable", "measured fan response in use (see characterize)",
+            &fantable_command);
+}
+
+static void fantable_command(const char* args, FILE* out) {
+    if (!table.valid) {
+        fprintf(out, "no fan table, settle_ms %d max_rpm %d\n",
+                FANTABLE_DEFAULT_SETTLE_MS, FANTABLE_DEFAULT_MAX_RPM);
+        return;
+    }
+    fantable_print(out);
+}
+
+static void fantable_machine(char* buffer, size_t max) {
+    char path[256];
+    if (util_path(path, sizeof(path), "/sys/class/dmi/id/product_name") < 0
+            || util_read_line(path, buffer, max) != 0 || buffer[0] == '\0')
+        snprintf(buffer, max, "unknown");
+}
+
+static int fantable_fan_index(const char* name) {
+    for (int i = 0; i < FANTABLE_FANS; i++) {
+        if (strcmp(name, fan_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int fantable_step(int fan, int duty, fantable_point* point, FILE* out) {
+    int rpms[FANTABLE_STEP_SAMPLES];
+    uint64_t times[FANTABLE_STEP_SAMPLES];
+    if (backend_write_duty(fan, duty) != 0) {
+        fprintf(out, "unable to set the %s fan to %d%%\n", fan_names[fan], duty);
+        return -1;
+    }
+    uint64_t start = util_now_us();
+    for (int n = 0; n < FANTABLE_STEP_SAMPLES; n++) {
+        uint64_t next = start + (uint64_t) (n + 1) * FANTABLE_SAMPLE_MS * 1000;
+        uint64_t now = util_now_us();
+        if (next > now)
+            usleep(next - now);
+        if (fantable_stop)
+            return -1;
+        if (backend_read_one(fan_rpms[fan], &rpms[n]) != 0) {
+            fprintf(out, "unable to read the %s fan RPM\n", fan_names[fan]);
+            return -1;
+        }
+        times[n] = util_now_us() - start;
+        int temp;
+        if (n % (1000 / FANTABLE_SAMPLE_MS) == 0
+                && backend_read_one(BACKEND_CPU_TEMP, &temp) == 0
+                && temp > FANTABLE_TEMP_LIMIT) {
+            fprintf(out, "CPU at %d°C, stopping with full fan duty\n", temp);
+            backend_write_duty(0, 100);
+            backend_write_duty(1, 100);
+            fantable_hot = 1;
+            return -1;
+        }
+    }
+
+    // the steady state is what the last samples agree on; the step settled
+    // when the RPM entered its band for the last time
+    int n = FANTABLE_STEP_SAMPLES;
+    long sum = 0;
+    for (int i = n - FANTABLE_STEADY_SAMPLES; i < n; i++)
+        sum += rpms[i];
+    int steady = sum / FANTABLE_STEADY_SAMPLES;
+    int band = steady * FANTABLE_STEADY_PCT / 100;
+    if (band < FANTABLE_STEADY_RPM)
+        band = FANTABLE_STEADY_RPM;
+    int first = n;
+    while (first > 0 && abs(rpms[first - 1] - steady) <= band)
+        first--;
+    // overshoot is past the steady state in the direction of the step
+    int rising = rpms[0] <= steady, overshoot = 0;
+    for (int i = 0; i < n; i++) {
+        int beyond = rising ? rpms[i] - steady : steady - rpms[i];
+        if (beyond > overshoot)
+            overshoot = beyond;
+    }
+    point->duty = duty;
+    point->rpm = steady;
+    point->settle_ms = first == 0 ? 0 : (int) (times[first - 1] / 1000);
+    point->overshoot_rpm = overshoot;
+    if (first > n - FANTABLE_STEADY_SAMPLES)
+        fprintf(out, "  %s fan at %d%% did not settle within %d ms\n", fan_names[fan],
+                duty, FANTABLE_STEP_MS);
+    return 0;
+}
+
+static int fantable_measure(int fan, fantable_fan* result, FILE* out) {
+    fprintf(out, "Characterizing %s fan\n", fan_names[fan]);
+    result->count = 0;
+    result->settle_ms = 0;
+    for (int duty = 0; duty <= 100; duty += FANTABLE_DUTY_STEP) {
+        fantable_point* p = &result->points[result->count];
+        if (fantable_step(fan, duty, p, out) != 0)
+            return -1;
+        fprintf(out, "  duty %3d%% rpm %4d settle %4d ms overshoot %3d rpm\n",
+                p->duty, p->rpm, p->settle_ms, p->overshoot_rpm);
+        if (p->settle_ms > result->settle_ms)
+            result->settle_ms = p->settle_ms;
+        result->count++;
+    }
+    result->max_rpm = result->points[result->count - 1].rpm;
+
+    int spin = 0;
+    while (spin < result->count && result->points[spin].rpm == 0)
+        spin++;
+    if (spin == result->count) {
+        fprintf(out, "  %s fan never started\n", fan_names[fan]);
+        result->min_duty = -1;
+        return 0;
+    }
+    result->min_duty = result->points[spin].duty;
+    if (spin == 0)
+        return 0;
+
+    // narrow the spin-up duty down, stepping up from a stopped fan
+    fantable_point p;
+    if (fantable_step(fan, 0, &p, out) != 0)
+        return -1;
+    if (p.rpm != 0)
+        return 0;
+    for (int duty = result->points[spin - 1].duty + FANTABLE_SPINUP_STEP;
+            duty < result->points[spin].duty; duty += FANTABLE_SPINUP_STEP) {
+        if (fantable_step(fan, duty, &p, out) != 0)
+            return -1;
+        if (p.rpm > 0) {
+            result->min_duty = duty;
+            break;
+        }
+    }
+    fprintf(out, "  spin-up duty %d%%\n", result->min_duty);
+    return 0;
+}
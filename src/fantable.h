@@ -0,0 +1,93 @@
+/*
+ ============================================================================
+ Name        : fantable.h
+ Description : Measured fan response table of this machine
+ ============================================================================
+
+ "clevo-indicator characterize" steps each fan from 0 to 100% duty in
+ FANTABLE_DUTY_STEP increments and samples its RPM every FANTABLE_SAMPLE_MS
+ for FANTABLE_STEP_MS. The steady-state RPM of a step is the mean of its
+ last FANTABLE_STEADY_SAMPLES samples; the settle time is when the RPM last
+ entered the band of FANTABLE_STEADY_PCT (at least FANTABLE_STEADY_RPM)
+ around it, and the overshoot how far the RPM went past it. The lowest
+ duty that starts a stopped fan is then narrowed down in
+ FANTABLE_SPINUP_STEP increments.
+
+ The result is saved, together with the DMI product name, to
+ FANTABLE_DEFAULT_PATH (or $CLEVO_FAN_TABLE) and loaded by the auto mode,
+ where it replaces the fixed 1.1 s settle wait of the actuator and the
+ 4400 RPM full-speed guess. Without a table, or with one measured on a
+ different product, the FANTABLE_DEFAULT_* values apply.
+ */
+
+#ifndef CLEVO_FANTABLE_H
+#define CLEVO_FANTABLE_H
+
+#include <stdio.h>
+
+#define FANTABLE_DEFAULT_PATH "/var/lib/clevo-indicator/fan-table"
+
+#define FANTABLE_FANS 2
+#define FANTABLE_DUTY_STEP 10
+#define FANTABLE_POINTS (100 / FANTABLE_DUTY_STEP + 1)
+#define FANTABLE_SPINUP_STEP 2
+
+#define FANTABLE_SAMPLE_MS 50
+#define FANTABLE_STEP_MS 8000
+#define FANTABLE_STEADY_SAMPLES 10
+#define FANTABLE_STEADY_PCT 3
+#define FANTABLE_STEADY_RPM 50
+/* Characterisation stops and sets full duty above this CPU temperature. */
+#define FANTABLE_TEMP_LIMIT 85
+
+#define FANTABLE_DEFAULT_SETTLE_MS 1100
+#define FANTABLE_DEFAULT_MAX_RPM 4400
+
+typedef struct {
+    int duty;           /* % */
+    int rpm;            /* steady state */
+    int settle_ms;      /* from the write to steady state */
+    int overshoot_rpm;  /* peak above the steady state */
+} fantable_point;
+
+typedef struct {
+    int min_duty;       /* lowest duty starting a stopped fan, -1 unknown */
+    int max_rpm;
+    int settle_ms;      /* slowest step */
+    int count;
+    fantable_point points[FANTABLE_POINTS];
+} fantable_fan;
+
+/* Path of the table: $CLEVO_FAN_TABLE or FANTABLE_DEFAULT_PATH. The
+ * variable is ignored in a setuid process. */
+const char* fantable_path(void);
+
+/* Load the table measured on this machine. Returns 0 when one was loaded;
+ * the defaults stay in effect otherwise. */
+int fantable_load(const char* path);
+int fantable_save(const char* path);
+
+/* Measure both fans, logging progress to out, and keep the result as the
+ * current table. The duties found on entry are restored, except after the
+ * CPU got hotter than FANTABLE_TEMP_LIMIT: both fans are then left at full
+ * duty. Returns 0 on success, -1 otherwise. */
+int fantable_characterize(FILE* out);
+
+/* Stop a running characterisation at the next sample (signal safe). */
+void fantable_abort(void);
+
+/* fan 0 is the CPU fan, 1 the GPU fan. */
+const fantable_fan* fantable_get(int fan);
+int fantable_settle_ms(int fan, int duty_percentage);
+int fantable_max_rpm(int fan);
+
+/* RPM the table expects at a duty, -1 without a table. */
+int fantable_rpm(int fan, int duty_percentage);
+
+/* Print the current table, in the file format. */
+void fantable_print(FILE* out);
+
+/* Register the "fantable" socket command. */
+void fantable_register(void);
+
+#endif
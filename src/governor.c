@@ -0,0 +1,192 @@
+/*
+ ============================================================================
+ Name        : governor.c
+ Description : Joint fan + CPU performance-limit governor
+ ============================================================================
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "governor.h"
+#include "util.h"
+
+#define GOVERNOR_MAX_POLICIES 64
+
+typedef enum {
+    GOVERNOR_NONE = 0, GOVERNOR_PSTATE, GOVERNOR_CPUFREQ
+} governor_backend;
+
+typedef struct {
+    char max_path[UTIL_PATH_MAX];
+    long orig_max;
+    long hw_min;
+} governor_policy;
+
+static struct {
+    governor_backend backend;
+    governor_config config;
+    char pstate_path[UTIL_PATH_MAX];
+    long pstate_orig;
+    governor_policy policies[GOVERNOR_MAX_POLICIES];
+    int policy_count;
+    int cap;
+    double trend;
+    int trend_valid;
+} governor = { GOVERNOR_NONE, GOVERNOR_DEFAULT_CONFIG };
+
+static int governor_init_pstate(void);
+static int governor_init_cpufreq(void);
+static int governor_apply(int cap);
+
+int governor_init(const governor_config* config) {
+    if (config != NULL)
+        governor_configure(config);
+    governor.cap = 100;
+    governor.trend_valid = 0;
+    if (governor_init_pstate() == 0) {
+        governor.backend = GOVERNOR_PSTATE;
+        printf("Performance governor: intel_pstate max_perf_pct (was %ld%%)\n",
+                governor.pstate_orig);
+        return 0;
+    }
+    if (governor_init_cpufreq() == 0) {
+        governor.backend = GOVERNOR_CPUFREQ;
+        printf("Performance governor: cpufreq scaling_max_freq, %d policies\n",
+                governor.policy_count);
+        return 0;
+    }
+    governor.backend = GOVERNOR_NONE;
+    printf("Performance governor: no limit interface found\n");
+    return -1;
+}
+
+void governor_configure(const governor_config* config) {
+    governor.config = *config;
+    if (governor.config.step_pct < 1)
+        governor.config.step_pct = 1;
+    if (governor.config.floor_pct < 10)
+        governor.config.floor_pct = 10;
+    if (governor.config.floor_pct > 100)
+        governor.config.floor_pct = 100;
+    if (governor.config.release_temp > governor.config.trip_temp)
+        governor.config.release_temp = governor.config.trip_temp;
+}
+
+int governor_update(double temp, int fan_duty) {
+    if (governor.backend == GOVERNOR_NONE)
+        return 100;
+    // a short moving average so one noisy reading doesn't look like a rise
+    double rise = governor.trend_valid ? temp - governor.trend : 0;
+    governor.trend = governor.trend_valid ?
+            (governor.trend + temp) / 2 : temp;
+    governor.trend_valid = 1;
+
+    const governor_config* c = &governor.config;
+    int cap = governor.cap;
+    if (fan_duty >= 100 && temp >= c->trip_temp && rise >= 0.5)
+        cap -= c->step_pct;
+    else if (temp < c->release_temp || fan_duty < 100)
+        cap += c->step_pct;
+    if (cap < c->floor_pct)
+        cap = c->floor_pct;
+    if (cap > 100)
+        cap = 100;
+    if (cap != governor.cap && governor_apply(cap) == 0) {
+        printf("Performance governor: %.0f°C at %d%% fan, cap %d%% -> %d%%\n",
+                temp, fan_duty, governor.cap, cap);
+        governor.cap = cap;
+    }
+    return governor.cap;
+}
+
+void governor_release(void) {
+    switch (governor.backend) {
+    case GOVERNOR_PSTATE:
+        util_write_long(governor.pstate_path, governor.pstate_orig);
+        break;
+    case GOVERNOR_CPUFREQ:
+        for (int i = 0; i < governor.policy_count; i++)
+            util_write_long(governor.policies[i].max_path,
+                    governor.policies[i].orig_max);
+        break;
+    default:
+        return;
+    }
+    governor.cap = 100;
+}
+
+static int governor_init_pstate(void) {
+    char status[64];
+    char path[UTIL_PATH_MAX];
+    if (util_path(path, sizeof(path), "/sys/devices/system/cpu/intel_pstate/status") < 0)
+        return -1;
+    // "passive" mode hands the limits over to cpufreq
+    if (util_read_line(path, status, sizeof(status)) == 0
+            && strcmp(status, "active") != 0)
+        return -1;
+    if (util_path(governor.pstate_path, sizeof(governor.pstate_path),
+            "/sys/devices/system/cpu/intel_pstate/max_perf_pct") < 0)
+        return -1;
+    return util_read_long(governor.pstate_path, &governor.pstate_orig);
+}
+
+static int governor_init_cpufreq(void) {
+    char dir_path[UTIL_PATH_MAX];
+    if (util_path(dir_path, sizeof(dir_path), "/sys/devices/system/cpu/cpufreq") < 0)
+        return -1;
+    DIR* dir = opendir(dir_path);
+    if (dir == NULL)
+        return -1;
+    governor.policy_count = 0;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL
+            && governor.policy_count < GOVERNOR_MAX_POLICIES) {
+        if (strncmp(ent->d_name, "policy", 6) != 0)
+            continue;
+        governor_policy* p = &governor.policies[governor.policy_count];
+        char path[UTIL_PATH_MAX];
+        int len = snprintf(path, sizeof(path), "%s/%s/cpuinfo_min_freq", dir_path,
+                ent->d_name);
+        if (len < 0 || (size_t) len >= sizeof(path) || util_read_long(path, &p->hw_min) != 0)
+            continue;
+        len = snprintf(p->max_path, sizeof(p->max_path), "%s/%s/scaling_max_freq",
+                dir_path, ent->d_name);
+        if (len < 0 || (size_t) len >= sizeof(p->max_path)
+                || util_read_long(p->max_path, &p->orig_max) != 0 || p->orig_max <= 0)
+            continue;
+        governor.policy_count++;
+    }
+    closedir(dir);
+    return governor.policy_count > 0 ? 0 : -1;
+}
+
+static int governor_apply(int cap) {
+    if (governor.backend == GOVERNOR_PSTATE) {
+        // a share of what the user had configured, as with cpufreq
+        long value = governor.pstate_orig * cap / 100;
+        if (value < 1)
+            value = 1;
+        if (util_write_long(governor.pstate_path, value) != 0) {
+            printf("unable to write %s: %s\n", governor.pstate_path,
+                    strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    int result = 0;
+    for (int i = 0; i < governor.policy_count; i++) {
+        governor_policy* p = &governor.policies[i];
+        long freq = p->orig_max * cap / 100;
+        if (freq < p->hw_min)
+            freq = p->hw_min;
+        if (util_write_long(p->max_path, freq) != 0) {
+            printf("unable to write %s: %s\n", p->max_path, strerror(errno));
+            result = -1;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,44 @@
+/*
+ ============================================================================
+ Name        : governor.h
+ Description : Joint fan + CPU performance-limit governor
+ ============================================================================
+
+ Once the fans are already at 100% and the temperature still rises, there's
+ nothing left for the fan curve to do and the firmware would eventually hit
+ PROCHOT and halve the clocks. The governor steps the CPU performance limit
+ down a few percent per tick instead - intel_pstate's max_perf_pct when the
+ driver is active, every cpufreq policy's scaling_max_freq otherwise - and
+ gives it back gradually once the temperature falls. A small, early cap
+ keeps the all-core clock far higher on average than the firmware cliff.
+
+ All files are resolved with util_path(), so CLEVO_SYSFS_ROOT can point the
+ governor at a fake sysfs tree.
+ */
+
+#ifndef CLEVO_GOVERNOR_H
+#define CLEVO_GOVERNOR_H
+
+typedef struct {
+    int trip_temp;      /* cap only at or above this temperature (°C) */
+    int release_temp;   /* lift the cap again below this temperature */
+    int step_pct;       /* cap change per tick */
+    int floor_pct;      /* never cap below this */
+} governor_config;
+
+#define GOVERNOR_DEFAULT_CONFIG { 88, 80, 5, 50 }
+
+/* Detect the limit interface and remember the original limits. Returns 0
+ * when a usable interface was found. */
+int governor_init(const governor_config* config);
+
+void governor_configure(const governor_config* config);
+
+/* Feed one control tick. Returns the performance cap now in effect, as a
+ * percentage of the limits found at init (100 is uncapped). */
+int governor_update(double temp, int fan_duty);
+
+/* Restore the limits found by governor_init(). */
+void governor_release(void);
+
+#endif
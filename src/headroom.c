@@ -0,0 +1,92 @@
+/*
+ ============================================================================
+ Name        : headroom.c
+ Description : Thermal headroom estimate for job schedulers
+ ============================================================================
+ */
+
+#include <stdio.h>
+
+#include "ctl.h"
+#include "headroom.h"
+#include "util.h"
+
+/* Predictions beyond this are reported as "not throttling soon". */
+#define HEADROOM_MAX_SECONDS 3600.0
+
+static struct {
+    uint64_t times[HEADROOM_WINDOW];
+    double temps[HEADROOM_WINDOW];
+    int count;
+    int next;
+    int fan_duty;
+    int throttle_temp;
+} headroom = { .throttle_temp = HEADROOM_DEFAULT_THROTTLE_TEMP };
+
+static void headroom_command(const char* args, FILE* out);
+
+void headroom_set_throttle_temp(int temp) {
+    if (temp > 0)
+        headroom.throttle_temp = temp;
+}
+
+void headroom_update(double temp, int fan_duty) {
+    headroom.times[headroom.next] = util_now_us();
+    headroom.temps[headroom.next] = temp;
+    headroom.next = (headroom.next + 1) % HEADROOM_WINDOW;
+    if (headroom.count < HEADROOM_WINDOW)
+        headroom.count++;
+    headroom.fan_duty = fan_duty;
+}
+
+void headroom_get(headroom_info* info) {
+    int last = (headroom.next + HEADROOM_WINDOW - 1) % HEADROOM_WINDOW;
+    info->throttle_temp = headroom.throttle_temp;
+    info->fan_reserve = headroom.fan_duty < 100 ? 100 - headroom.fan_duty : 0;
+    info->temp = headroom.count > 0 ? headroom.temps[last] : 0;
+    info->updated_us = headroom.count > 0 ? headroom.times[last] : 0;
+    info->slope = 0;
+    info->seconds_to_throttle = -1;
+    if (headroom.count < 2)
+        return;
+
+    // least-squares slope, times relative to the newest sample in seconds
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i = 0; i < headroom.count; i++) {
+        double x = -(double) (headroom.times[last] - headroom.times[i]) / 1e6;
+        double y = headroom.temps[i];
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    double n = headroom.count;
+    double denom = n * sxx - sx * sx;
+    if (denom <= 0)
+        return;
+    info->slope = (n * sxy - sx * sy) / denom;
+    if (info->temp >= info->throttle_temp) {
+        info->seconds_to_throttle = 0;
+    } else if (info->slope > 0) {
+        double seconds = (info->throttle_temp - info->temp) / info->slope;
+        if (seconds < HEADROOM_MAX_SECONDS)
+            info->seconds_to_throttle = seconds;
+    }
+}
+
+void headroom_register(void) {
+    ctl_register("headroom", "predicted seconds until throttle and fan reserve",
+            &headroom_command);
+}
+
+static void headroom_command(const char* args, FILE* out) {
+    headroom_info info;
+    headroom_get(&info);
+    fprintf(out, "temp %.1f\n", info.temp);
+    fprintf(out, "throttle_temp %d\n", info.throttle_temp);
+    fprintf(out, "slope %.3f\n", info.slope);
+    fprintf(out, "seconds_to_throttle %.0f\n", info.seconds_to_throttle);
+    fprintf(out, "fan_reserve %d\n", info.fan_reserve);
+    fprintf(out, "age_ms %llu\n", info.updated_us == 0 ? 0ULL
+            : (unsigned long long) (util_now_us() - info.updated_us) / 1000);
+}
@@ -0,0 +1,39 @@
+/*
+ ============================================================================
+ Name        : headroom.h
+ Description : Thermal headroom estimate for job schedulers
+ ============================================================================
+
+ The control loop feeds the CPU temperature and fan duty of every tick. The
+ temperature trend is a least-squares slope over the last HEADROOM_WINDOW
+ samples, which gives a predicted time until the throttle temperature is
+ reached; together with the unused fan duty ("fan reserve") this tells a
+ build system whether it can add jobs or should back off before the clocks
+ drop. Published through the "headroom" socket command.
+ */
+
+#ifndef CLEVO_HEADROOM_H
+#define CLEVO_HEADROOM_H
+
+#include <stdint.h>
+
+#define HEADROOM_WINDOW 16
+#define HEADROOM_DEFAULT_THROTTLE_TEMP 95
+
+typedef struct {
+    double temp;
+    double slope;               /* °C per second */
+    double seconds_to_throttle; /* -1 when the temperature isn't rising */
+    int throttle_temp;
+    int fan_reserve;            /* 100 - highest fan duty, in percent */
+    uint64_t updated_us;
+} headroom_info;
+
+void headroom_set_throttle_temp(int temp);
+void headroom_update(double temp, int fan_duty);
+void headroom_get(headroom_info* info);
+
+/* Register the "headroom" socket command. */
+void headroom_register(void);
+
+#endif
@@ -0,0 +1,319 @@
+/*
+ ============================================================================
+ Name        : heat.c
+ Description : Per-process heat attribution
+ ============================================================================
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "heat.h"
+#include "util.h"
+
+#define HEAT_INITIAL_CAPACITY 1024
+#define HEAT_DEFAULT_TOP 10
+
+typedef struct {
+    pid_t pid;                      /* 0 marks a free slot */
+    uint32_t seen;                  /* tick of the last successful read */
+    uint64_t start_time;            /* tells a reused pid from the old one */
+    uint64_t last_ticks;
+    uint32_t ring[HEAT_WINDOW];     /* CPU ticks per window slot */
+    uint32_t sum;
+    char comm[HEAT_COMM_MAX];
+} heat_slot;
+
+static struct {
+    heat_slot* slots;
+    uint32_t capacity;              /* power of two */
+    uint32_t used;
+    uint32_t tick;
+    uint64_t total_ring[HEAT_WINDOW];
+    uint64_t energy_ring[HEAT_WINDOW];
+    uint64_t time_ring[HEAT_WINDOW];
+    char rapl_path[UTIL_PATH_MAX];
+    uint64_t rapl_range;
+    uint64_t rapl_last;
+    int rapl_valid;
+    uint64_t last_us;
+    long clk_tck;
+} heat;
+
+static void heat_command(const char* args, FILE* out);
+static int heat_read_rapl(uint64_t* energy);
+static int heat_read_stat(pid_t pid, char* comm, uint64_t* ticks,
+        uint64_t* start_time);
+static heat_slot* heat_lookup(pid_t pid, int insert);
+static void heat_remove(heat_slot* slot);
+static int heat_grow(void);
+static int heat_compare(const void* a, const void* b);
+
+static inline uint32_t heat_hash(pid_t pid) {
+    return (uint32_t) pid * 2654435761u;
+}
+
+int heat_init(void) {
+    heat.capacity = HEAT_INITIAL_CAPACITY;
+    heat.slots = calloc(heat.capacity, sizeof(heat_slot));
+    if (heat.slots == NULL)
+        return -1;
+    heat.clk_tck = sysconf(_SC_CLK_TCK);
+    if (heat.clk_tck <= 0)
+        heat.clk_tck = 100;
+    char path[UTIL_PATH_MAX];
+    long range;
+    util_path(path, sizeof(path),
+            "/sys/class/powercap/intel-rapl:0/max_energy_range_uj");
+    if (util_read_long(path, &range) == 0) {
+        heat.rapl_range = range;
+        util_path(heat.rapl_path, sizeof(heat.rapl_path),
+                "/sys/class/powercap/intel-rapl:0/energy_uj");
+        heat.rapl_valid = heat_read_rapl(&heat.rapl_last) == 0;
+    }
+    if (!heat.rapl_valid)
+        printf("Heat attribution: no RAPL package energy, CPU time only\n");
+    heat.last_us = util_now_us();
+    return 0;
+}
+
+void heat_sample(void) {
+    if (heat.slots == NULL)
+        return;
+    heat.tick++;
+    int window_slot = heat.tick % HEAT_WINDOW;
+
+    uint64_t now = util_now_us();
+    heat.time_ring[window_slot] = now - heat.last_us;
+    heat.last_us = now;
+    heat.energy_ring[window_slot] = 0;
+    uint64_t energy;
+    if (heat.rapl_valid && heat_read_rapl(&energy) == 0) {
+        heat.energy_ring[window_slot] = energy >= heat.rapl_last ?
+                energy - heat.rapl_last : energy + heat.rapl_range - heat.rapl_last;
+        heat.rapl_last = energy;
+    }
+
+    char proc_path[UTIL_PATH_MAX];
+    util_path(proc_path, sizeof(proc_path), "/proc");
+    DIR* dir = opendir(proc_path);
+    if (dir == NULL)
+        return;
+    uint64_t total = 0;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        char* endptr;
+        long pid = strtol(ent->d_name, &endptr, 10);
+        if (*endptr != '\0' || pid <= 0)
+            continue;
+        char comm[HEAT_COMM_MAX];
+        uint64_t ticks, start_time;
+        if (heat_read_stat(pid, comm, &ticks, &start_time) != 0)
+            continue;
+        heat_slot* slot = heat_lookup(pid, 1);
+        if (slot == NULL)
+            continue;
+        uint32_t delta = 0;
+        if (slot->seen != 0 && slot->start_time == start_time
+                && ticks >= slot->last_ticks) {
+            delta = ticks - slot->last_ticks;
+        } else if (slot->seen != 0) {
+            // the pid was reused, forget the previous process
+            memset(slot->ring, 0, sizeof(slot->ring));
+            slot->sum = 0;
+        }
+        memcpy(slot->comm, comm, sizeof(slot->comm));
+        slot->start_time = start_time;
+        slot->last_ticks = ticks;
+        slot->seen = heat.tick;
+        slot->sum += delta - slot->ring[window_slot];
+        slot->ring[window_slot] = delta;
+        total += delta;
+    }
+    closedir(dir);
+    heat.total_ring[window_slot] = total;
+
+    // age out the window slot of processes that weren't seen, drop the
+    // ones with nothing left in the window
+    for (uint32_t i = 0; i < heat.capacity; i++) {
+        heat_slot* slot = &heat.slots[i];
+        if (slot->pid == 0 || slot->seen == heat.tick)
+            continue;
+        slot->sum -= slot->ring[window_slot];
+        slot->ring[window_slot] = 0;
+        if (slot->sum == 0) {
+            heat_remove(slot);
+            i--;  // backward shift may have moved another entry here
+        }
+    }
+}
+
+int heat_top(heat_entry* entries, int max) {
+    if (heat.slots == NULL || max <= 0)
+        return 0;
+    uint64_t total = 0, energy = 0, time_us = 0;
+    for (int i = 0; i < HEAT_WINDOW; i++) {
+        total += heat.total_ring[i];
+        energy += heat.energy_ring[i];
+        time_us += heat.time_ring[i];
+    }
+    if (total == 0 || time_us == 0)
+        return 0;
+    double seconds = time_us / 1e6;
+    double watts = heat.rapl_valid ? energy / 1e6 / seconds : 0;
+
+    heat_entry* all = malloc(sizeof(heat_entry) * heat.used);
+    if (all == NULL)
+        return 0;
+    int count = 0;
+    for (uint32_t i = 0; i < heat.capacity; i++) {
+        heat_slot* slot = &heat.slots[i];
+        if (slot->pid == 0 || slot->sum == 0)
+            continue;
+        heat_entry* e = &all[count++];
+        e->pid = slot->pid;
+        memcpy(e->comm, slot->comm, sizeof(e->comm));
+        e->cpu_pct = slot->sum * 100.0 / heat.clk_tck / seconds;
+        e->watts = watts * slot->sum / total;
+    }
+    qsort(all, count, sizeof(heat_entry), &heat_compare);
+    if (count > max)
+        count = max;
+    memcpy(entries, all, sizeof(heat_entry) * count);
+    free(all);
+    return count;
+}
+
+void heat_print_top(FILE* out, int max) {
+    heat_entry entries[64];
+    if (max > 64)
+        max = 64;
+    int count = heat_top(entries, max);
+    for (int i = 0; i < count; i++)
+        fprintf(out, "%7d %-16s %6.1f%% CPU %6.2f W\n", entries[i].pid,
+                entries[i].comm, entries[i].cpu_pct, entries[i].watts);
+}
+
+void heat_register(void) {
+    ctl_register("top-heat", "[count] processes by attributed package power",
+            &heat_command);
+}
+
+static void heat_command(const char* args, FILE* out) {
+    int count = atoi(args);
+    heat_print_top(out, count > 0 ? count : HEAT_DEFAULT_TOP);
+}
+
+static int heat_read_rapl(uint64_t* energy) {
+    long value;
+    if (util_read_long(heat.rapl_path, &value) != 0)
+        return -1;
+    *energy = value;
+    return 0;
+}
+
+static int heat_read_stat(pid_t pid, char* comm, uint64_t* ticks,
+        uint64_t* start_time) {
+    char path[UTIL_PATH_MAX];
+    char buffer[512];
+    util_path(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (len <= 0)
+        return -1;
+    buffer[len] = '\0';
+    // "pid (comm) state ppid ...", comm itself may contain ") "
+    char* open_paren = strchr(buffer, '(');
+    char* close_paren = strrchr(buffer, ')');
+    if (open_paren == NULL || close_paren == NULL || close_paren < open_paren)
+        return -1;
+    size_t comm_len = close_paren - open_paren - 1;
+    if (comm_len >= HEAT_COMM_MAX)
+        comm_len = HEAT_COMM_MAX - 1;
+    memcpy(comm, open_paren + 1, comm_len);
+    comm[comm_len] = '\0';
+    // utime and stime are fields 14 and 15, starttime is field 22
+    unsigned long long utime, stime, start;
+    if (sscanf(close_paren + 2,
+            "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu "
+            "%*d %*d %*d %*d %*d %*d %llu", &utime, &stime, &start) != 3)
+        return -1;
+    *ticks = utime + stime;
+    *start_time = start;
+    return 0;
+}
+
+static heat_slot* heat_lookup(pid_t pid, int insert) {
+    if (insert && (heat.used + 1) * 2 > heat.capacity && heat_grow() != 0)
+        return NULL;
+    uint32_t mask = heat.capacity - 1;
+    for (uint32_t i = heat_hash(pid) & mask;; i = (i + 1) & mask) {
+        heat_slot* slot = &heat.slots[i];
+        if (slot->pid == pid)
+            return slot;
+        if (slot->pid == 0) {
+            if (!insert)
+                return NULL;
+            memset(slot, 0, sizeof(*slot));
+            slot->pid = pid;
+            heat.used++;
+            return slot;
+        }
+    }
+}
+
+/* Linear probing deletion without tombstones: shift later members of the
+ * probe chain back into the hole. */
+static void heat_remove(heat_slot* slot) {
+    uint32_t mask = heat.capacity - 1;
+    uint32_t hole = slot - heat.slots;
+    uint32_t i = hole;
+    for (;;) {
+        i = (i + 1) & mask;
+        heat_slot* next = &heat.slots[i];
+        if (next->pid == 0)
+            break;
+        uint32_t home = heat_hash(next->pid) & mask;
+        // move it unless its home lies cyclically within (hole, i]
+        if (hole <= i ? (home <= hole || home > i) : (home <= hole && home > i)) {
+            heat.slots[hole] = *next;
+            hole = i;
+        }
+    }
+    heat.slots[hole].pid = 0;
+    heat.used--;
+}
+
+static int heat_grow(void) {
+    heat_slot* old = heat.slots;
+    uint32_t old_capacity = heat.capacity;
+    heat_slot* slots = calloc(old_capacity * 2, sizeof(heat_slot));
+    if (slots == NULL)
+        return -1;
+    heat.slots = slots;
+    heat.capacity = old_capacity * 2;
+    heat.used = 0;
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old[i].pid == 0)
+            continue;
+        heat_slot* slot = heat_lookup(old[i].pid, 1);
+        *slot = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+static int heat_compare(const void* a, const void* b) {
+    const heat_entry* x = a;
+    const heat_entry* y = b;
+    return x->cpu_pct < y->cpu_pct ? 1 : x->cpu_pct > y->cpu_pct ? -1 : 0;
+}
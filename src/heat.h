@@ -0,0 +1,45 @@
+/*
+ ============================================================================
+ Name        : heat.h
+ Description : Per-process heat attribution
+ ============================================================================
+
+ Every tick heat_sample() walks /proc, reads utime+stime of each process
+ and keeps the per-pid delta in a small open-addressing hash table, next to
+ the RAPL package energy delta of the same tick. Over a sliding window of
+ HEAT_WINDOW ticks the package energy is split between processes by their
+ share of CPU time. Only deltas are kept, so the cost per tick is one read
+ of each /proc/<pid>/stat and O(1) table work per process.
+
+ Exited processes stay in the table until their window share drops to
+ zero, so a short compiler burst still shows up as the cause of a ramp.
+ */
+
+#ifndef CLEVO_HEAT_H
+#define CLEVO_HEAT_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define HEAT_WINDOW 10
+#define HEAT_COMM_MAX 16
+
+typedef struct {
+    pid_t pid;
+    char comm[HEAT_COMM_MAX];
+    double cpu_pct;     /* of one CPU, averaged over the window */
+    double watts;       /* attributed package power, 0 without RAPL */
+} heat_entry;
+
+int heat_init(void);
+void heat_sample(void);
+
+/* Fill up to max entries, hottest first. Returns the number filled. */
+int heat_top(heat_entry* entries, int max);
+
+void heat_print_top(FILE* out, int max);
+
+/* Register the "top-heat" socket command. */
+void heat_register(void);
+
+#endif
@@ -0,0 +1,422 @@
+/*
+ ============================================================================
+ Name        : history.c
+ Description : Tiered, memory-mapped time-series history
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "analytics.h"
+#include "history.h"
+
+#define HISTORY_MAGIC "CLVHIST1"
+#define HISTORY_PAGE 4096
+
+/* The interval being summed up for a tier. Values are in tenths. */
+typedef struct {
+    int64_t bucket;     /* interval number (time / step), -1 for none */
+    int32_t count[HISTORY_COLUMNS];
+    int32_t min[HISTORY_COLUMNS];
+    int32_t max[HISTORY_COLUMNS];
+    int64_t sum[HISTORY_COLUMNS];
+} history_acc;
+
+typedef struct {
+    uint32_t step_s;
+    uint32_t slots;
+    uint64_t offset;    /* of the start times, followed by the columns */
+} history_layout;
+
+typedef struct {
+    char magic[8];
+    uint32_t columns;
+    uint32_t tiers;
+    history_layout layout[HISTORY_TIERS];
+    history_acc acc[HISTORY_TIERS];
+} history_header;
+
+static const uint32_t tier_steps[HISTORY_TIERS] = { 1, 60, 3600 };
+static const uint32_t tier_slots[HISTORY_TIERS] = { 86400, 43200, 8760 };
+static const char* tier_names[HISTORY_TIERS] = { "sec", "min", "hour" };
+static const char* column_names[HISTORY_COLUMNS] = { "cpu_temp", "gpu_temp", "cpu_duty", "gpu_duty" };
+
+static struct {
+    char* base;
+    size_t size;
+} history = { NULL, 0 };
+
+static size_t history_align(size_t size);
+static size_t history_init_header(history_header* header);
+static uint32_t* history_times(char* base, const history_header* header, int tier);
+static int16_t* history_values(char* base, const history_header* header, int tier,
+        history_stat stat, history_column column);
+static void history_add(int tier, int64_t bucket, const int32_t* min, const int32_t* max,
+        const int64_t* sum, const int32_t* count);
+static void history_flush(int tier);
+static void history_print_row(FILE* out, int tier, time_t start, const int16_t (*values)[HISTORY_COLUMNS]);
+static void history_print_stats(FILE* out, int tier, const uint32_t* times,
+        const int16_t* (*columns)[HISTORY_COLUMNS], int64_t first, int64_t last,
+        const history_acc* acc, double above);
+
+const char* history_path(void) {
+    // the daemon creates and truncates it as root
+    const char* path = secure_getenv("CLEVO_HISTORY");
+    return path != NULL && *path != '\0' ? path : HISTORY_DEFAULT_PATH;
+}
+
+int history_open(const char* path) {
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char* slash = strrchr(dir, '/');
+    if (slash != NULL && slash != dir) {
+        *slash = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            printf("unable to create %s: %s\n", dir, strerror(errno));
+            return -1;
+        }
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644);
+    if (fd < 0) {
+        printf("unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    history_header expected, existing;
+    size_t size = history_init_header(&expected);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size != size
+            || pread(fd, &existing, sizeof(existing), 0) != sizeof(existing)
+            || memcmp(existing.magic, expected.magic, offsetof(history_header, acc)) != 0) {
+        // a new file or another layout: start over, the file is sparse until written
+        printf("Creating history %s (%zu KiB)\n", path, size / 1024);
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0
+                || pwrite(fd, &expected, sizeof(expected), 0) != sizeof(expected)) {
+            printf("unable to create %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    history.base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (history.base == MAP_FAILED) {
+        printf("unable to map %s: %s\n", path, strerror(errno));
+        history.base = NULL;
+        return -1;
+    }
+    history.size = size;
+    return 0;
+}
+
+void history_close(void) {
+    if (history.base == NULL)
+        return;
+    // the intervals in progress stay in the header accumulators
+    munmap(history.base, history.size);
+    history.base = NULL;
+}
+
+void history_record(const double* values) {
+    history_record_at(values, time(NULL));
+}
+
+void history_record_at(const double* values, time_t now) {
+    if (history.base == NULL)
+        return;
+    int32_t tenths[HISTORY_COLUMNS], count[HISTORY_COLUMNS];
+    int64_t sum[HISTORY_COLUMNS];
+    for (int c = 0; c < HISTORY_COLUMNS; c++) {
+        count[c] = !isnan(values[c]) && fabs(values[c]) < 3000;
+        tenths[c] = count[c] ? (int32_t) lround(values[c] * 10) : 0;
+        sum[c] = tenths[c];
+    }
+    history_add(HISTORY_SECONDS, now / tier_steps[HISTORY_SECONDS], tenths, tenths, sum, count);
+}
+
+int history_query(const char* path, const char* since, const char* tier_name, int stats, double above,
+        FILE* out) {
+    char* end;
+    double amount = strtod(since, &end);
+    int unit = *end == 'm' ? 60 : *end == 'h' ? 3600 : *end == 'd' ? 86400 : 1;
+    if (end == since || amount <= 0 || (*end != '\0' && end[1] != '\0')
+            || (*end != '\0' && strchr("smhd", *end) == NULL)) {
+        fprintf(out, "invalid duration %s, expected e.g. 90s, 15m, 12h or 7d\n", since);
+        return -1;
+    }
+    int64_t span = (int64_t) (amount * unit);
+    int tier = HISTORY_SECONDS;
+    if (tier_name != NULL) {
+        while (tier < HISTORY_TIERS && strcmp(tier_names[tier], tier_name) != 0)
+            tier++;
+        if (tier == HISTORY_TIERS) {
+            fprintf(out, "invalid tier %s, expected sec, min or hour\n", tier_name);
+            return -1;
+        }
+    } else {
+        while (tier < HISTORY_TIERS - 1 && span > (int64_t) tier_steps[tier] * tier_slots[tier])
+            tier++;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        fprintf(out, "unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    history_header expected;
+    size_t size = history_init_header(&expected);
+    struct stat st;
+    char* base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size == size)
+        base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED || memcmp(base, &expected, offsetof(history_header, acc)) != 0) {
+        fprintf(out, "%s is not a history file\n", path);
+        if (base != MAP_FAILED)
+            munmap(base, size);
+        return -1;
+    }
+
+    // only the slots of the requested interval are touched, so only their
+    // pages are read
+    const history_header* header = (const history_header*) base;
+    int64_t step = tier_steps[tier], slots = tier_slots[tier];
+    int64_t last = time(NULL) / step;
+    int64_t first = last - (span + step - 1) / step + 1;
+    if (first <= last - slots)
+        first = last - slots + 1;
+    const uint32_t* times = history_times(base, header, tier);
+    const int16_t* columns[HISTORY_STATS][HISTORY_COLUMNS];
+    for (int s = 0; s < HISTORY_STATS; s++)
+        for (int c = 0; c < HISTORY_COLUMNS; c++)
+            columns[s][c] = history_values(base, header, tier, s, c);
+    if (stats) {
+        history_print_stats(out, tier, times, columns, first, last, &header->acc[tier], above);
+        munmap(base, size);
+        return 0;
+    }
+    fprintf(out, "# %s tier, %lld s intervals%s\ntime", tier_names[tier], (long long) step,
+            tier == HISTORY_SECONDS ? "" : ", mean/min/max");
+    for (int c = 0; c < HISTORY_COLUMNS; c++)
+        fprintf(out, " %s", column_names[c]);
+    fprintf(out, "\n");
+    long recorded = 0;
+    for (int64_t bucket = first; bucket <= last; bucket++) {
+        int slot = bucket % slots;
+        if (times[slot] != (uint32_t) (bucket * step))
+            continue;
+        int16_t values[HISTORY_STATS][HISTORY_COLUMNS];
+        for (int s = 0; s < HISTORY_STATS; s++)
+            for (int c = 0; c < HISTORY_COLUMNS; c++)
+                values[s][c] = columns[s][c][slot];
+        history_print_row(out, tier, bucket * step, values);
+        recorded++;
+    }
+    // the interval in progress (or left when the daemon stopped) is still
+    // in the accumulator, and always the newest
+    const history_acc* acc = &header->acc[tier];
+    if (acc->bucket >= first && acc->bucket <= last) {
+        int16_t values[HISTORY_STATS][HISTORY_COLUMNS];
+        for (int c = 0; c < HISTORY_COLUMNS; c++) {
+            values[HISTORY_MIN][c] = acc->count[c] ? acc->min[c] : HISTORY_MISSING;
+            values[HISTORY_MEAN][c] = acc->count[c] ? (acc->sum[c] + acc->count[c] / 2) / acc->count[c] : HISTORY_MISSING;
+            values[HISTORY_MAX][c] = acc->count[c] ? acc->max[c] : HISTORY_MISSING;
+        }
+        history_print_row(out, tier, acc->bucket * step, values);
+        recorded++;
+    }
+    fprintf(out, "# %ld of %lld intervals recorded\n", recorded, (long long) (last - first + 1));
+    munmap(base, size);
+    return 0;
+}
+
+static size_t history_align(size_t size) {
+    return (size + HISTORY_PAGE - 1) & ~(size_t) (HISTORY_PAGE - 1);
+}
+
+/* Fill a fresh header and return the file size of its layout: the header
+ * page, then per tier the start times and one array per stat and column,
+ * each starting on its own page. */
+static size_t history_init_header(history_header* header) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, HISTORY_MAGIC, sizeof(header->magic));
+    header->columns = HISTORY_COLUMNS;
+    header->tiers = HISTORY_TIERS;
+    size_t offset = history_align(sizeof(*header));
+    for (int t = 0; t < HISTORY_TIERS; t++) {
+        header->layout[t].step_s = tier_steps[t];
+        header->layout[t].slots = tier_slots[t];
+        header->layout[t].offset = offset;
+        offset += history_align(tier_slots[t] * sizeof(uint32_t))
+                + HISTORY_STATS * HISTORY_COLUMNS * history_align(tier_slots[t] * sizeof(int16_t));
+        header->acc[t].bucket = -1;
+    }
+    return offset;
+}
+
+static uint32_t* history_times(char* base, const history_header* header, int tier) {
+    return (uint32_t*) (base + header->layout[tier].offset);
+}
+
+static int16_t* history_values(char* base, const history_header* header, int tier,
+        history_stat stat, history_column column) {
+    const history_layout* layout = &header->layout[tier];
+    return (int16_t*) (base + layout->offset + history_align(layout->slots * sizeof(uint32_t))
+            + (stat * HISTORY_COLUMNS + column) * history_align(layout->slots * sizeof(int16_t)));
+}
+
+/* Fold a sample, or a finished interval of the tier below, into a tier. */
+static void history_add(int tier, int64_t bucket, const int32_t* min, const int32_t* max,
+        const int64_t* sum, const int32_t* count) {
+    history_acc* acc = &((history_header*) history.base)->acc[tier];
+    if (acc->bucket != bucket) {
+        if (acc->bucket >= 0)
+            history_flush(tier);
+        memset(acc, 0, sizeof(*acc));
+        acc->bucket = bucket;
+    }
+    for (int c = 0; c < HISTORY_COLUMNS; c++) {
+        if (count[c] == 0)
+            continue;
+        if (acc->count[c] == 0 || min[c] < acc->min[c])
+            acc->min[c] = min[c];
+        if (acc->count[c] == 0 || max[c] > acc->max[c])
+            acc->max[c] = max[c];
+        acc->sum[c] += sum[c];
+        acc->count[c] += count[c];
+    }
+}
+
+/* Write a finished interval to its slot and pass it on to the next tier. */
+static void history_flush(int tier) {
+    history_header* header = (history_header*) history.base;
+    history_acc* acc = &header->acc[tier];
+    int slot = acc->bucket % tier_slots[tier];
+    for (int c = 0; c < HISTORY_COLUMNS; c++) {
+        int n = acc->count[c];
+        history_values(history.base, header, tier, HISTORY_MIN, c)[slot] = n ? acc->min[c] : HISTORY_MISSING;
+        history_values(history.base, header, tier, HISTORY_MEAN, c)[slot] =
+                n ? (acc->sum[c] + n / 2) / n : HISTORY_MISSING;
+        history_values(history.base, header, tier, HISTORY_MAX, c)[slot] = n ? acc->max[c] : HISTORY_MISSING;
+    }
+    // the start time goes last: a reader never sees it with old values
+    history_times(history.base, header, tier)[slot] = acc->bucket * tier_steps[tier];
+    if (tier + 1 < HISTORY_TIERS)
+        history_add(tier + 1, acc->bucket * tier_steps[tier] / tier_steps[tier + 1],
+                acc->min, acc->max, acc->sum, acc->count);
+}
+
+static void history_print_row(FILE* out, int tier, time_t start, const int16_t (*values)[HISTORY_COLUMNS]) {
+    char when[32];
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&start, &tm));
+    fprintf(out, "%s", when);
+    for (int c = 0; c < HISTORY_COLUMNS; c++) {
+        if (values[HISTORY_MEAN][c] == HISTORY_MISSING) {
+            fprintf(out, " -");
+            continue;
+        }
+        fprintf(out, " %.1f", values[HISTORY_MEAN][c] / 10.0);
+        if (tier != HISTORY_SECONDS)
+            fprintf(out, "/%.1f/%.1f", values[HISTORY_MIN][c] / 10.0, values[HISTORY_MAX][c] / 10.0);
+    }
+    fprintf(out, "\n");
+}
+
+/* Summarise the slots of buckets first..last, as one or two runs of the
+ * ring plus the accumulator, with the analytics kernels. */
+static void history_print_stats(FILE* out, int tier, const uint32_t* times,
+        const int16_t* (*columns)[HISTORY_COLUMNS], int64_t first, int64_t last,
+        const history_acc* acc, double above) {
+    static const int percentiles[] = { 50, 95, 99 };
+    int64_t step = tier_steps[tier], slots = tier_slots[tier];
+    uint32_t from = first * step, to = last * step;
+    int start = first % slots, end = last % slots;
+    // runs of slots: [start, end], or [start, slots) and [0, end] when the
+    // period wraps, with stale slots left out by their start times
+    int runs = start <= end ? 1 : 2;
+    int run_start[3] = { start, 0, 0 };
+    int run_n[3] = { start <= end ? end - start + 1 : slots - start, end + 1, 0 };
+    // the accumulator as a run of one slot of its own
+    uint32_t acc_time = acc->bucket * step;
+    int16_t acc_values[HISTORY_STATS][HISTORY_COLUMNS];
+    for (int c = 0; c < HISTORY_COLUMNS; c++) {
+        acc_values[HISTORY_MIN][c] = acc->count[c] ? acc->min[c] : HISTORY_MISSING;
+        acc_values[HISTORY_MEAN][c] = acc->count[c] ? (acc->sum[c] + acc->count[c] / 2) / acc->count[c] : HISTORY_MISSING;
+        acc_values[HISTORY_MAX][c] = acc->count[c] ? acc->max[c] : HISTORY_MISSING;
+    }
+    int with_acc = acc->bucket >= first && acc->bucket <= last;
+    int threshold = (int) lround(above * 10);
+
+    fprintf(out, "# %s tier, %lld s intervals, %lld intervals\n", tier_names[tier], (long long) step,
+            (long long) (last - first + 1));
+    for (int c = 0; c < HISTORY_COLUMNS; c++) {
+        analytics_span spans[3];
+        analytics_summary means, mins, maxs;
+        analytics_summary_init(&means);
+        analytics_summary_init(&mins);
+        analytics_summary_init(&maxs);
+        for (int r = 0; r < runs; r++) {
+            spans[r] = (analytics_span) { times + run_start[r], columns[HISTORY_MEAN][c] + run_start[r], run_n[r] };
+            analytics_summarize(spans[r].times, spans[r].values, spans[r].n, from, to, threshold, &means);
+            if (tier != HISTORY_SECONDS) {
+                analytics_summarize(spans[r].times, columns[HISTORY_MIN][c] + run_start[r], run_n[r],
+                        from, to, threshold, &mins);
+                analytics_summarize(spans[r].times, columns[HISTORY_MAX][c] + run_start[r], run_n[r],
+                        from, to, threshold, &maxs);
+            }
+        }
+        int n = runs;
+        if (with_acc) {
+            spans[n++] = (analytics_span) { &acc_time, &acc_values[HISTORY_MEAN][c], 1 };
+            analytics_summarize(&acc_time, &acc_values[HISTORY_MEAN][c], 1, from, to, threshold, &means);
+            analytics_summarize(&acc_time, &acc_values[HISTORY_MIN][c], 1, from, to, threshold, &mins);
+            analytics_summarize(&acc_time, &acc_values[HISTORY_MAX][c], 1, from, to, threshold, &maxs);
+        }
+        fprintf(out, "%s count %ld", column_names[c], means.count);
+        if (means.count == 0) {
+            fprintf(out, "\n");
+            continue;
+        }
+        // per-second slots are their own minimum and maximum
+        int min = tier == HISTORY_SECONDS ? means.min : mins.min;
+        int max = tier == HISTORY_SECONDS ? means.max : maxs.max;
+        fprintf(out, " min %.1f max %.1f mean %.1f", min / 10.0, max / 10.0,
+                (double) means.sum / means.count / 10);
+        int ranks[3];
+        if (analytics_percentiles(spans, n, from, to, &means, percentiles, ranks, 3) == 0) {
+            for (int p = 0; p < 3; p++)
+                fprintf(out, " p%d %.1f", percentiles[p], ranks[p] / 10.0);
+        }
+        if (c == HISTORY_CPU_TEMP || c == HISTORY_GPU_TEMP)
+            fprintf(out, " above_%g_s %lld", above, (long long) (means.above * step));
+        fprintf(out, "\n");
+    }
+    // how closely each fan follows its temperature
+    static const int pairs[][2] = { { HISTORY_CPU_DUTY, HISTORY_CPU_TEMP }, { HISTORY_GPU_DUTY, HISTORY_GPU_TEMP } };
+    for (int i = 0; i < 2; i++) {
+        int x = pairs[i][0], y = pairs[i][1];
+        analytics_moments m;
+        memset(&m, 0, sizeof(m));
+        for (int r = 0; r < runs; r++)
+            analytics_correlate(times + run_start[r], columns[HISTORY_MEAN][x] + run_start[r],
+                    columns[HISTORY_MEAN][y] + run_start[r], run_n[r], from, to, &m);
+        if (with_acc)
+            analytics_correlate(&acc_time, &acc_values[HISTORY_MEAN][x], &acc_values[HISTORY_MEAN][y], 1,
+                    from, to, &m);
+        double r = analytics_pearson(&m);
+        if (isnan(r))
+            fprintf(out, "%s~%s count %ld r -\n", column_names[x], column_names[y], m.count);
+        else
+            fprintf(out, "%s~%s count %ld r %.3f\n", column_names[x], column_names[y], m.count, r);
+    }
+}
@@ -0,0 +1,73 @@
+/*
+ ============================================================================
+ Name        : history.h
+ Description : Tiered, memory-mapped time-series history
+ ============================================================================
+
+ The auto mode records the temperatures and the fan duties it applied into
+ a fixed-size file mapped into memory, in three tiers: one slot per second
+ for a day, per minute for a month and per hour for a year. A slot holds
+ the minimum, mean and maximum of each column over its interval, and its
+ start time.
+
+ Samples are folded into an accumulator for the current second; when the
+ second is over it is written to its slot and folded into the accumulator
+ of the current minute, and so on up to the hours, so downsampling costs a
+ few additions per tick and nothing is ever rescanned. The accumulators
+ live in the file header, and a restarted daemon carries on where the
+ previous one stopped.
+
+ A slot's position is its interval number modulo the tier size, and each
+ column of a tier is a contiguous array: "clevo-indicator history --since
+ 7d" works out which slots hold the last week and reads only the pages
+ they sit in, without the daemon. Slots whose start time doesn't match
+ were never written (the daemon wasn't running) and are skipped.
+ */
+
+#ifndef CLEVO_HISTORY_H
+#define CLEVO_HISTORY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define HISTORY_DEFAULT_PATH "/var/lib/clevo-indicator/history"
+#define HISTORY_MISSING INT16_MIN   /* no sample in the interval */
+
+typedef enum {
+    HISTORY_CPU_TEMP = 0, HISTORY_GPU_TEMP, HISTORY_CPU_DUTY, HISTORY_GPU_DUTY, HISTORY_COLUMNS
+} history_column;
+
+typedef enum {
+    HISTORY_MIN = 0, HISTORY_MEAN, HISTORY_MAX, HISTORY_STATS
+} history_stat;
+
+typedef enum {
+    HISTORY_SECONDS = 0, HISTORY_MINUTES, HISTORY_HOURS, HISTORY_TIERS
+} history_tier;
+
+/* History file path: $CLEVO_HISTORY or HISTORY_DEFAULT_PATH. The variable
+ * is ignored in a setuid process. */
+const char* history_path(void);
+
+/* Map the history file for recording, creating or resetting it when its
+ * layout doesn't match. A symlink in its place is refused. Returns 0 on
+ * success. */
+int history_open(const char* path);
+void history_close(void);
+
+/* Add a sample of every column at the current time; NaN for a value that
+ * wasn't read. */
+void history_record(const double* values);
+/* The same at a given time, which must not go backwards. */
+void history_record_at(const double* values, time_t now);
+
+/* "history" subcommand: print the slots of the finest tier covering the
+ * last since ("90s", "15m", "12h", "7d"), or of tier ("sec", "min",
+ * "hour"), read from the file at path. With stats, print per column the
+ * count, min, max, mean, percentiles and, for temperatures, the seconds
+ * above above (°C), then the duty/temperature correlations instead. */
+int history_query(const char* path, const char* since, const char* tier, int stats, double above,
+        FILE* out);
+
+#endif
@@ -0,0 +1,508 @@
+/*
+ ============================================================================
+ Name        : hwmon.c
+ Description : hwmon chip and channel registry
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "hwmon.h"
+#include "uring.h"
+
+#define HWMON_CHECK_INTERVAL_US 5000000
+
+static struct {
+    hwmon_chip chips[HWMON_MAX_CHIPS];
+    int chip_count;
+    unsigned generation;
+    uint64_t signature;
+    uint64_t last_check_us;
+    int dirty;
+    int use_io_uring;
+    unsigned registered_generation;
+    int registered_count;
+    hwmon_channel* open_channels[HWMON_MAX_CHIPS * HWMON_MAX_CHANNELS];
+    int open_count;
+} hwmon;
+
+static const char* hwmon_type_names[] = { "temp", "fan", "pwm" };
+
+/* Taken by every entry point; recursive so hwmon_ref_read() and friends can
+ * be called while holding it through hwmon_lock(). */
+static pthread_mutex_t hwmon_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+static int hwmon_scan_unlocked(void);
+static int hwmon_chip_compare(const void* a, const void* b);
+static const hwmon_chip* hwmon_find_device(const char* prefix, const char* device);
+static void hwmon_check_unlocked(void);
+static void hwmon_prefetch_unlocked(void);
+static int hwmon_read_unlocked(const hwmon_chip* chip, hwmon_channel* channel,
+        long* value);
+static int hwmon_write_unlocked(const hwmon_chip* chip, hwmon_channel* channel,
+        long value);
+static uint64_t hwmon_signature(void);
+static void hwmon_scan_chip(hwmon_chip* chip);
+static void hwmon_close_all(void);
+static void hwmon_command(const char* args, FILE* out);
+static int hwmon_open(const hwmon_chip* chip, hwmon_channel* channel);
+static int hwmon_parse(const char* buffer, ssize_t len, long* value);
+
+void hwmon_lock(void) {
+    pthread_mutex_lock(&hwmon_mutex);
+}
+
+void hwmon_unlock(void) {
+    pthread_mutex_unlock(&hwmon_mutex);
+}
+
+int hwmon_scan(void) {
+    hwmon_lock();
+    int count = hwmon_scan_unlocked();
+    hwmon_unlock();
+    return count;
+}
+
+void hwmon_check(void) {
+    hwmon_lock();
+    hwmon_check_unlocked();
+    hwmon_unlock();
+}
+
+void hwmon_prefetch(void) {
+    hwmon_lock();
+    hwmon_prefetch_unlocked();
+    hwmon_unlock();
+}
+
+int hwmon_read(const hwmon_chip* chip, hwmon_channel* channel, long* value) {
+    hwmon_lock();
+    int result = hwmon_read_unlocked(chip, channel, value);
+    hwmon_unlock();
+    return result;
+}
+
+int hwmon_write(const hwmon_chip* chip, hwmon_channel* channel, long value) {
+    hwmon_lock();
+    int result = hwmon_write_unlocked(chip, channel, value);
+    hwmon_unlock();
+    return result;
+}
+
+static int hwmon_scan_unlocked(void) {
+    hwmon_close_all();
+    hwmon.chip_count = 0;
+    hwmon.generation++;
+    hwmon.dirty = 0;
+    hwmon.signature = hwmon_signature();
+    hwmon.last_check_us = util_now_us();
+
+    char class_path[UTIL_PATH_MAX];
+    util_path(class_path, sizeof(class_path), "/sys/class/hwmon");
+    DIR* dir = opendir(class_path);
+    if (dir == NULL)
+        return 0;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL && hwmon.chip_count < HWMON_MAX_CHIPS) {
+        if (strncmp(ent->d_name, "hwmon", 5) != 0)
+            continue;
+        hwmon_chip* chip = &hwmon.chips[hwmon.chip_count];
+        char path[UTIL_PATH_MAX];
+        int len = snprintf(chip->dir, sizeof(chip->dir), "%s/%s", class_path, ent->d_name);
+        if (len < 0 || (size_t) len >= sizeof(chip->dir) - sizeof("/device"))
+            continue;
+        snprintf(path, sizeof(path), "%.*s/name", len, chip->dir);
+        if (util_read_line(path, chip->name, sizeof(chip->name)) != 0)
+            continue;
+        snprintf(path, sizeof(path), "%.*s/device", len, chip->dir);
+        char resolved[PATH_MAX];
+        // virtual chips such as acpitz have no device link
+        if (realpath(path, resolved) == NULL && realpath(chip->dir, resolved) == NULL)
+            snprintf(resolved, sizeof(resolved), "%s", chip->dir);
+        if (strlen(resolved) >= sizeof(chip->device))
+            continue;
+        memcpy(chip->device, resolved, strlen(resolved) + 1);
+        hwmon_scan_chip(chip);
+        hwmon.chip_count++;
+    }
+    closedir(dir);
+    // readdir() order follows the hwmonN numbering, which changes as chips
+    // come and go; the device paths don't
+    qsort(hwmon.chips, hwmon.chip_count, sizeof(hwmon.chips[0]), &hwmon_chip_compare);
+    return hwmon.chip_count;
+}
+
+static int hwmon_chip_compare(const void* a, const void* b) {
+    const hwmon_chip* x = a;
+    const hwmon_chip* y = b;
+    int order = strcmp(x->device, y->device);
+    return order != 0 ? order : strcmp(x->name, y->name);
+}
+
+static void hwmon_check_unlocked(void) {
+    uint64_t now = util_now_us();
+    if (!hwmon.dirty && now - hwmon.last_check_us < HWMON_CHECK_INTERVAL_US)
+        return;
+    hwmon.last_check_us = now;
+    if (hwmon.dirty || hwmon_signature() != hwmon.signature) {
+        hwmon_scan_unlocked();
+        printf("hwmon registry rebuilt, %d chips\n", hwmon.chip_count);
+    }
+}
+
+unsigned hwmon_generation(void) {
+    return hwmon.generation;
+}
+
+int hwmon_chip_count(void) {
+    return hwmon.chip_count;
+}
+
+const hwmon_chip* hwmon_chip_at(int i) {
+    return i >= 0 && i < hwmon.chip_count ? &hwmon.chips[i] : NULL;
+}
+
+const hwmon_chip* hwmon_find_chip(const char* prefix, int nth) {
+    size_t len = strlen(prefix);
+    for (int i = 0; i < hwmon.chip_count; i++)
+        if (strncmp(hwmon.chips[i].name, prefix, len) == 0 && nth-- == 0)
+            return &hwmon.chips[i];
+    return NULL;
+}
+
+static const hwmon_chip* hwmon_find_device(const char* prefix, const char* device) {
+    size_t len = strlen(prefix);
+    for (int i = 0; i < hwmon.chip_count; i++)
+        if (strcmp(hwmon.chips[i].device, device) == 0 && strncmp(hwmon.chips[i].name, prefix, len) == 0)
+            return &hwmon.chips[i];
+    return NULL;
+}
+
+hwmon_channel* hwmon_find_channel(const hwmon_chip* chip, hwmon_type type,
+        int index) {
+    if (chip == NULL)
+        return NULL;
+    for (int i = 0; i < chip->channel_count; i++)
+        if (chip->channels[i].type == type && chip->channels[i].index == index)
+            return (hwmon_channel*) &chip->channels[i];
+    return NULL;
+}
+
+static int hwmon_read_unlocked(const hwmon_chip* chip, hwmon_channel* channel,
+        long* value) {
+    if (channel->sampled_us != 0
+            && util_now_us() - channel->sampled_us < HWMON_PREFETCH_MAX_AGE_US) {
+        *value = channel->value;
+        return 0;
+    }
+    if (channel->fd < 0 && hwmon_open(chip, channel) != 0)
+        return -1;
+    char buffer[32];
+    ssize_t len = pread(channel->fd, buffer, sizeof(buffer) - 1, 0);
+    if (len < 0 && (errno == ENODEV || errno == ENOENT || errno == ENXIO))
+        hwmon.dirty = 1;  // the chip went away under us
+    return hwmon_parse(buffer, len, value);
+}
+
+static int hwmon_write_unlocked(const hwmon_chip* chip, hwmon_channel* channel,
+        long value) {
+    if (channel->fd < 0 && hwmon_open(chip, channel) != 0)
+        return -1;
+    char buffer[32];
+    int len = snprintf(buffer, sizeof(buffer), "%ld\n", value);
+    channel->sampled_us = 0;
+    if (pwrite(channel->fd, buffer, len, 0) != len) {
+        if (errno == ENODEV || errno == ENOENT || errno == ENXIO)
+            hwmon.dirty = 1;
+        return -1;
+    }
+    return 0;
+}
+
+void hwmon_ref_init(hwmon_ref* ref, const char* chip, int nth,
+        hwmon_type type, int index) {
+    snprintf(ref->chip, sizeof(ref->chip), "%s", chip);
+    ref->nth = nth;
+    ref->type = type;
+    ref->index = index;
+    ref->generation = 0;
+    ref->channel = NULL;
+    ref->owner = NULL;
+    ref->device[0] = '\0';
+}
+
+static int hwmon_ref_resolve(hwmon_ref* ref) {
+    if (ref->generation != hwmon.generation) {
+        ref->generation = hwmon.generation;
+        // once bound, a ref stays with its chip's device rather than
+        // moving on to whichever chip is nth now
+        if (ref->device[0] != '\0') {
+            ref->owner = hwmon_find_device(ref->chip, ref->device);
+        } else {
+            ref->owner = hwmon_find_chip(ref->chip, ref->nth);
+            if (ref->owner != NULL)
+                snprintf(ref->device, sizeof(ref->device), "%s", ref->owner->device);
+        }
+        ref->channel = hwmon_find_channel(ref->owner, ref->type, ref->index);
+    }
+    return ref->channel != NULL ? 0 : -1;
+}
+
+int hwmon_ref_read(hwmon_ref* ref, long* value) {
+    hwmon_lock();
+    int result = hwmon_ref_resolve(ref) == 0 ?
+            hwmon_read_unlocked(ref->owner, ref->channel, value) : -1;
+    hwmon_unlock();
+    return result;
+}
+
+int hwmon_ref_write(hwmon_ref* ref, long value) {
+    hwmon_lock();
+    int result = hwmon_ref_resolve(ref) == 0 ?
+            hwmon_write_unlocked(ref->owner, ref->channel, value) : -1;
+    hwmon_unlock();
+    return result;
+}
+
+static void hwmon_prefetch_unlocked(void) {
+    static uring_read reads[HWMON_MAX_CHIPS * HWMON_MAX_CHANNELS];
+    static char buffers[HWMON_MAX_CHIPS * HWMON_MAX_CHANNELS][32];
+    hwmon.open_count = 0;
+    for (int i = 0; i < hwmon.chip_count; i++) {
+        hwmon_chip* chip = &hwmon.chips[i];
+        for (int j = 0; j < chip->channel_count; j++) {
+            hwmon_channel* ch = &chip->channels[j];
+            ch->sampled_us = 0;
+            if (ch->fd < 0)
+                continue;
+            uring_read* r = &reads[hwmon.open_count];
+            r->fd = ch->fd;
+            r->buffer = buffers[hwmon.open_count];
+            r->size = sizeof(buffers[0]) - 1;
+            r->offset = 0;
+            r->result = -EIO;
+            hwmon.open_channels[hwmon.open_count++] = ch;
+        }
+    }
+    if (hwmon.open_count == 0)
+        return;
+
+    int batched = 0;
+    if (hwmon.use_io_uring) {
+        // the registered file table follows the set of open channels
+        if (hwmon.registered_generation != hwmon.generation
+                || hwmon.registered_count != hwmon.open_count) {
+            static int fds[HWMON_MAX_CHIPS * HWMON_MAX_CHANNELS];
+            for (int i = 0; i < hwmon.open_count; i++)
+                fds[i] = reads[i].fd;
+            if (uring_register_fds(fds, hwmon.open_count) == 0) {
+                hwmon.registered_generation = hwmon.generation;
+                hwmon.registered_count = hwmon.open_count;
+            } else {
+                hwmon.registered_count = -1;
+            }
+        }
+        batched = hwmon.registered_count == hwmon.open_count
+                && uring_read_batch(reads, hwmon.open_count) == 0;
+        if (!batched)
+            hwmon.registered_count = -1;  // register again on the next tick
+    }
+    if (!batched) {
+        for (int i = 0; i < hwmon.open_count; i++) {
+            reads[i].result = pread(reads[i].fd, reads[i].buffer, reads[i].size, 0);
+            if (reads[i].result < 0)
+                reads[i].result = -errno;
+        }
+    }
+
+    uint64_t now = util_now_us();
+    for (int i = 0; i < hwmon.open_count; i++) {
+        hwmon_channel* ch = hwmon.open_channels[i];
+        ssize_t len = reads[i].result;
+        if (len == -ENODEV || len == -ENOENT || len == -ENXIO)
+            hwmon.dirty = 1;
+        if (hwmon_parse(reads[i].buffer, len, &ch->value) == 0)
+            ch->sampled_us = now;
+    }
+}
+
+int hwmon_use_io_uring(int enable) {
+    if (!enable) {
+        hwmon.use_io_uring = 0;
+        uring_exit();
+        return 0;
+    }
+    if (uring_init() != 0) {
+        printf("io_uring not available: %s\n", strerror(errno));
+        return -1;
+    }
+    hwmon.use_io_uring = 1;
+    hwmon.registered_count = 0;
+    return 0;
+}
+
+int hwmon_bench(int iterations, FILE* out) {
+    if (hwmon_scan() == 0) {
+        fprintf(out, "no hwmon chips\n");
+        return -1;
+    }
+    // open every channel, like a loop using all of them would
+    long value;
+    for (int i = 0; i < hwmon.chip_count; i++)
+        for (int j = 0; j < hwmon.chips[i].channel_count; j++)
+            hwmon_read(&hwmon.chips[i], &hwmon.chips[i].channels[j], &value);
+    for (int mode = 0; mode < 2; mode++) {
+        if (hwmon_use_io_uring(mode) != 0)
+            break;
+        hwmon_prefetch();  // warm up, registers the files
+        uint64_t start = util_now_us();
+        for (int i = 0; i < iterations; i++)
+            hwmon_prefetch();
+        uint64_t elapsed = util_now_us() - start;
+        fprintf(out, "%-8s %d reads/tick, %.2f us/tick, %d syscalls/tick\n",
+                mode ? "io_uring" : "pread", hwmon.open_count,
+                (double) elapsed / iterations, mode ? 1 : hwmon.open_count);
+    }
+    hwmon_use_io_uring(0);
+    return 0;
+}
+
+void hwmon_dump(FILE* out) {
+    hwmon_lock();
+    for (int i = 0; i < hwmon.chip_count; i++) {
+        const hwmon_chip* chip = &hwmon.chips[i];
+        fprintf(out, "%s %s %s\n", chip->name, chip->dir, chip->device);
+        for (int j = 0; j < chip->channel_count; j++) {
+            const hwmon_channel* ch = &chip->channels[j];
+            fprintf(out, "  %s%d %s%s\n", hwmon_type_names[ch->type], ch->index,
+                    ch->label[0] != '\0' ? ch->label : "-",
+                    ch->fd >= 0 ? " (open)" : "");
+        }
+    }
+    hwmon_unlock();
+}
+
+void hwmon_register(void) {
+    ctl_register("hwmon", "hwmon chips, device paths and channels",
+            &hwmon_command);
+}
+
+/* One readdir() of /sys/class/hwmon: the entries' names and inode numbers
+ * change whenever a chip comes or goes. */
+static uint64_t hwmon_signature(void) {
+    char class_path[UTIL_PATH_MAX];
+    util_path(class_path, sizeof(class_path), "/sys/class/hwmon");
+    DIR* dir = opendir(class_path);
+    if (dir == NULL)
+        return 0;
+    uint64_t signature = 0;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        uint64_t h = 14695981039346656037ULL;
+        for (const char* p = ent->d_name; *p != '\0'; p++)
+            h = (h ^ (unsigned char) *p) * 1099511628211ULL;
+        signature += h ^ (uint64_t) ent->d_ino;
+    }
+    closedir(dir);
+    return signature;
+}
+
+static void hwmon_scan_chip(hwmon_chip* chip) {
+    chip->channel_count = 0;
+    DIR* dir = opendir(chip->dir);
+    if (dir == NULL)
+        return;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL
+            && chip->channel_count < HWMON_MAX_CHANNELS) {
+        hwmon_channel* ch = &chip->channels[chip->channel_count];
+        int index, consumed = 0;
+        size_t len = strlen(ent->d_name);
+        if (sscanf(ent->d_name, "temp%d_input%n", &index, &consumed) == 1
+                && (size_t) consumed == len)
+            ch->type = HWMON_TEMP;
+        else if (sscanf(ent->d_name, "fan%d_input%n", &index, &consumed) == 1
+                && (size_t) consumed == len)
+            ch->type = HWMON_FAN;
+        else if (sscanf(ent->d_name, "pwm%d%n", &index, &consumed) == 1
+                && (size_t) consumed == len)
+            ch->type = HWMON_PWM;
+        else
+            continue;
+        if (len >= sizeof(ch->file))
+            continue;
+        ch->index = index;
+        ch->fd = -1;
+        ch->sampled_us = 0;
+        memcpy(ch->file, ent->d_name, len + 1);
+        char path[UTIL_PATH_MAX];
+        int path_len = snprintf(path, sizeof(path), "%s/%s%d_label", chip->dir,
+                hwmon_type_names[ch->type], index);
+        if (path_len < 0 || (size_t) path_len >= sizeof(path)
+                || util_read_line(path, ch->label, sizeof(ch->label)) != 0)
+            ch->label[0] = '\0';
+        chip->channel_count++;
+    }
+    closedir(dir);
+}
+
+static void hwmon_close_all(void) {
+    for (int i = 0; i < hwmon.chip_count; i++) {
+        hwmon_chip* chip = &hwmon.chips[i];
+        for (int j = 0; j < chip->channel_count; j++) {
+            if (chip->channels[j].fd >= 0)
+                close(chip->channels[j].fd);
+            chip->channels[j].fd = -1;
+        }
+    }
+}
+
+static void hwmon_command(const char* args, FILE* out) {
+    hwmon_dump(out);
+}
+
+static int hwmon_parse(const char* buffer, ssize_t len, long* value) {
+    if (len <= 0)
+        return -1;
+    char text[32];
+    if (len >= (ssize_t) sizeof(text))
+        len = sizeof(text) - 1;
+    memcpy(text, buffer, len);
+    text[len] = '\0';
+    char* endptr;
+    long v = strtol(text, &endptr, 10);
+    if (endptr == text)
+        return -1;
+    *value = v;
+    return 0;
+}
+
+static int hwmon_open(const hwmon_chip* chip, hwmon_channel* channel) {
+    char path[UTIL_PATH_MAX];
+    int len = snprintf(path, sizeof(path), "%s/%s", chip->dir, channel->file);
+    if (len < 0 || (size_t) len >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int flags = channel->type == HWMON_PWM ? O_RDWR : O_RDONLY;
+    channel->fd = open(path, flags | O_CLOEXEC);
+    if (channel->fd < 0 && flags == O_RDWR)
+        channel->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (channel->fd < 0) {
+        if (errno == ENOENT || errno == ENODEV)
+            hwmon.dirty = 1;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ ============================================================================
+ Name        : hwmon.h
+ Description : hwmon chip and channel registry
+ ============================================================================
+
+ hwmon_scan() walks /sys/class/hwmon once and records every chip with its
+ name, its stable device path (the resolved "device" link, which survives
+ the hwmonN renumbering across boots) and its temp*_input, fan*_input and
+ pwm* channels with their labels. A channel's file is opened on first use
+ and kept open, so a read in the control loop is a single pread().
+
+ The registry is rebuilt by hwmon_check() when the set of hwmon entries
+ changes (hotplug, module reload) or a channel read fails. Every rebuild
+ bumps hwmon_generation(); hwmon_ref caches a lookup and redoes it only
+ when the generation moved on.
+
+ All entry points are thread-safe. Chip and channel pointers are only
+ stable while hwmon_lock() is held or until the next rebuild.
+
+ hwmon_prefetch() reads every open channel at the start of a tick, either
+ with one pread() each or, after hwmon_use_io_uring(), as a single io_uring
+ batch on registered fds. Reads within HWMON_PREFETCH_MAX_AGE_US of the
+ prefetch are served from that batch.
+ */
+
+#ifndef CLEVO_HWMON_H
+#define CLEVO_HWMON_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util.h"
+
+#define HWMON_MAX_CHIPS 32
+#define HWMON_MAX_CHANNELS 48
+#define HWMON_NAME_MAX 32
+#define HWMON_PREFETCH_MAX_AGE_US 100000
+
+typedef enum {
+    HWMON_TEMP = 0, HWMON_FAN, HWMON_PWM
+} hwmon_type;
+
+typedef struct {
+    hwmon_type type;
+    int index;                  /* N of tempN_input, fanN_input, pwmN */
+    char file[HWMON_NAME_MAX];  /* e.g. "temp1_input" */
+    char label[HWMON_NAME_MAX]; /* from tempN_label, empty if missing */
+    int fd;                     /* -1 until first used */
+    long value;                 /* from the last prefetch */
+    uint64_t sampled_us;        /* 0 when there's no prefetched value */
+} hwmon_channel;
+
+typedef struct {
+    char name[HWMON_NAME_MAX];
+    char dir[UTIL_PATH_MAX];    /* /sys/class/hwmon/hwmonN */
+    char device[UTIL_PATH_MAX]; /* resolved device path */
+    hwmon_channel channels[HWMON_MAX_CHANNELS];
+    int channel_count;
+} hwmon_chip;
+
+/* A cached lookup of "channel <type><index> of the nth chip whose name
+ * starts with <chip>". The first time that finds a chip, the ref is bound
+ * to the chip's device path and from then on only follows that device, so
+ * chips coming and going never make it silently switch to another one. */
+typedef struct {
+    char chip[HWMON_NAME_MAX];
+    int nth;
+    char device[UTIL_PATH_MAX]; /* bound device path, empty until found */
+    hwmon_type type;
+    int index;
+    unsigned generation;
+    hwmon_channel* channel;
+    const hwmon_chip* owner;
+} hwmon_ref;
+
+void hwmon_lock(void);
+void hwmon_unlock(void);
+
+/* (Re)build the registry. Returns the number of chips found. */
+int hwmon_scan(void);
+
+/* Cheap hotplug check, rebuilds the registry when needed. Call once per
+ * control tick. */
+void hwmon_check(void);
+
+unsigned hwmon_generation(void);
+int hwmon_chip_count(void);
+const hwmon_chip* hwmon_chip_at(int i);
+
+/* nth chip (counting from 0, in device path order) whose name starts with
+ * prefix, or NULL. */
+const hwmon_chip* hwmon_find_chip(const char* prefix, int nth);
+hwmon_channel* hwmon_find_channel(const hwmon_chip* chip, hwmon_type type,
+        int index);
+
+/* pread()/pwrite() on the channel's kept-open file. Return 0 on success. */
+int hwmon_read(const hwmon_chip* chip, hwmon_channel* channel, long* value);
+int hwmon_write(const hwmon_chip* chip, hwmon_channel* channel, long value);
+
+void hwmon_ref_init(hwmon_ref* ref, const char* chip, int nth,
+        hwmon_type type, int index);
+/* Resolve (if the registry changed) and read/write. */
+int hwmon_ref_read(hwmon_ref* ref, long* value);
+int hwmon_ref_write(hwmon_ref* ref, long value);
+
+/* Read all open channels for this tick. */
+void hwmon_prefetch(void);
+
+/* Switch prefetching to io_uring. Returns 0 when io_uring is usable. */
+int hwmon_use_io_uring(int enable);
+
+/* Open every channel and compare pread() against io_uring prefetching. */
+int hwmon_bench(int iterations, FILE* out);
+
+void hwmon_dump(FILE* out);
+
+/* Register the "hwmon" socket command. */
+void hwmon_register(void);
+
+#endif
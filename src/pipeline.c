@@ -0,0 +1,162 @@
+/*
+ ============================================================================
+ Name        : pipeline.c
+ Description : Lock-free SPSC queues and stage statistics of the auto mode
+ ============================================================================
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "pipeline.h"
+
+typedef struct {
+    const char* name;
+    pthread_mutex_t lock;
+    unsigned long items;
+    unsigned long dropped;      /* items the stage could not hand on */
+    uint64_t wait_total_us;
+    uint64_t wait_max_us;
+    uint64_t service_total_us;
+    uint64_t service_max_us;
+    uint64_t service_last_us;
+} pipeline_stage;
+
+static pipeline_stage stages[PIPELINE_MAX_STAGES];
+static int stage_count = 0;
+
+static void pipeline_command(const char* args, FILE* out);
+
+int pipeline_queue_init(pipeline_queue* queue, size_t item_size,
+        unsigned capacity) {
+    unsigned size = 1;
+    while (size < capacity)
+        size <<= 1;
+    memset(queue, 0, sizeof(*queue));
+    queue->items = calloc(size, item_size);
+    if (queue->items == NULL)
+        return -1;
+    queue->item_size = item_size;
+    queue->mask = size - 1;
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->event_fd < 0) {
+        printf("unable to create pipeline eventfd: %s\n", strerror(errno));
+        free(queue->items);
+        queue->items = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int pipeline_push(pipeline_queue* queue, const void* item) {
+    unsigned tail = queue->tail;
+    unsigned head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail - head > queue->mask)
+        return -1;
+    memcpy(queue->items + (tail & queue->mask) * queue->item_size, item,
+            queue->item_size);
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(queue->event_fd, &one, sizeof(one)) < 0) {
+        // the counter is already non-zero, the consumer will wake anyway
+    }
+    return 0;
+}
+
+int pipeline_pop(pipeline_queue* queue, void* item) {
+    unsigned head = queue->head;
+    unsigned tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return -1;
+    memcpy(item, queue->items + (head & queue->mask) * queue->item_size,
+            queue->item_size);
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void pipeline_done(pipeline_queue* queue) {
+    __atomic_add_fetch(&queue->done, 1, __ATOMIC_RELEASE);
+}
+
+unsigned long pipeline_pending(pipeline_queue* queue) {
+    unsigned long done = __atomic_load_n(&queue->done, __ATOMIC_ACQUIRE);
+    unsigned tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    return (unsigned) (tail - (unsigned) done);
+}
+
+void pipeline_wait(pipeline_queue* queue, int timeout_ms) {
+    struct pollfd pfd = { queue->event_fd, POLLIN, 0 };
+    if (timeout_ms != 0 && poll(&pfd, 1, timeout_ms) <= 0)
+        return;
+    uint64_t count;
+    if (read(queue->event_fd, &count, sizeof(count)) < 0) {
+        // nothing pushed since the last reset
+    }
+}
+
+int pipeline_fd(pipeline_queue* queue) {
+    return queue->event_fd;
+}
+
+int pipeline_stage_add(const char* name) {
+    if (stage_count >= PIPELINE_MAX_STAGES)
+        return -1;
+    pipeline_stage* s = &stages[stage_count];
+    memset(s, 0, sizeof(*s));
+    s->name = name;
+    pthread_mutex_init(&s->lock, NULL);
+    return stage_count++;
+}
+
+void pipeline_stage_record(int id, uint64_t wait_us, uint64_t service_us) {
+    if (id < 0 || id >= stage_count)
+        return;
+    pipeline_stage* s = &stages[id];
+    pthread_mutex_lock(&s->lock);
+    s->items++;
+    s->wait_total_us += wait_us;
+    if (wait_us > s->wait_max_us)
+        s->wait_max_us = wait_us;
+    s->service_total_us += service_us;
+    if (service_us > s->service_max_us)
+        s->service_max_us = service_us;
+    s->service_last_us = service_us;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void pipeline_stage_drop(int id) {
+    if (id < 0 || id >= stage_count)
+        return;
+    pthread_mutex_lock(&stages[id].lock);
+    stages[id].dropped++;
+    pthread_mutex_unlock(&stages[id].lock);
+}
+
+void pipeline_register(void) {
+    ctl_register("pipeline", "per-stage queue wait and handling latency",
+            &pipeline_command);
+}
+
+static void pipeline_command(const char* args, FILE* out) {
+    for (int i = 0; i < stage_count; i++) {
+        pipeline_stage* s = &stages[i];
+        pthread_mutex_lock(&s->lock);
+        unsigned long items = s->items > 0 ? s->items : 1;
+        fprintf(out, "%s items %lu dropped %lu wait_avg_us %llu wait_max_us %llu "
+                "service_avg_us %llu service_max_us %llu service_last_us %llu\n",
+                s->name, s->items, s->dropped,
+                (unsigned long long) (s->wait_total_us / items),
+                (unsigned long long) s->wait_max_us,
+                (unsigned long long) (s->service_total_us / items),
+                (unsigned long long) s->service_max_us,
+                (unsigned long long) s->service_last_us);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
@@ -0,0 +1,68 @@
+/*
+ ============================================================================
+ Name        : pipeline.h
+ Description : Lock-free SPSC queues and stage statistics of the auto mode
+ ============================================================================
+
+ Auto mode runs as three stages on their own threads: acquisition collects
+ a frame of the freshest source values every tick, control turns a frame
+ into fan duties, and actuation writes them to the EC and verifies them.
+ Each pair of stages is connected by a single-producer single-consumer ring
+ whose head and tail are only ever written by one side, so neither side
+ takes a lock. An eventfd wakes the consumer; it can be polled together with
+ other descriptors.
+
+ Every stage records how long items waited in its input queue and how long
+ it took to handle them; the "pipeline" socket command shows both.
+ */
+
+#ifndef CLEVO_PIPELINE_H
+#define CLEVO_PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PIPELINE_MAX_STAGES 4
+
+typedef struct {
+    unsigned char* items;
+    size_t item_size;
+    unsigned mask;              /* capacity - 1, capacity is a power of two */
+    unsigned head;              /* next slot to pop, written by the consumer */
+    unsigned tail;              /* next slot to push, written by the producer */
+    unsigned long done;         /* items the consumer has finished with */
+    int event_fd;
+} pipeline_queue;
+
+/* Capacity is rounded up to a power of two. Returns 0 or -1. */
+int pipeline_queue_init(pipeline_queue* queue, size_t item_size,
+        unsigned capacity);
+
+/* Producer side. Returns -1 when the queue is full. */
+int pipeline_push(pipeline_queue* queue, const void* item);
+
+/* Consumer side. Returns -1 when the queue is empty. */
+int pipeline_pop(pipeline_queue* queue, void* item);
+
+/* Consumer side: mark a popped item as handled. */
+void pipeline_done(pipeline_queue* queue);
+
+/* Items pushed but not yet marked done, safe from either side. */
+unsigned long pipeline_pending(pipeline_queue* queue);
+
+/* Consumer side: block up to timeout_ms (-1 forever) for a push and reset
+ * the wakeup. Pop after it returns; it may return without a new item. */
+void pipeline_wait(pipeline_queue* queue, int timeout_ms);
+
+/* Descriptor that becomes readable on a push, for poll()/select(). */
+int pipeline_fd(pipeline_queue* queue);
+
+/* Stage statistics. pipeline_stage_add() before the stages start. */
+int pipeline_stage_add(const char* name);
+void pipeline_stage_record(int id, uint64_t wait_us, uint64_t service_us);
+void pipeline_stage_drop(int id);
+
+/* Register the "pipeline" socket command. */
+void pipeline_register(void);
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ ============================================================================
+ Name        : power.c
+ Description : AC/battery control profiles switched by power_supply uevents
+ ============================================================================
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <linux/netlink.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "power.h"
+#include "util.h"
+
+static struct {
+    int fd;
+    power_source source;
+    unsigned long events;       /* power_supply uevents received */
+    unsigned long switches;
+    uint64_t switched_us;
+} power = { -1, POWER_AC };
+
+static const char* source_names[POWER_SOURCES] = { "ac", "battery" };
+
+static power_source power_read(void);
+static int power_is_supply_event(const char* buffer, ssize_t len);
+static void power_command(const char* args, FILE* out);
+
+int power_init(void) {
+    power.source = power_read();
+    power.switched_us = util_now_us();
+    power.fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            NETLINK_KOBJECT_UEVENT);
+    if (power.fd < 0) {
+        printf("unable to open uevent socket: %s\n", strerror(errno));
+        return -1;
+    }
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;     // kernel events, not the udev rebroadcast
+    if (bind(power.fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        printf("unable to bind uevent socket: %s\n", strerror(errno));
+        close(power.fd);
+        power.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void power_close(void) {
+    if (power.fd >= 0)
+        close(power.fd);
+    power.fd = -1;
+}
+
+int power_update(void) {
+    if (power.fd < 0)
+        return 0;
+    int supply_event = 0;
+    static char buffer[POWER_UEVENT_MAX];
+    for (;;) {
+        struct sockaddr_nl from;
+        struct iovec iov = { buffer, sizeof(buffer) - 1 };
+        struct msghdr msg = { &from, sizeof(from), &iov, 1, NULL, 0, 0 };
+        ssize_t len = recvmsg(power.fd, &msg, 0);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS) {
+                // events were lost, the supply files tell the truth
+                supply_event = 1;
+                continue;
+            }
+            break;
+        }
+        // only the kernel (port 0) speaks on this group
+        if (from.nl_pid != 0)
+            continue;
+        buffer[len] = '\0';
+        if (power_is_supply_event(buffer, len)) {
+            power.events++;
+            supply_event = 1;
+        }
+    }
+    if (!supply_event)
+        return 0;
+    power_source source = power_read();
+    if (source == power.source)
+        return 0;
+    power.source = source;
+    power.switches++;
+    power.switched_us = util_now_us();
+    return 1;
+}
+
+power_source power_get(void) {
+    return power.source;
+}
+
+const char* power_name(power_source source) {
+    return source >= 0 && source < POWER_SOURCES ? source_names[source] : "unknown";
+}
+
+void power_register(void) {
+    ctl_register("power", "AC or battery, with uevents and profile switches",
+            &power_command);
+}
+
+static power_source power_read(void) {
+    char path[256];
+    if (util_path(path, sizeof(path), "/sys/class/power_supply") < 0)
+        return POWER_AC;
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return POWER_AC;
+    int chargers = 0, online = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        char type[32];
+        long value;
+        if (util_path(path, sizeof(path), "/sys/class/power_supply/%s/type",
+                entry->d_name) < 0 || util_read_line(path, type, sizeof(type)) != 0)
+            continue;
+        if (strcmp(type, "Mains") != 0 && strncmp(type, "USB", 3) != 0)
+            continue;
+        chargers++;
+        if (util_path(path, sizeof(path), "/sys/class/power_supply/%s/online",
+                entry->d_name) >= 0 && util_read_long(path, &value) == 0 && value > 0)
+            online++;
+    }
+    closedir(dir);
+    return chargers == 0 || online > 0 ? POWER_AC : POWER_BATTERY;
+}
+
+/* A kernel uevent is "action@devpath" followed by NUL separated KEY=value
+ * pairs. */
+static int power_is_supply_event(const char* buffer, ssize_t len) {
+    for (ssize_t i = 0; i < len; i += strnlen(buffer + i, len - i) + 1) {
+        if (strcmp(buffer + i, "SUBSYSTEM=power_supply") == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void power_command(const char* args, FILE* out) {
+    fprintf(out, "source %s\n", power_name(power.source));
+    fprintf(out, "uevents %s\n", power.fd >= 0 ? "on" : "off");
+    fprintf(out, "events %lu\n", power.events);
+    fprintf(out, "switches %lu\n", power.switches);
+    fprintf(out, "since_s %llu\n",
+            (unsigned long long) (util_now_us() - power.switched_us) / 1000000);
+}
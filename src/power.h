@@ -0,0 +1,52 @@
+/*
+ ============================================================================
+ Name        : power.h
+ Description : AC/battery control profiles switched by power_supply uevents
+ ============================================================================
+
+ The kernel announces every power_supply change (charger plugged in or out,
+ battery level steps) as a uevent on the NETLINK_KOBJECT_UEVENT socket. The
+ control loop drains that socket without blocking once per tick; when a
+ power_supply event came in, the "online" files of the Mains and USB
+ supplies under /sys/class/power_supply are read again to tell AC from
+ battery. Nothing is polled in between, so a switch takes effect on the
+ tick after the event. A machine without any such supply counts as on AC.
+
+ Each power source has its own power_profile: a duty offset added to the
+ curves while the fans are running (more airflow for sustained clocks on
+ AC, less noise and power on battery) and the EC sampling period.
+ */
+
+#ifndef CLEVO_POWER_H
+#define CLEVO_POWER_H
+
+typedef enum {
+    POWER_AC = 0, POWER_BATTERY, POWER_SOURCES
+} power_source;
+
+typedef struct {
+    int offset;         /* duty % added to a running fan's curve duty */
+    int sample_ms;      /* EC sampling period */
+} power_profile;
+
+#define POWER_DEFAULT_AC { 5, 500 }
+#define POWER_DEFAULT_BATTERY { -10, 1500 }
+
+#define POWER_UEVENT_MAX 8192
+
+/* Open the uevent socket and read the current power source. Returns 0 when
+ * uevents can be received; the source is still known otherwise, just never
+ * updated. */
+int power_init(void);
+void power_close(void);
+
+/* Handle pending uevents. Returns 1 when the power source changed. */
+int power_update(void);
+
+power_source power_get(void);
+const char* power_name(power_source source);
+
+/* Register the "power" socket command. */
+void power_register(void);
+
+#endif
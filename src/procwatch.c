@@ -0,0 +1,266 @@
+/*
+ ============================================================================
+ Name        : procwatch.c
+ Description : Pre-emptive fan ramp when heavy workloads start
+ ============================================================================
+ */
+
+#include <errno.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "procwatch.h"
+#include "util.h"
+
+typedef struct {
+    char name[PROCWATCH_NAME_MAX];
+    unsigned char len;
+    unsigned char prefix;
+    unsigned char used;
+} procwatch_slot;
+
+static struct {
+    pthread_mutex_t lock;
+    procwatch_slot slots[PROCWATCH_SLOTS];
+    uint32_t prefix_lengths;    /* bit n: some prefix pattern is n long */
+    int count;
+    procwatch_config config;
+    int started;                /* 1 running, -1 failed to subscribe */
+    uint64_t boost_until_us;
+    char last[PROCWATCH_NAME_MAX];
+    int last_pid;
+    unsigned long execs;
+    unsigned long matches;
+    unsigned long lost;
+    unsigned long unreadable;   /* gone before its name could be read */
+    uint64_t match_ns;
+} watch = { PTHREAD_MUTEX_INITIALIZER };
+
+static uint32_t procwatch_hash(const char* name, int len);
+static procwatch_slot* procwatch_find(const char* name, int len, int prefix);
+static void procwatch_add(const char* pattern);
+static int procwatch_match(const char* name);
+static int procwatch_subscribe(void);
+static void* procwatch_thread(void* arg);
+static void procwatch_exec(int pid);
+static void procwatch_command(const char* args, FILE* out);
+
+void procwatch_configure(const procwatch_config* config) {
+    pthread_mutex_lock(&watch.lock);
+    if (strcmp(config->patterns, watch.config.patterns) != 0) {
+        memset(watch.slots, 0, sizeof(watch.slots));
+        watch.prefix_lengths = 0;
+        watch.count = 0;
+        char patterns[sizeof(config->patterns)];
+        snprintf(patterns, sizeof(patterns), "%s", config->patterns);
+        char* save;
+        for (char* p = strtok_r(patterns, " \t\r\n", &save); p != NULL;
+                p = strtok_r(NULL, " \t\r\n", &save))
+            procwatch_add(p);
+    }
+    watch.config = *config;
+    int start = watch.count > 0 && watch.started == 0;
+    pthread_mutex_unlock(&watch.lock);
+    if (!start)
+        return;
+    pthread_t thread;
+    int fd = procwatch_subscribe();
+    if (fd < 0 || pthread_create(&thread, NULL, &procwatch_thread, (void*) (intptr_t) fd) != 0) {
+        if (fd >= 0)
+            close(fd);
+        watch.started = -1;
+        return;
+    }
+    pthread_detach(thread);
+    watch.started = 1;
+}
+
+int procwatch_duty(void) {
+    pthread_mutex_lock(&watch.lock);
+    int duty = util_now_us() < watch.boost_until_us ? watch.config.duty : 0;
+    pthread_mutex_unlock(&watch.lock);
+    return duty;
+}
+
+void procwatch_register(void) {
+    ctl_register("procwatch", "heavy workload patterns, exec events and matches",
+            &procwatch_command);
+}
+
+/* FNV-1a */
+static uint32_t procwatch_hash(const char* name, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* The slot holding the pattern, or the free slot where it belongs. */
+static procwatch_slot* procwatch_find(const char* name, int len, int prefix) {
+    uint32_t i = procwatch_hash(name, len);
+    for (;; i++) {
+        procwatch_slot* slot = &watch.slots[i & (PROCWATCH_SLOTS - 1)];
+        if (!slot->used || (slot->len == len && slot->prefix == prefix
+                && memcmp(slot->name, name, len) == 0))
+            return slot;
+    }
+}
+
+static void procwatch_add(const char* pattern) {
+    int len = strlen(pattern);
+    int prefix = len > 0 && pattern[len - 1] == '*';
+    if (prefix)
+        len--;
+    if (len == 0 || len >= PROCWATCH_NAME_MAX || watch.count >= PROCWATCH_MAX_PATTERNS) {
+        printf("Ignoring heavy workload pattern %s\n", pattern);
+        return;
+    }
+    procwatch_slot* slot = procwatch_find(pattern, len, prefix);
+    if (slot->used)
+        return;
+    memcpy(slot->name, pattern, len);
+    slot->len = len;
+    slot->prefix = prefix;
+    slot->used = 1;
+    watch.count++;
+    if (prefix)
+        watch.prefix_lengths |= 1u << len;
+}
+
+/* Called with the lock held. */
+static int procwatch_match(const char* name) {
+    int len = strnlen(name, PROCWATCH_NAME_MAX - 1);
+    if (procwatch_find(name, len, 0)->used)
+        return 1;
+    for (uint32_t lengths = watch.prefix_lengths; lengths != 0; lengths &= lengths - 1) {
+        int n = __builtin_ctz(lengths);
+        if (n > len)
+            break;
+        if (procwatch_find(name, n, 1)->used)
+            return 1;
+    }
+    return 0;
+}
+
+static int procwatch_subscribe(void) {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (fd < 0) {
+        printf("unable to open proc connector: %s\n", strerror(errno));
+        return -1;
+    }
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        printf("unable to bind proc connector: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    struct {
+        struct nlmsghdr header;
+        struct cn_msg msg;
+        enum proc_cn_mcast_op op;
+    } __attribute__((packed)) request;
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = NLMSG_DONE;
+    request.msg.id.idx = CN_IDX_PROC;
+    request.msg.id.val = CN_VAL_PROC;
+    request.msg.len = sizeof(request.op);
+    request.op = PROC_CN_MCAST_LISTEN;
+    if (send(fd, &request, sizeof(request), 0) < 0) {
+        printf("unable to subscribe to exec events: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void* procwatch_thread(void* arg) {
+    int fd = (int) (intptr_t) arg;
+    char buffer[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+    for (;;) {
+        ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+        if (len < 0) {
+            if (errno == ENOBUFS) {
+                // a storm outran us; the next matching exec ramps anyway
+                pthread_mutex_lock(&watch.lock);
+                watch.lost++;
+                pthread_mutex_unlock(&watch.lock);
+            } else if (errno != EINTR) {
+                printf("proc connector: %s\n", strerror(errno));
+                break;
+            }
+            continue;
+        }
+        for (struct nlmsghdr* header = (struct nlmsghdr*) buffer; NLMSG_OK(header, len);
+                header = NLMSG_NEXT(header, len)) {
+            struct cn_msg* msg = NLMSG_DATA(header);
+            if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC)
+                continue;
+            struct proc_event* event = (struct proc_event*) msg->data;
+            if (event->what == PROC_EVENT_EXEC)
+                procwatch_exec(event->event_data.exec.process_tgid);
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static void procwatch_exec(int pid) {
+    char path[64], name[PROCWATCH_NAME_MAX];
+    int found = util_path(path, sizeof(path), "/proc/%d/comm", pid) >= 0
+            && util_read_line(path, name, sizeof(name)) == 0;
+    pthread_mutex_lock(&watch.lock);
+    watch.execs++;
+    if (!found) {
+        watch.unreadable++;
+        pthread_mutex_unlock(&watch.lock);
+        return;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int match = procwatch_match(name);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    watch.match_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec;
+    if (match) {
+        uint64_t now = util_now_us();
+        if (now >= watch.boost_until_us)
+            printf("Heavy workload %s (%d) started, fans to at least %d%%\n", name, pid,
+                    watch.config.duty);
+        watch.boost_until_us = now + watch.config.hold_s * 1000000ULL;
+        watch.matches++;
+        memcpy(watch.last, name, sizeof(name));
+        watch.last_pid = pid;
+    }
+    pthread_mutex_unlock(&watch.lock);
+}
+
+static void procwatch_command(const char* args, FILE* out) {
+    pthread_mutex_lock(&watch.lock);
+    uint64_t now = util_now_us();
+    fprintf(out, "patterns %s\n", watch.config.patterns);
+    fprintf(out, "subscribed %s\n", watch.started == 1 ? "yes" : watch.started < 0 ? "failed" : "no");
+    fprintf(out, "execs %lu matches %lu lost_batches %lu unreadable %lu match_avg_ns %llu\n",
+            watch.execs, watch.matches, watch.lost, watch.unreadable,
+            (unsigned long long) (watch.execs > watch.unreadable ?
+                    watch.match_ns / (watch.execs - watch.unreadable) : 0));
+    if (watch.matches > 0)
+        fprintf(out, "last %s %d\n", watch.last, watch.last_pid);
+    fprintf(out, "boost_duty %d remaining_s %llu\n",
+            now < watch.boost_until_us ? watch.config.duty : 0,
+            (unsigned long long) (now < watch.boost_until_us ? (watch.boost_until_us - now) / 1000000 : 0));
+    pthread_mutex_unlock(&watch.lock);
+}
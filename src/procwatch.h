@@ -0,0 +1,48 @@
+/*
+ ============================================================================
+ Name        : procwatch.h
+ Description : Pre-emptive fan ramp when heavy workloads start
+ ============================================================================
+
+ A compiler, renderer or test runner heats the CPU within seconds, and by
+ the time the temperature shows it the fans are already behind. The netlink
+ proc connector reports every exec() as it happens; a thread reads those
+ events, looks up the new process's name (/proc/<pid>/comm) in the list of
+ heavy workloads and, on a match, asks the control loop for at least
+ procwatch duty on both fans for the next hold seconds.
+
+ Patterns are process names, or name prefixes ending in '*' ("cc1*" covers
+ cc1 and cc1plus). They are kept in an open-addressing hash table: an exact
+ name is one probe, and prefixes are one probe per distinct prefix length,
+ so an event costs a hash of at most 15 bytes a few times, whatever the
+ number of patterns. During a "make -j64" storm the /proc read dominates
+ by far; the "procwatch" socket command shows events, matches and the
+ average matching time.
+ */
+
+#ifndef CLEVO_PROCWATCH_H
+#define CLEVO_PROCWATCH_H
+
+#define PROCWATCH_MAX_PATTERNS 64
+#define PROCWATCH_SLOTS 256         /* power of two, 4x the patterns */
+#define PROCWATCH_NAME_MAX 16       /* TASK_COMM_LEN */
+
+typedef struct {
+    char patterns[512];     /* names separated by spaces */
+    int duty;               /* fan floor while a workload is fresh */
+    int hold_s;
+} procwatch_config;
+
+#define PROCWATCH_DEFAULT_CONFIG { "", 60, 10 }
+
+/* Apply a new configuration. The proc connector is subscribed to when the
+ * first patterns are configured. */
+void procwatch_configure(const procwatch_config* config);
+
+/* Fan floor requested by a recently started heavy workload, 0 for none. */
+int procwatch_duty(void);
+
+/* Register the "procwatch" socket command. */
+void procwatch_register(void);
+
+#endif
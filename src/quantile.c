@@ -0,0 +1,121 @@
+/*
+ ============================================================================
+ Name        : quantile.c
+ Description : Streaming quantile sketches over rolling windows
+ ============================================================================
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ctl.h"
+#include "quantile.h"
+#include "util.h"
+
+#define QUANTILE_WINDOWS 2
+
+typedef struct {
+    uint32_t counts[QUANTILE_SLICES][QUANTILE_BUCKETS];
+    uint32_t totals[QUANTILE_SLICES];
+    int slice;              /* the one being filled */
+    uint64_t slice_start_us;
+} quantile_window;
+
+static const uint64_t window_us[QUANTILE_WINDOWS] = { 60000000ULL, 3600000000ULL };
+static const char* window_names[QUANTILE_WINDOWS] = { "1m", "1h" };
+static const char* series_names[QUANTILE_SERIES] = { "cpu_temp", "gpu_temp", "cpu_duty",
+        "gpu_duty", "loop_jitter_us", "ec_latency_us" };
+
+static pthread_mutex_t quantile_lock = PTHREAD_MUTEX_INITIALIZER;
+static quantile_window windows[QUANTILE_SERIES][QUANTILE_WINDOWS];
+
+static void quantile_roll(quantile_window* w, uint64_t slice_us, uint64_t now);
+static int quantile_bucket(double value);
+static double quantile_value(int bucket);
+static void quantile_command(const char* args, FILE* out);
+
+void quantile_add(quantile_series series, double value) {
+    if (series < 0 || series >= QUANTILE_SERIES || isnan(value))
+        return;
+    int bucket = quantile_bucket(value);
+    uint64_t now = util_now_us();
+    pthread_mutex_lock(&quantile_lock);
+    for (int i = 0; i < QUANTILE_WINDOWS; i++) {
+        quantile_window* w = &windows[series][i];
+        quantile_roll(w, window_us[i] / QUANTILE_SLICES, now);
+        w->counts[w->slice][bucket]++;
+        w->totals[w->slice]++;
+    }
+    pthread_mutex_unlock(&quantile_lock);
+}
+
+void quantile_register(void) {
+    ctl_register("stats", "p50/p95/p99 of temperatures, duties, tick jitter and EC latency over 1m and 1h",
+            &quantile_command);
+}
+
+/* Move on to the slice now falls in, clearing the ones it passes. */
+static void quantile_roll(quantile_window* w, uint64_t slice_us, uint64_t now) {
+    if (w->slice_start_us == 0 || now - w->slice_start_us >= slice_us * QUANTILE_SLICES) {
+        // first use, or idle for a whole window
+        memset(w, 0, sizeof(*w));
+        w->slice_start_us = now;
+        return;
+    }
+    while (now - w->slice_start_us >= slice_us) {
+        w->slice = (w->slice + 1) % QUANTILE_SLICES;
+        memset(w->counts[w->slice], 0, sizeof(w->counts[w->slice]));
+        w->totals[w->slice] = 0;
+        w->slice_start_us += slice_us;
+    }
+}
+
+static int quantile_bucket(double value) {
+    if (!(value >= 1))
+        return 0;
+    int k = (int) ceil(log(value) / log(QUANTILE_GAMMA));
+    return k + 1 < QUANTILE_BUCKETS ? k + 1 : QUANTILE_BUCKETS - 1;
+}
+
+/* The middle of a bucket in relative terms: within 1% of all it holds. */
+static double quantile_value(int bucket) {
+    if (bucket == 0)
+        return 0;
+    return 2 * pow(QUANTILE_GAMMA, bucket - 1) / (QUANTILE_GAMMA + 1);
+}
+
+static void quantile_command(const char* args, FILE* out) {
+    static const int percentiles[] = { 50, 95, 99 };
+    uint64_t now = util_now_us();
+    pthread_mutex_lock(&quantile_lock);
+    for (int s = 0; s < QUANTILE_SERIES; s++) {
+        for (int i = 0; i < QUANTILE_WINDOWS; i++) {
+            quantile_window* w = &windows[s][i];
+            if (w->slice_start_us == 0)
+                continue;
+            quantile_roll(w, window_us[i] / QUANTILE_SLICES, now);
+            unsigned long total = 0;
+            for (int j = 0; j < QUANTILE_SLICES; j++)
+                total += w->totals[j];
+            fprintf(out, "%s %s count %lu", series_names[s], window_names[i], total);
+            // one pass over the merged buckets finds all three ranks
+            int p = 0, bucket = 0;
+            unsigned long seen = 0;
+            while (total > 0 && p < 3) {
+                unsigned long rank = (total * percentiles[p] + 99) / 100;
+                while (seen < rank && bucket < QUANTILE_BUCKETS) {
+                    for (int j = 0; j < QUANTILE_SLICES; j++)
+                        seen += w->counts[j][bucket];
+                    bucket++;
+                }
+                fprintf(out, " p%d %.1f", percentiles[p], quantile_value(bucket - 1));
+                p++;
+            }
+            fprintf(out, "\n");
+        }
+    }
+    pthread_mutex_unlock(&quantile_lock);
+}
@@ -0,0 +1,40 @@
+/*
+ ============================================================================
+ Name        : quantile.h
+ Description : Streaming quantile sketches over rolling windows
+ ============================================================================
+
+ p50/p95/p99 of the temperatures, the fan duties, the control tick's
+ wake-up jitter and the EC transaction latency, over the last minute and
+ the last hour, without keeping the samples. Each value lands in a
+ logarithmic bucket, bucket k holding (g^(k-1), g^k] with g = 1.0202, so
+ any quantile read back from the bucket counts is within 1% of a value
+ that was seen (the DDSketch construction); values below 1 count as 0.
+ QUANTILE_BUCKETS covers everything up to ~7e8, microseconds included.
+
+ A window is QUANTILE_SLICES slices of counts, the oldest cleared as a new
+ one starts, so a "1 hour" window holds between 50 and 60 minutes of data
+ and the memory is fixed however long the daemon runs. Adding a value is a
+ log() and an increment; the "stats" socket command merges the slices.
+ */
+
+#ifndef CLEVO_QUANTILE_H
+#define CLEVO_QUANTILE_H
+
+#define QUANTILE_BUCKETS 1024
+#define QUANTILE_SLICES 6
+#define QUANTILE_GAMMA 1.0202       /* (1 + 1%) / (1 - 1%) */
+
+/* The first four in history_column order. */
+typedef enum {
+    QUANTILE_CPU_TEMP = 0, QUANTILE_GPU_TEMP, QUANTILE_CPU_DUTY, QUANTILE_GPU_DUTY,
+    QUANTILE_LOOP_JITTER, QUANTILE_EC_LATENCY, QUANTILE_SERIES
+} quantile_series;
+
+/* Add a value (°C, % or µs) to both windows of a series. Thread safe. */
+void quantile_add(quantile_series series, double value);
+
+/* Register the "stats" socket command. */
+void quantile_register(void);
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ ============================================================================
+ Name        : residency.c
+ Description : Time-in-state histograms of temperatures and fan duties
+ ============================================================================
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ctl.h"
+#include "history.h"
+#include "residency.h"
+#include "util.h"
+
+static const char* series_names[HISTORY_COLUMNS] = { "cpu_temp", "gpu_temp", "cpu_duty", "gpu_duty" };
+
+static struct {
+    uint64_t temp_us[2][RESIDENCY_TEMP_BINS];
+    uint64_t duty_us[2][RESIDENCY_DUTY_BINS];
+    int bins[HISTORY_COLUMNS];      /* of the previous sample, -1 for none */
+    uint64_t last_us;               /* 0 before the first sample */
+    uint64_t since_us;
+    uint64_t gaps;
+} residency = { .bins = { -1, -1, -1, -1 } };
+
+/* Updates come from the control thread, the command from the socket's. */
+static pthread_mutex_t residency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int residency_bin(int column, double value);
+static uint64_t* residency_bins(int column, int* count);
+static void residency_command(const char* args, FILE* out);
+
+void residency_update(const double* values) {
+    pthread_mutex_lock(&residency_lock);
+    uint64_t now = util_now_us();
+    if (residency.since_us == 0)
+        residency.since_us = now;
+    if (residency.last_us != 0) {
+        uint64_t elapsed = now - residency.last_us;
+        if (elapsed <= RESIDENCY_MAX_GAP_MS * 1000ULL) {
+            for (int c = 0; c < HISTORY_COLUMNS; c++) {
+                int count;
+                if (residency.bins[c] >= 0)
+                    residency_bins(c, &count)[residency.bins[c]] += elapsed;
+            }
+        } else {
+            residency.gaps++;
+        }
+    }
+    residency.last_us = now;
+    for (int c = 0; c < HISTORY_COLUMNS; c++)
+        residency.bins[c] = residency_bin(c, values[c]);
+    pthread_mutex_unlock(&residency_lock);
+}
+
+void residency_register(void) {
+    ctl_register("residency", "time per temperature degree and duty step, 'reset' clears",
+            &residency_command);
+}
+
+static int residency_bin(int column, double value) {
+    if (isnan(value) || value < 0)
+        return -1;
+    int count;
+    residency_bins(column, &count);
+    int bin = column == HISTORY_CPU_DUTY || column == HISTORY_GPU_DUTY ?
+            (int) value / RESIDENCY_DUTY_STEP : (int) value;
+    return bin < count ? bin : count - 1;
+}
+
+static uint64_t* residency_bins(int column, int* count) {
+    switch (column) {
+    case HISTORY_CPU_TEMP:
+    case HISTORY_GPU_TEMP:
+        *count = RESIDENCY_TEMP_BINS;
+        return residency.temp_us[column - HISTORY_CPU_TEMP];
+    default:
+        *count = RESIDENCY_DUTY_BINS;
+        return residency.duty_us[column - HISTORY_CPU_DUTY];
+    }
+}
+
+static void residency_command(const char* args, FILE* out) {
+    if (strncmp(args, "reset", 5) == 0 && !ctl_privileged(out))
+        return;
+    pthread_mutex_lock(&residency_lock);
+    uint64_t now = util_now_us();
+    if (strncmp(args, "reset", 5) == 0) {
+        // the current state keeps counting from now
+        memset(residency.temp_us, 0, sizeof(residency.temp_us));
+        memset(residency.duty_us, 0, sizeof(residency.duty_us));
+        residency.since_us = now;
+        residency.gaps = 0;
+        if (residency.last_us != 0)
+            residency.last_us = now;
+        pthread_mutex_unlock(&residency_lock);
+        fprintf(out, "reset\n");
+        return;
+    }
+    fprintf(out, "since_s %.1f gaps %llu\n",
+            residency.since_us ? (now - residency.since_us) / 1e6 : 0.0,
+            (unsigned long long) residency.gaps);
+    for (int c = 0; c < HISTORY_COLUMNS; c++) {
+        int count;
+        const uint64_t* bins = residency_bins(c, &count);
+        int step = c == HISTORY_CPU_DUTY || c == HISTORY_GPU_DUTY ? RESIDENCY_DUTY_STEP : 1;
+        // from the top down, so each line can carry the time at or above it
+        uint64_t above = 0;
+        for (int b = count - 1; b >= 0; b--) {
+            above += bins[b];
+            if (bins[b] > 0)
+                fprintf(out, "%s %d%s s %.1f at_or_above_s %.1f\n", series_names[c], b * step,
+                        b == count - 1 && step == 1 ? "+" : "", bins[b] / 1e6, above / 1e6);
+        }
+    }
+    pthread_mutex_unlock(&residency_lock);
+}
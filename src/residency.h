@@ -0,0 +1,35 @@
+/*
+ ============================================================================
+ Name        : residency.h
+ Description : Time-in-state histograms of temperatures and fan duties
+ ============================================================================
+
+ How long each temperature and each duty lasted: per degree for the CPU
+ and GPU temperatures, per 5% step for the fan duties. Every control tick
+ credits the time since the previous tick to the bins the previous sample
+ fell in, which is a handful of additions whatever the run length. The
+ clock is CLOCK_MONOTONIC, so a suspend counts for nothing, and gaps longer
+ than RESIDENCY_MAX_GAP_MS (a stalled loop) are left out rather than
+ credited to a stale state.
+
+ "clevo-indicator query residency" lists the time per bin and the time at
+ or above it ("minutes above 85°C" is one line), "query residency reset"
+ starts over, e.g. after changing a curve.
+ */
+
+#ifndef CLEVO_RESIDENCY_H
+#define CLEVO_RESIDENCY_H
+
+#define RESIDENCY_TEMP_BINS 128     /* 1°C each, the last one open */
+#define RESIDENCY_DUTY_STEP 5
+#define RESIDENCY_DUTY_BINS (100 / RESIDENCY_DUTY_STEP + 1)
+#define RESIDENCY_MAX_GAP_MS 5000
+
+/* Account a tick's sample, indexed by history_column, NaN for a value
+ * that wasn't read. */
+void residency_update(const double* values);
+
+/* Register the "residency" socket command. */
+void residency_register(void);
+
+#endif
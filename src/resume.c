@@ -0,0 +1,43 @@
+/*
+ ============================================================================
+ Name        : resume.c
+ Description : Suspend/resume detection from clock offsets
+ ============================================================================
+ */
+
+#include <time.h>
+
+#include "resume.h"
+#include "util.h"
+
+static uint64_t resume_offset_us = 0;
+static uint64_t resume_checked_us = 0;
+
+static uint64_t resume_offset(void);
+
+void resume_init(void) {
+    resume_offset_us = resume_offset();
+    resume_checked_us = util_now_us();
+}
+
+int resume_check(uint64_t* slept_us, uint64_t* since_us) {
+    uint64_t offset = resume_offset();
+    uint64_t now = util_now_us();
+    uint64_t awake = now - resume_checked_us;
+    resume_checked_us = now;
+    if (offset < resume_offset_us + RESUME_MIN_SLEEP_MS * 1000ULL)
+        return 0;
+    *slept_us = offset - resume_offset_us;
+    *since_us = awake;
+    resume_offset_us = offset;
+    return 1;
+}
+
+/* CLOCK_BOOTTIME - CLOCK_MONOTONIC, the total time spent suspended. */
+static uint64_t resume_offset(void) {
+    struct timespec boot;
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    uint64_t boot_us = (uint64_t) boot.tv_sec * 1000000 + boot.tv_nsec / 1000;
+    uint64_t mono_us = util_now_us();
+    return boot_us > mono_us ? boot_us - mono_us : 0;
+}
@@ -0,0 +1,32 @@
+/*
+ ============================================================================
+ Name        : resume.h
+ Description : Suspend/resume detection from clock offsets
+ ============================================================================
+
+ CLOCK_MONOTONIC stops while the machine is suspended, CLOCK_BOOTTIME keeps
+ counting. Their difference therefore only ever grows across a suspend, by
+ exactly the time spent asleep; comparing it between two calls tells
+ whether the machine slept in between, without D-Bus or root-only
+ interfaces. Short growths below RESUME_MIN_SLEEP_MS are ignored.
+
+ The EC may come back from a suspend with its firmware default duties, so
+ both the auto mode and the indicator worker check this every tick and
+ write their duties again right away.
+ */
+
+#ifndef CLEVO_RESUME_H
+#define CLEVO_RESUME_H
+
+#include <stdint.h>
+
+#define RESUME_MIN_SLEEP_MS 1000
+
+void resume_init(void);
+
+/* Returns 1 when the machine was suspended since the previous call, with
+ * the time asleep and an upper bound on the time since the resume (the
+ * awake time since the previous call). */
+int resume_check(uint64_t* slept_us, uint64_t* since_us);
+
+#endif
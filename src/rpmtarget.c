@@ -0,0 +1,137 @@
+/*
+ ============================================================================
+ Name        : rpmtarget.c
+ Description : Closed-loop fan RPM targeting
+ ============================================================================
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ctl.h"
+#include "fantable.h"
+#include "rpmtarget.h"
+#include "util.h"
+
+static int full_rpm = 0;
+
+static struct {
+    pthread_mutex_t lock;
+    struct {
+        int target_rpm;
+        int duty;
+        int rpm;
+        unsigned long trims;
+        unsigned long settled;
+        uint64_t updated_us;
+    } fans[FANTABLE_FANS];
+} status = { PTHREAD_MUTEX_INITIALIZER };
+
+static double rpmtarget_slope(int fan, int duty);
+static void rpmtarget_command(const char* args, FILE* out);
+
+void rpmtarget_configure(int rpm) {
+    __atomic_store_n(&full_rpm, rpm > 0 ? rpm : 0, __ATOMIC_RELAXED);
+}
+
+int rpmtarget_enabled(void) {
+    return __atomic_load_n(&full_rpm, __ATOMIC_RELAXED) > 0;
+}
+
+int rpmtarget_rpm(int duty_percentage) {
+    return __atomic_load_n(&full_rpm, __ATOMIC_RELAXED) * duty_percentage / 100;
+}
+
+int rpmtarget_seed(int fan, int target_rpm) {
+    if (target_rpm <= 0)
+        return 0;
+    const fantable_fan* f = fantable_get(fan);
+    if (f == NULL || f->count < 2) {
+        int duty = target_rpm * 100 / FANTABLE_DEFAULT_MAX_RPM;
+        return duty > 100 ? 100 : duty;
+    }
+    int duty = 100;
+    for (int i = 1; i < f->count; i++) {
+        const fantable_point* lo = &f->points[i - 1];
+        const fantable_point* hi = &f->points[i];
+        if (hi->rpm >= target_rpm && hi->rpm > lo->rpm) {
+            duty = lo->duty + (hi->duty - lo->duty) * (target_rpm - lo->rpm)
+                    / (hi->rpm - lo->rpm);
+            break;
+        }
+    }
+    // anything below the spin-up duty leaves a stopped fan standing
+    if (f->min_duty > duty)
+        duty = f->min_duty;
+    return duty < 0 ? 0 : duty > 100 ? 100 : duty;
+}
+
+int rpmtarget_trim(int fan, int target_rpm, int duty, int rpm) {
+    int error = target_rpm - rpm;
+    int band = target_rpm * RPMTARGET_TOLERANCE_PCT / 100;
+    if (band < RPMTARGET_TOLERANCE_RPM)
+        band = RPMTARGET_TOLERANCE_RPM;
+    int next = duty;
+    if (abs(error) > band) {
+        int step = (int) (error * rpmtarget_slope(fan, duty));
+        if (step == 0)
+            step = error > 0 ? 1 : -1;
+        if (step > RPMTARGET_MAX_STEP)
+            step = RPMTARGET_MAX_STEP;
+        if (step < -RPMTARGET_MAX_STEP)
+            step = -RPMTARGET_MAX_STEP;
+        next = duty + step;
+        next = next < 0 ? 0 : next > 100 ? 100 : next;
+    }
+    if (fan >= 0 && fan < FANTABLE_FANS) {
+        pthread_mutex_lock(&status.lock);
+        status.fans[fan].target_rpm = target_rpm;
+        status.fans[fan].duty = next;
+        status.fans[fan].rpm = rpm;
+        if (next != duty)
+            status.fans[fan].trims++;
+        else
+            status.fans[fan].settled++;
+        status.fans[fan].updated_us = util_now_us();
+        pthread_mutex_unlock(&status.lock);
+    }
+    return next;
+}
+
+void rpmtarget_register(void) {
+    ctl_register("rpm", "RPM targets, measured RPM and duty trims",
+            &rpmtarget_command);
+}
+
+/* Duty per RPM around duty, from the fan table. */
+static double rpmtarget_slope(int fan, int duty) {
+    const fantable_fan* f = fantable_get(fan);
+    if (f != NULL) {
+        for (int i = 1; i < f->count; i++) {
+            const fantable_point* lo = &f->points[i - 1];
+            const fantable_point* hi = &f->points[i];
+            if (duty <= hi->duty && hi->rpm > lo->rpm)
+                return (double) (hi->duty - lo->duty) / (hi->rpm - lo->rpm);
+        }
+    }
+    return 100.0 / FANTABLE_DEFAULT_MAX_RPM;
+}
+
+static void rpmtarget_command(const char* args, FILE* out) {
+    static const char* names[FANTABLE_FANS] = { "cpu", "gpu" };
+    int full = __atomic_load_n(&full_rpm, __ATOMIC_RELAXED);
+    fprintf(out, "rpm_full %d%s\n", full, full > 0 ? "" : " (off)");
+    uint64_t now = util_now_us();
+    pthread_mutex_lock(&status.lock);
+    for (int i = 0; i < FANTABLE_FANS; i++) {
+        if (status.fans[i].updated_us == 0)
+            continue;
+        fprintf(out, "%s target_rpm %d rpm %d duty %d trims %lu settled %lu age_ms %llu\n",
+                names[i], status.fans[i].target_rpm, status.fans[i].rpm,
+                status.fans[i].duty, status.fans[i].trims, status.fans[i].settled,
+                (unsigned long long) (now - status.fans[i].updated_us) / 1000);
+    }
+    pthread_mutex_unlock(&status.lock);
+}
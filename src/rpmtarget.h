@@ -0,0 +1,44 @@
+/*
+ ============================================================================
+ Name        : rpmtarget.h
+ Description : Closed-loop fan RPM targeting
+ ============================================================================
+
+ The same duty percentage turns different fans at different speeds, and a
+ fan slows down as it ages. With rpm_full set, the duty a curve asks for is
+ read as a share of that RPM instead (60% of 4000 RPM = 2400 RPM), the same
+ on every machine of a fleet. The actuator seeds each new target with the
+ duty the fan table (fantable.h) says reaches it, then trims the duty every
+ RPMTARGET_PERIOD_MS until the measured RPM is within RPMTARGET_TOLERANCE_PCT
+ (at least RPMTARGET_TOLERANCE_RPM) of the target. A trim step follows the
+ local slope of the table, limited to RPMTARGET_MAX_STEP percent; without a
+ table the seed and slope assume a straight line to FANTABLE_DEFAULT_MAX_RPM.
+ */
+
+#ifndef CLEVO_RPMTARGET_H
+#define CLEVO_RPMTARGET_H
+
+#define RPMTARGET_PERIOD_MS 1000
+#define RPMTARGET_TOLERANCE_PCT 3
+#define RPMTARGET_TOLERANCE_RPM 50
+#define RPMTARGET_MAX_STEP 10
+
+/* RPM meant by a curve duty of 100%; 0 turns targeting off. */
+void rpmtarget_configure(int full_rpm);
+int rpmtarget_enabled(void);
+
+/* Target RPM for a curve duty. */
+int rpmtarget_rpm(int duty_percentage);
+
+/* First duty guess for a target, from the fan table. fan 0 is the CPU fan,
+ * 1 the GPU fan. */
+int rpmtarget_seed(int fan, int target_rpm);
+
+/* Next duty after measuring rpm at duty; duty itself when within tolerance.
+ * Records the step for the "rpm" socket command. */
+int rpmtarget_trim(int fan, int target_rpm, int duty, int rpm);
+
+/* Register the "rpm" socket command. */
+void rpmtarget_register(void);
+
+#endif
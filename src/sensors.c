@@ -0,0 +1,161 @@
+/*
+ ============================================================================
+ Name        : sensors.c
+ Description : Extra hwmon temperature inputs with their own fan curves
+ ============================================================================
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ctl.h"
+#include "hwmon.h"
+#include "sensors.h"
+
+#define SENSOR_MAX_CHIPS 8
+
+typedef struct {
+    sensor_config config;
+    const hwmon_chip* chips[SENSOR_MAX_CHIPS];
+    hwmon_channel* channels[SENSOR_MAX_CHIPS];
+    int channel_count;
+    unsigned generation;    /* of the hwmon registry the channels belong to */
+    double temp;        /* hottest matching chip, -1 when unreadable */
+    int duty;
+} sensor;
+
+static sensor sensors[SENSORS_MAX];
+static int sensor_count = 0;
+static pthread_mutex_t sensors_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void sensors_resolve(sensor* s);
+static void sensors_command(const char* args, FILE* out);
+
+int sensor_config_parse(sensor_config* config, const char* text) {
+    char source[2 * SENSOR_NAME_MAX];
+    char fans[8];
+    int consumed;
+    if (sscanf(text, "%63s %7s %n", source, fans, &consumed) != 2)
+        return -1;
+    char* slash = strchr(source, '/');
+    snprintf(config->channel, sizeof(config->channel), "%s",
+            slash != NULL ? slash + 1 : "temp1");
+    if (slash != NULL)
+        *slash = '\0';
+    snprintf(config->chip, sizeof(config->chip), "%.31s", source);
+    if (strcmp(fans, "cpu") == 0)
+        config->fans = SENSOR_FAN_CPU;
+    else if (strcmp(fans, "gpu") == 0)
+        config->fans = SENSOR_FAN_GPU;
+    else if (strcmp(fans, "both") == 0)
+        config->fans = SENSOR_FAN_CPU | SENSOR_FAN_GPU;
+    else if (strcmp(fans, "none") == 0)
+        config->fans = 0;
+    else
+        return -1;
+    // a sensor read only by the fan rules needs no curve
+    if (config->fans == 0 && text[consumed] == '\0') {
+        config->curve.count = 0;
+        return 0;
+    }
+    return curve_parse(&config->curve, text + consumed);
+}
+
+void sensors_configure(const sensor_config* configs, int count) {
+    if (count > SENSORS_MAX)
+        count = SENSORS_MAX;
+    pthread_mutex_lock(&sensors_mutex);
+    for (int i = 0; i < count; i++) {
+        sensor* s = &sensors[i];
+        int changed = i >= sensor_count
+                || strcmp(s->config.chip, configs[i].chip) != 0
+                || strcmp(s->config.channel, configs[i].channel) != 0;
+        s->config = configs[i];
+        if (changed) {
+            s->generation = 0;
+            s->temp = -1;
+            s->duty = 0;
+        }
+    }
+    sensor_count = count;
+    pthread_mutex_unlock(&sensors_mutex);
+}
+
+void sensors_sample(void) {
+    pthread_mutex_lock(&sensors_mutex);
+    // the chip and channel pointers must not change under the reads
+    hwmon_lock();
+    for (int i = 0; i < sensor_count; i++) {
+        sensor* s = &sensors[i];
+        if (s->generation != hwmon_generation())
+            sensors_resolve(s);
+        s->temp = -1;
+        for (int j = 0; j < s->channel_count; j++) {
+            long millidegrees;
+            if (hwmon_read(s->chips[j], s->channels[j], &millidegrees) == 0
+                    && millidegrees / 1000.0 > s->temp)
+                s->temp = millidegrees / 1000.0;
+        }
+        // a sensor that went away shouldn't keep the fans up (or down)
+        s->duty = s->temp >= 0 ? (int) (curve_eval(&s->config.curve, s->temp) + 0.5)
+                : 0;
+    }
+    hwmon_unlock();
+    pthread_mutex_unlock(&sensors_mutex);
+}
+
+int sensors_duty(int fan) {
+    int duty = 0;
+    pthread_mutex_lock(&sensors_mutex);
+    for (int i = 0; i < sensor_count; i++)
+        if ((sensors[i].config.fans & fan) && sensors[i].duty > duty)
+            duty = sensors[i].duty;
+    pthread_mutex_unlock(&sensors_mutex);
+    return duty;
+}
+
+double sensors_temp(int index) {
+    pthread_mutex_lock(&sensors_mutex);
+    double temp = index >= 0 && index < sensor_count ? sensors[index].temp : -1;
+    pthread_mutex_unlock(&sensors_mutex);
+    return temp;
+}
+
+void sensors_register(void) {
+    ctl_register("sensors", "extra sensor temperatures and requested duty",
+            &sensors_command);
+}
+
+static void sensors_resolve(sensor* s) {
+    s->generation = hwmon_generation();
+    s->channel_count = 0;
+    int index;
+    if (sscanf(s->config.channel, "temp%d", &index) != 1)
+        return;
+    const hwmon_chip* chip;
+    for (int nth = 0; s->channel_count < SENSOR_MAX_CHIPS
+            && (chip = hwmon_find_chip(s->config.chip, nth)) != NULL; nth++) {
+        hwmon_channel* channel = hwmon_find_channel(chip, HWMON_TEMP, index);
+        if (channel == NULL)
+            continue;
+        printf("Sensor %s/%s: %s (%s)\n", s->config.chip, s->config.channel,
+                chip->device, channel->label[0] != '\0' ? channel->label : "-");
+        s->chips[s->channel_count] = chip;
+        s->channels[s->channel_count] = channel;
+        s->channel_count++;
+    }
+}
+
+static void sensors_command(const char* args, FILE* out) {
+    pthread_mutex_lock(&sensors_mutex);
+    for (int i = 0; i < sensor_count; i++) {
+        const sensor* s = &sensors[i];
+        fprintf(out, "%s/%s temp %.1f duty %d fans %s%s%s\n", s->config.chip,
+                s->config.channel, s->temp, s->duty,
+                (s->config.fans & SENSOR_FAN_CPU) ? "cpu" : "",
+                (s->config.fans & SENSOR_FAN_GPU) ? "gpu" : "",
+                s->config.fans == 0 ? "none" : "");
+    }
+    pthread_mutex_unlock(&sensors_mutex);
+}
@@ -0,0 +1,55 @@
+/*
+ ============================================================================
+ Name        : sensors.h
+ Description : Extra hwmon temperature inputs with their own fan curves
+ ============================================================================
+
+ The stock loop only looks at the CPU and GPU temperatures, but NVMe drives
+ in these chassis throttle at ~70°C during long builds and never make the
+ fans move. Each configured sensor names an hwmon chip (nvme, acpitz, pch,
+ ...), a temperature channel, the fans it drives and a curve. Every chip
+ whose name starts with the configured one is read, so "nvme" covers all
+ drives; the hottest reading goes through the curve, and each fan runs at
+ the maximum over its own curve and all sensor curves.
+ */
+
+#ifndef CLEVO_SENSORS_H
+#define CLEVO_SENSORS_H
+
+#include "curve.h"
+
+#define SENSORS_MAX 16
+#define SENSOR_NAME_MAX 32
+
+#define SENSOR_FAN_CPU 0x1
+#define SENSOR_FAN_GPU 0x2
+
+typedef struct {
+    char chip[SENSOR_NAME_MAX];     /* hwmon name or its prefix */
+    char channel[SENSOR_NAME_MAX];  /* e.g. "temp1" */
+    int fans;                       /* SENSOR_FAN_* mask */
+    curve curve;
+} sensor_config;
+
+/* Parse "<chip>[/<channel>] <cpu|gpu|both|none> <curve>"; the curve is
+ * optional for "none", a sensor only the fan rules read. */
+int sensor_config_parse(sensor_config* config, const char* text);
+
+/* Replace the sensor set and resolve the hwmon files of each sensor. */
+void sensors_configure(const sensor_config* configs, int count);
+
+/* Read every sensor once for this tick. */
+void sensors_sample(void);
+
+/* Highest duty requested for a fan (SENSOR_FAN_CPU or SENSOR_FAN_GPU) by
+ * the last sample, 0 without sensors. */
+int sensors_duty(int fan);
+
+/* Temperature of the index-th configured sensor by the last sample, -1
+ * when unreadable. */
+double sensors_temp(int index);
+
+/* Register the "sensors" socket command. */
+void sensors_register(void);
+
+#endif
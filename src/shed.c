@@ -0,0 +1,201 @@
+/*
+ ============================================================================
+ Name        : shed.c
+ Description : cgroup v2 based thermal shedding of low-priority workloads
+ ============================================================================
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shed.h"
+#include "util.h"
+
+#define SHED_DEFAULT_PERIOD 100000
+
+typedef struct {
+    char cgroup[SHED_CGROUP_MAX];
+    char path[UTIL_PATH_MAX];
+    char orig[64];
+    long period;
+    long orig_quota;    /* 0 when unlimited ("max") */
+    int floor_pct;
+    int pct;            /* current share, 100 means untouched */
+} shed_target;
+
+static struct {
+    shed_config config;
+    shed_target targets[SHED_MAX_TARGETS];
+    int target_count;
+    double trend;
+    int trend_valid;
+} shed = { SHED_DEFAULT_CONFIG };
+
+static int shed_cgroup_valid(const char* cgroup);
+static int shed_target_open(shed_target* t, const shed_target_config* c);
+static int shed_target_apply(shed_target* t, int pct);
+
+void shed_configure(const shed_config* config) {
+    shed_target next[SHED_MAX_TARGETS];
+    int next_count = 0;
+    for (int i = 0; i < config->target_count; i++) {
+        const shed_target_config* c = &config->targets[i];
+        int found = -1, duplicate = 0;
+        // a cgroup named twice would record the first copy's limit as its original
+        for (int j = 0; j < next_count && !duplicate; j++)
+            duplicate = strcmp(next[j].cgroup, c->cgroup) == 0;
+        if (duplicate)
+            continue;
+        for (int j = 0; j < shed.target_count && found < 0; j++)
+            if (strcmp(shed.targets[j].cgroup, c->cgroup) == 0)
+                found = j;
+        if (found >= 0) {
+            next[next_count] = shed.targets[found];
+            next[next_count].floor_pct = c->floor_pct;
+            shed.targets[found].cgroup[0] = '\0';
+            next_count++;
+        } else if (shed_target_open(&next[next_count], c) == 0) {
+            printf("Thermal shedding: %s (cpu.max %s, floor %d%%)\n",
+                    c->cgroup, next[next_count].orig, c->floor_pct);
+            next_count++;
+        }
+    }
+    // whatever wasn't carried over has been removed from the configuration
+    for (int j = 0; j < shed.target_count; j++)
+        if (shed.targets[j].cgroup[0] != '\0')
+            shed_target_apply(&shed.targets[j], 100);
+    memcpy(shed.targets, next, sizeof(next[0]) * next_count);
+    shed.target_count = next_count;
+    shed.config = *config;
+    if (shed.config.step_pct < 1)
+        shed.config.step_pct = 1;
+    if (shed.config.release_temp > shed.config.trip_temp)
+        shed.config.release_temp = shed.config.trip_temp;
+}
+
+int shed_update(double temp, int fan_duty) {
+    double rise = shed.trend_valid ? temp - shed.trend : 0;
+    shed.trend = shed.trend_valid ? (shed.trend + temp) / 2 : temp;
+    shed.trend_valid = 1;
+
+    const shed_config* c = &shed.config;
+    if (fan_duty >= 100 && temp >= c->trip_temp && rise >= 0.5) {
+        for (int i = 0; i < shed.target_count; i++) {
+            shed_target* t = &shed.targets[i];
+            if (t->pct <= t->floor_pct)
+                continue;
+            int pct = t->pct - c->step_pct;
+            shed_target_apply(t, pct < t->floor_pct ? t->floor_pct : pct);
+            printf("Thermal shedding: %.0f°C, %s limited to %d%%\n", temp,
+                    t->cgroup, t->pct);
+            break;
+        }
+    } else if (temp < c->release_temp || fan_duty < 100) {
+        for (int i = shed.target_count - 1; i >= 0; i--) {
+            shed_target* t = &shed.targets[i];
+            if (t->pct >= 100)
+                continue;
+            int pct = t->pct + c->step_pct;
+            shed_target_apply(t, pct > 100 ? 100 : pct);
+            printf("Thermal shedding: %.0f°C, %s relaxed to %d%%\n", temp,
+                    t->cgroup, t->pct);
+            break;
+        }
+    }
+
+    int limited = 0;
+    for (int i = 0; i < shed.target_count; i++)
+        if (shed.targets[i].pct < 100)
+            limited++;
+    return limited;
+}
+
+void shed_release(void) {
+    for (int i = 0; i < shed.target_count; i++)
+        shed_target_apply(&shed.targets[i], 100);
+}
+
+/* The names come from the control file and cpu.max is written as root, so
+ * a name must stay below the cgroup2 mount: relative, without empty, "."
+ * or ".." components, and not leading out of it through a symlink. */
+static int shed_cgroup_valid(const char* cgroup) {
+    if (cgroup[0] == '\0' || cgroup[0] == '/')
+        return 0;
+    for (const char* p = cgroup; *p != '\0';) {
+        size_t len = strcspn(p, "/");
+        if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+            return 0;
+        p += len;
+        if (*p == '/')
+            p++;
+    }
+    char mount[UTIL_PATH_MAX], dir[UTIL_PATH_MAX];
+    char real_mount[PATH_MAX], real_dir[PATH_MAX];
+    if (util_path(mount, sizeof(mount), "/sys/fs/cgroup") < 0
+            || util_path(dir, sizeof(dir), "/sys/fs/cgroup/%s", cgroup) < 0
+            || realpath(mount, real_mount) == NULL || realpath(dir, real_dir) == NULL)
+        return 0;
+    size_t len = strlen(real_mount);
+    return strncmp(real_dir, real_mount, len) == 0 && real_dir[len] == '/';
+}
+
+static int shed_target_open(shed_target* t, const shed_target_config* c) {
+    snprintf(t->cgroup, sizeof(t->cgroup), "%s", c->cgroup);
+    t->floor_pct = c->floor_pct;
+    t->pct = 100;
+    if (!shed_cgroup_valid(c->cgroup)) {
+        printf("invalid cgroup %s: must be a path below /sys/fs/cgroup\n", c->cgroup);
+        return -1;
+    }
+    if (util_path(t->path, sizeof(t->path), "/sys/fs/cgroup/%s/cpu.max",
+            c->cgroup) < 0
+            || util_read_line(t->path, t->orig, sizeof(t->orig)) != 0) {
+        printf("unable to read cpu.max of cgroup %s: %s\n", c->cgroup,
+                strerror(errno));
+        return -1;
+    }
+    // "<quota|max> <period>", the period defaults to 100ms
+    t->period = SHED_DEFAULT_PERIOD;
+    t->orig_quota = 0;
+    char quota[32];
+    long period;
+    int fields = sscanf(t->orig, "%31s %ld", quota, &period);
+    if (fields == 2 && period > 0)
+        t->period = period;
+    if (fields >= 1 && strcmp(quota, "max") != 0)
+        t->orig_quota = atol(quota);
+    return 0;
+}
+
+static int shed_target_apply(shed_target* t, int pct) {
+    if (pct == t->pct)
+        return 0;
+    FILE* fp = fopen(t->path, "w");
+    if (fp == NULL) {
+        printf("unable to write %s: %s\n", t->path, strerror(errno));
+        return -1;
+    }
+    if (pct >= 100) {
+        fprintf(fp, "%s\n", t->orig);
+    } else {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        long quota = t->period * (cpus > 0 ? cpus : 1) * pct / 100;
+        // never hand out more than the cgroup was already allowed
+        if (t->orig_quota > 0 && quota > t->orig_quota)
+            quota = t->orig_quota;
+        // the kernel rejects quotas below 1ms
+        if (quota < 1000)
+            quota = 1000;
+        fprintf(fp, "%ld %ld\n", quota, t->period);
+    }
+    if (fclose(fp) != 0) {
+        printf("unable to write %s: %s\n", t->path, strerror(errno));
+        return -1;
+    }
+    t->pct = pct;
+    return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ ============================================================================
+ Name        : shed.h
+ Description : cgroup v2 based thermal shedding of low-priority workloads
+ ============================================================================
+
+ When the fans are pinned at 100% and the temperature keeps climbing, the
+ shedder tightens cpu.max of the configured cgroups, one step per tick, in
+ the order they were configured: the first target is squeezed down to its
+ floor before the next one is touched. Everything outside those cgroups
+ keeps the thermal budget (and the turbo clocks). The limits are loosened in
+ reverse order once the temperature drops, and the original cpu.max is
+ written back when a target is dropped or the daemon exits.
+
+ cgroups are given relative to the cgroup2 mount, /sys/fs/cgroup, which is
+ resolved with util_path() so CLEVO_SYSFS_ROOT can point at a fake tree.
+ Names with "." or ".." components, absolute ones and ones resolving outside
+ the mount are refused.
+ */
+
+#ifndef CLEVO_SHED_H
+#define CLEVO_SHED_H
+
+#define SHED_MAX_TARGETS 16
+#define SHED_CGROUP_MAX 256
+
+typedef struct {
+    char cgroup[SHED_CGROUP_MAX];
+    int floor_pct;      /* lowest share of the whole machine, in percent */
+} shed_target_config;
+
+typedef struct {
+    int trip_temp;      /* shed only at or above this temperature (°C) */
+    int release_temp;   /* give CPU time back below this temperature */
+    int step_pct;
+    shed_target_config targets[SHED_MAX_TARGETS];
+    int target_count;
+} shed_config;
+
+#define SHED_DEFAULT_CONFIG { 85, 78, 10 }
+#define SHED_DEFAULT_FLOOR 5
+
+/* Apply a new configuration. Targets that are no longer listed get their
+ * original cpu.max back; targets still listed keep their current limit. */
+void shed_configure(const shed_config* config);
+
+/* Feed one control tick. Returns the number of targets currently limited. */
+int shed_update(double temp, int fan_duty);
+
+/* Restore the original cpu.max of every target. */
+void shed_release(void);
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ ============================================================================
+ Name        : trace.c
+ Description : End-to-end latency tracing of fan commands
+ ============================================================================
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctl.h"
+#include "fantable.h"
+#include "trace.h"
+#include "util.h"
+
+typedef enum {
+    TRACE_TO_WRITE = 0, TRACE_TO_SETTLED, TRACE_PHASES
+} trace_phase;
+
+typedef struct {
+    uint32_t id;            /* 0 when free */
+    trace_origin origin;
+    int fan;
+    int duty;
+    int expected_rpm;
+    uint64_t start_us;
+    uint64_t written_us;    /* 0 until written */
+    int samples[TRACE_WINDOW];
+    int count;
+} trace_slot;
+
+typedef struct {
+    unsigned long count;
+    unsigned long dropped;
+    uint64_t total_us;
+    uint64_t max_us;
+    unsigned long buckets[TRACE_BUCKETS];
+} trace_histogram;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t trace_next = 1;
+static trace_slot slots[TRACE_INFLIGHT];
+static trace_histogram histograms[TRACE_ORIGINS][TRACE_PHASES];
+
+static const char* origin_names[TRACE_ORIGINS] = { "ui", "control", "socket", "resume" };
+static const char* phase_names[TRACE_PHASES] = { "command_to_write", "write_to_settled" };
+static const char* fan_names[2] = { "cpu", "gpu" };
+
+static trace_slot* trace_find(uint32_t id);
+static void trace_record(trace_origin origin, trace_phase phase, uint64_t us);
+static void trace_end(trace_slot* slot);
+static int trace_settled(const trace_slot* slot);
+static void trace_command(const char* args, FILE* out);
+
+uint32_t trace_begin(trace_origin origin, uint64_t start_us) {
+    pthread_mutex_lock(&trace_lock);
+    uint32_t id = trace_next++;
+    if (trace_next == 0)
+        trace_next = 1;
+    trace_slot* slot = &slots[id % TRACE_INFLIGHT];
+    // a trace still in the slot has been forgotten by its owner
+    if (slot->id != 0)
+        trace_end(slot);
+    memset(slot, 0, sizeof(*slot));
+    slot->id = id;
+    slot->origin = origin;
+    slot->start_us = start_us;
+    pthread_mutex_unlock(&trace_lock);
+    return id;
+}
+
+void trace_written(uint32_t id, int fan, int duty, int expected_rpm) {
+    pthread_mutex_lock(&trace_lock);
+    trace_slot* slot = trace_find(id);
+    if (slot != NULL && slot->written_us == 0) {
+        slot->written_us = util_now_us();
+        slot->fan = fan;
+        slot->duty = duty;
+        slot->expected_rpm = expected_rpm;
+        trace_record(slot->origin, TRACE_TO_WRITE, slot->written_us - slot->start_us);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int trace_sample(uint32_t id, int rpm) {
+    int settled = 0;
+    pthread_mutex_lock(&trace_lock);
+    trace_slot* slot = trace_find(id);
+    if (slot != NULL && slot->written_us != 0) {
+        if (slot->count == TRACE_WINDOW) {
+            memmove(slot->samples, slot->samples + 1, sizeof(int) * (TRACE_WINDOW - 1));
+            slot->count--;
+        }
+        slot->samples[slot->count++] = rpm;
+        uint64_t now = util_now_us();
+        if (trace_settled(slot)) {
+            trace_record(slot->origin, TRACE_TO_SETTLED, now - slot->written_us);
+            printf("trace %u %s %s %d%%: written after %llu ms, settled at %d RPM after %llu ms\n",
+                    slot->id, origin_names[slot->origin], fan_names[slot->fan & 1], slot->duty,
+                    (unsigned long long) (slot->written_us - slot->start_us) / 1000, rpm,
+                    (unsigned long long) (now - slot->written_us) / 1000);
+            slot->id = 0;
+            settled = 1;
+        } else if (now - slot->written_us > TRACE_SETTLE_TIMEOUT_MS * 1000ULL) {
+            trace_end(slot);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return settled;
+}
+
+void trace_drop(uint32_t id) {
+    pthread_mutex_lock(&trace_lock);
+    trace_slot* slot = trace_find(id);
+    if (slot != NULL)
+        trace_end(slot);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_register(void) {
+    ctl_register("latency", "fan command latency histograms: command to EC write to settled RPM",
+            &trace_command);
+}
+
+static trace_slot* trace_find(uint32_t id) {
+    if (id == 0)
+        return NULL;
+    trace_slot* slot = &slots[id % TRACE_INFLIGHT];
+    return slot->id == id ? slot : NULL;
+}
+
+static void trace_record(trace_origin origin, trace_phase phase, uint64_t us) {
+    trace_histogram* h = &histograms[origin][phase];
+    // bucket 0 is below 1 ms, bucket k up to 2^k ms, the last one open
+    int bucket = 0;
+    for (uint64_t ms = us / 1000; ms > 0 && bucket < TRACE_BUCKETS - 1; ms >>= 1)
+        bucket++;
+    h->buckets[bucket]++;
+    h->count++;
+    h->total_us += us;
+    if (us > h->max_us)
+        h->max_us = us;
+}
+
+static void trace_end(trace_slot* slot) {
+    histograms[slot->origin][slot->written_us ? TRACE_TO_SETTLED : TRACE_TO_WRITE].dropped++;
+    slot->id = 0;
+}
+
+static int trace_settled(const trace_slot* slot) {
+    int last = slot->samples[slot->count - 1];
+    int reference = slot->expected_rpm;
+    if (reference < 0) {
+        // no table: the last TRACE_WINDOW samples agree on a value
+        if (slot->count < TRACE_WINDOW)
+            return 0;
+        long sum = 0;
+        for (int i = 0; i < slot->count; i++)
+            sum += slot->samples[i];
+        reference = sum / slot->count;
+    }
+    int band = reference * FANTABLE_STEADY_PCT / 100;
+    if (band < FANTABLE_STEADY_RPM)
+        band = FANTABLE_STEADY_RPM;
+    if (slot->expected_rpm >= 0)
+        return abs(last - reference) <= band;
+    for (int i = 0; i < slot->count; i++) {
+        if (abs(slot->samples[i] - reference) > band)
+            return 0;
+    }
+    return 1;
+}
+
+static void trace_command(const char* args, FILE* out) {
+    pthread_mutex_lock(&trace_lock);
+    for (int o = 0; o < TRACE_ORIGINS; o++) {
+        for (int p = 0; p < TRACE_PHASES; p++) {
+            const trace_histogram* h = &histograms[o][p];
+            if (h->count == 0 && h->dropped == 0)
+                continue;
+            fprintf(out, "%s %s count %lu dropped %lu avg_ms %llu max_ms %llu", origin_names[o],
+                    phase_names[p], h->count, h->dropped,
+                    (unsigned long long) (h->count ? h->total_us / h->count / 1000 : 0),
+                    (unsigned long long) h->max_us / 1000);
+            // percentiles as the upper bound of the bucket they fall in
+            static const int percentiles[] = { 50, 90, 99 };
+            for (int i = 0; i < 3; i++) {
+                unsigned long seen = 0, rank = (h->count * percentiles[i] + 99) / 100;
+                int b = 0;
+                while (b < TRACE_BUCKETS - 1 && seen + h->buckets[b] < rank)
+                    seen += h->buckets[b++];
+                if (h->count > 0)
+                    fprintf(out, " p%d_ms %lu", percentiles[i], 1UL << b);
+            }
+            fprintf(out, " le_ms");
+            for (int b = 0; b < TRACE_BUCKETS; b++) {
+                if (h->buckets[b] > 0)
+                    fprintf(out, " %s%lu:%lu", b == TRACE_BUCKETS - 1 ? ">" : "",
+                            1UL << (b == TRACE_BUCKETS - 1 ? b - 1 : b), h->buckets[b]);
+            }
+            fprintf(out, "\n");
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
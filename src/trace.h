@@ -0,0 +1,55 @@
+/*
+ ============================================================================
+ Name        : trace.h
+ Description : End-to-end latency tracing of fan commands
+ ============================================================================
+
+ Every fan command gets a trace ID where it is made: an indicator menu
+ click, a control loop decision, a "fan" socket request or the duties
+ written again after a resume. The ID travels with the command through the
+ mailbox (the shared memory of the indicator, the actuation queue of the
+ auto mode) to the EC write, and the RPM is then sampled until the fan has
+ settled: within FANTABLE_STEADY_PCT (at least
+ FANTABLE_STEADY_RPM) of the RPM the fan table expects for the duty, or,
+ without a table, TRACE_WINDOW samples in a row agreeing that closely.
+
+ Two latencies are kept per origin, in power-of-two millisecond buckets:
+ command to EC write, and EC write to settled RPM. Commands replaced in the
+ mailbox before they were written, or fans that didn't settle within
+ TRACE_SETTLE_TIMEOUT_MS, are counted as dropped. The "latency" socket
+ command reports the histograms.
+ */
+
+#ifndef CLEVO_TRACE_H
+#define CLEVO_TRACE_H
+
+#include <stdint.h>
+
+typedef enum {
+    TRACE_UI = 0, TRACE_CONTROL, TRACE_SOCKET, TRACE_RESUME, TRACE_ORIGINS
+} trace_origin;
+
+#define TRACE_INFLIGHT 32
+#define TRACE_WINDOW 6
+#define TRACE_BUCKETS 16
+#define TRACE_SETTLE_TIMEOUT_MS 4000
+
+/* Start a trace for a command made at start_us (util_now_us() time, which
+ * is the same in every process). Returns its ID, never 0. */
+uint32_t trace_begin(trace_origin origin, uint64_t start_us);
+
+/* The command reached the EC: duty written to fan (0 CPU, 1 GPU), where
+ * the fan should turn at expected_rpm, -1 when unknown. */
+void trace_written(uint32_t id, int fan, int duty, int expected_rpm);
+
+/* Feed an RPM reading after trace_written(). Returns 1 once the fan has
+ * settled, which ends the trace. */
+int trace_sample(uint32_t id, int rpm);
+
+/* End a trace that won't complete: superseded, failed or timed out. */
+void trace_drop(uint32_t id);
+
+/* Register the "latency" socket command. */
+void trace_register(void);
+
+#endif
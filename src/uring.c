@@ -0,0 +1,201 @@
+/*
+ ============================================================================
+ Name        : uring.c
+ Description : Minimal io_uring batch reader for sensor acquisition
+ ============================================================================
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+static struct {
+    int fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    int* fds;           /* registered fds, index is the fixed file slot */
+    int fd_count;
+} uring = { .fd = -1 };
+
+static void uring_reset(void);
+
+int uring_init(void) {
+    if (uring.fd >= 0)
+        return 0;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0)
+        return -1;
+    uring.fd = fd;
+    uring.sq_ring_size = params.sq_off.array
+            + params.sq_entries * sizeof(unsigned);
+    uring.cq_ring_size = params.cq_off.cqes
+            + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring.cq_ring_size > uring.sq_ring_size)
+            uring.sq_ring_size = uring.cq_ring_size;
+        uring.cq_ring_size = uring.sq_ring_size;
+    }
+    uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (uring.sq_ring == MAP_FAILED)
+        goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring.cq_ring = uring.sq_ring;
+    } else {
+        uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (uring.cq_ring == MAP_FAILED)
+            goto fail;
+    }
+    uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED)
+        goto fail;
+    uring.sq_tail = (unsigned*) ((char*) uring.sq_ring + params.sq_off.tail);
+    uring.sq_mask = (unsigned*) ((char*) uring.sq_ring + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned*) ((char*) uring.sq_ring + params.sq_off.array);
+    uring.cq_head = (unsigned*) ((char*) uring.cq_ring + params.cq_off.head);
+    uring.cq_tail = (unsigned*) ((char*) uring.cq_ring + params.cq_off.tail);
+    uring.cq_mask = (unsigned*) ((char*) uring.cq_ring + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe*) ((char*) uring.cq_ring
+            + params.cq_off.cqes);
+    return 0;
+
+fail:
+    uring.sqes = NULL;
+    uring_exit();
+    return -1;
+}
+
+void uring_exit(void) {
+    if (uring.fd < 0)
+        return;
+    if (uring.sqes != NULL && uring.sqes != MAP_FAILED)
+        munmap(uring.sqes, uring.sqes_size);
+    if (uring.cq_ring != NULL && uring.cq_ring != MAP_FAILED
+            && uring.cq_ring != uring.sq_ring)
+        munmap(uring.cq_ring, uring.cq_ring_size);
+    if (uring.sq_ring != NULL && uring.sq_ring != MAP_FAILED)
+        munmap(uring.sq_ring, uring.sq_ring_size);
+    close(uring.fd);
+    free(uring.fds);
+    memset(&uring, 0, sizeof(uring));
+    uring.fd = -1;
+}
+
+int uring_available(void) {
+    return uring.fd >= 0;
+}
+
+int uring_register_fds(const int* fds, int count) {
+    if (uring.fd < 0)
+        return -1;
+    if (uring.fd_count > 0) {
+        syscall(__NR_io_uring_register, uring.fd, IORING_UNREGISTER_FILES,
+                NULL, 0);
+        uring.fd_count = 0;
+    }
+    if (count == 0)
+        return 0;
+    int* copy = realloc(uring.fds, sizeof(int) * count);
+    if (copy == NULL)
+        return -1;
+    uring.fds = copy;
+    memcpy(uring.fds, fds, sizeof(int) * count);
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_FILES,
+            uring.fds, count) != 0)
+        return -1;
+    uring.fd_count = count;
+    return 0;
+}
+
+int uring_read_batch(uring_read* reads, int count) {
+    if (uring.fd < 0 || count > uring.fd_count)
+        return -1;
+    for (int done = 0; done < count;) {
+        int chunk = count - done;
+        if (chunk > URING_ENTRIES)
+            chunk = URING_ENTRIES;
+        unsigned tail = *uring.sq_tail;
+        unsigned mask = *uring.sq_mask;
+        for (int i = 0; i < chunk; i++) {
+            // read i goes to the file registered in slot i
+            uring_read* r = &reads[done + i];
+            int slot = done + i;
+            if (uring.fds[slot] != r->fd)
+                return -1;
+            unsigned index = tail & mask;
+            struct io_uring_sqe* sqe = &uring.sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = slot;
+            sqe->addr = (uint64_t) (uintptr_t) r->buffer;
+            sqe->len = r->size;
+            sqe->off = r->offset;
+            sqe->user_data = done + i;
+            uring.sq_array[index] = index;
+            tail++;
+        }
+        __atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+
+        int submitted = syscall(__NR_io_uring_enter, uring.fd, chunk, chunk,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            uring_reset();
+            return -1;
+        }
+        for (int reaped = 0; reaped < chunk;) {
+            unsigned head = *uring.cq_head;
+            unsigned cq_tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+            if (head == cq_tail) {
+                // interrupted before everything completed
+                if (syscall(__NR_io_uring_enter, uring.fd, 0, chunk - reaped,
+                        IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+                    uring_reset();
+                    return -1;
+                }
+                continue;
+            }
+            for (; head != cq_tail; head++, reaped++) {
+                struct io_uring_cqe* cqe = &uring.cqes[head & *uring.cq_mask];
+                reads[cqe->user_data].result = cqe->res;
+            }
+            __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+        }
+        done += chunk;
+    }
+    return 0;
+}
+
+/* Start over on a fresh ring: SQEs left queued or CQEs still to come from
+ * a failed batch would otherwise be taken for the next batch's. The
+ * caller has to register its files again. */
+static void uring_reset(void) {
+    int saved = errno;
+    uring_exit();
+    uring_init();
+    errno = saved;
+}
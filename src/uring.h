@@ -0,0 +1,45 @@
+/*
+ ============================================================================
+ Name        : uring.h
+ Description : Minimal io_uring batch reader for sensor acquisition
+ ============================================================================
+
+ A tick reads dozens of tiny sysfs files. uring_read_batch() submits all of
+ them as one batch of IORING_OP_READ on registered (fixed) files and waits
+ for every completion with a single io_uring_enter(), instead of one pread()
+ per file. Talks to the kernel directly through the io_uring syscalls, so
+ there's no liburing dependency; uring_init() fails cleanly on kernels
+ without io_uring (or with it disabled) and callers fall back to pread().
+ */
+
+#ifndef CLEVO_URING_H
+#define CLEVO_URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define URING_ENTRIES 64
+
+typedef struct {
+    int fd;             /* plain fd, must match the registered slot */
+    void* buffer;
+    size_t size;
+    off_t offset;
+    ssize_t result;     /* bytes read or -errno */
+} uring_read;
+
+int uring_init(void);
+void uring_exit(void);
+int uring_available(void);
+
+/* Register the set of fds used by the following batches. Re-registering
+ * replaces the previous set. */
+int uring_register_fds(const int* fds, int count);
+
+/* Read everything in one submission (chunked by URING_ENTRIES). reads[i]
+ * must be on the fd registered i-th. Returns 0 once all results are filled
+ * in. On failure the ring is replaced by a fresh one, so nothing of the
+ * batch spills into the next, and the fds have to be registered again. */
+int uring_read_batch(uring_read* reads, int count);
+
+#endif
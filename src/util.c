@@ -0,0 +1,80 @@
+/*
+ ============================================================================
+ Name        : util.c
+ Description : Small file and clock helpers shared by the daemon modules
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+
+int util_path(char* buffer, size_t max, const char* format, ...) {
+    // not honoured when running setuid: the governor and the shedder write
+    // below this root
+    const char* root = secure_getenv("CLEVO_SYSFS_ROOT");
+    if (root == NULL)
+        root = "";
+    int len = snprintf(buffer, max, "%s", root);
+    if (len < 0 || (size_t) len >= max)
+        return -1;
+    va_list args;
+    va_start(args, format);
+    int rest = vsnprintf(buffer + len, max - len, format, args);
+    va_end(args);
+    if (rest < 0 || (size_t) (len + rest) >= max)
+        return -1;
+    return len + rest;
+}
+
+int util_read_long(const char* path, long* value) {
+    char buffer[64];
+    if (util_read_line(path, buffer, sizeof(buffer)) != 0)
+        return -1;
+    char* endptr;
+    errno = 0;
+    long v = strtol(buffer, &endptr, 10);
+    if (errno != 0 || endptr == buffer) {
+        errno = EINVAL;
+        return -1;
+    }
+    *value = v;
+    return 0;
+}
+
+int util_write_long(const char* path, long value) {
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL)
+        return -1;
+    int ok = fprintf(fp, "%ld\n", value) > 0;
+    if (fclose(fp) != 0)
+        ok = 0;
+    return ok ? 0 : -1;
+}
+
+int util_read_line(const char* path, char* buffer, size_t max) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    char* line = fgets(buffer, max, fp);
+    fclose(fp);
+    if (line == NULL) {
+        errno = EIO;
+        return -1;
+    }
+    buffer[strcspn(buffer, "\n")] = '\0';
+    return 0;
+}
+
+uint64_t util_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
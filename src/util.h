@@ -0,0 +1,33 @@
+/*
+ ============================================================================
+ Name        : util.h
+ Description : Small file and clock helpers shared by the daemon modules
+ ============================================================================
+ */
+
+#ifndef CLEVO_UTIL_H
+#define CLEVO_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define UTIL_PATH_MAX 1024
+
+/* Build an absolute /sys or /proc path. The result is prefixed with
+ * $CLEVO_SYSFS_ROOT (empty by default, and ignored in a setuid process),
+ * so every module touching kernel files can be run against a fake tree.
+ * Returns the length, or -1 when the path doesn't fit. */
+int util_path(char* buffer, size_t max, const char* format, ...)
+        __attribute__((format(printf, 3, 4)));
+
+/* Read/write a single integer file such as max_perf_pct. Return 0 on
+ * success, -1 on failure with errno set. */
+int util_read_long(const char* path, long* value);
+int util_write_long(const char* path, long value);
+
+/* Read the first line of a file without the trailing newline. */
+int util_read_line(const char* path, char* buffer, size_t max);
+
+uint64_t util_now_us(void);
+
+#endif
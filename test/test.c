@@ -0,0 +1,102 @@
+/*
+ ============================================================================
+ Name        : test.c
+ Description : Checks and fake sysfs helpers for the module tests
+ ============================================================================
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <ftw.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define TEST_MAX_ROOTS 16
+
+int test_failures = 0;
+
+static char roots[TEST_MAX_ROOTS][64];
+static int root_count = 0;
+
+static int test_remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw);
+
+const char* test_fake_root(void) {
+    if (root_count == TEST_MAX_ROOTS) {
+        printf("too many fake roots\n");
+        exit(EXIT_FAILURE);
+    }
+    char* root = roots[root_count];
+    snprintf(root, sizeof(roots[0]), "/tmp/clevo-test-XXXXXX");
+    if (mkdtemp(root) == NULL) {
+        printf("unable to create a fake root\n");
+        exit(EXIT_FAILURE);
+    }
+    root_count++;
+    setenv("CLEVO_SYSFS_ROOT", root, 1);
+    return root;
+}
+
+void test_write(const char* root, const char* path, const char* content) {
+    char full[1024];
+    snprintf(full, sizeof(full), "%s/%s", root, path);
+    for (char* slash = strchr(full + strlen(root) + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(full, 0755);
+        *slash = '/';
+    }
+    FILE* fp = fopen(full, "w");
+    if (fp == NULL) {
+        printf("unable to write %s\n", full);
+        exit(EXIT_FAILURE);
+    }
+    fputs(content, fp);
+    fclose(fp);
+}
+
+void test_symlink(const char* root, const char* path, const char* target) {
+    test_write(root, path, "");
+    char full[1024];
+    snprintf(full, sizeof(full), "%s/%s", root, path);
+    remove(full);
+    if (symlink(target, full) != 0) {
+        printf("unable to link %s\n", full);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void test_remove(const char* root, const char* path) {
+    char full[1024];
+    snprintf(full, sizeof(full), "%s/%s", root, path);
+    nftw(full, &test_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+const char* test_read(const char* root, const char* path) {
+    static char line[256];
+    char full[1024];
+    snprintf(full, sizeof(full), "%s/%s", root, path);
+    line[0] = '\0';
+    FILE* fp = fopen(full, "r");
+    if (fp == NULL)
+        return line;
+    if (fgets(line, sizeof(line), fp) == NULL)
+        line[0] = '\0';
+    fclose(fp);
+    line[strcspn(line, "\n")] = '\0';
+    return line;
+}
+
+int test_exit(const char* name) {
+    for (int i = 0; i < root_count; i++)
+        nftw(roots[i], &test_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    printf("%s: %s\n", name, test_failures ? "FAILED" : "ok");
+    return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int test_remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    remove(path);
+    return 0;
+}
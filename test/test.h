@@ -0,0 +1,44 @@
+/*
+ ============================================================================
+ Name        : test.h
+ Description : Checks and fake sysfs helpers for the module tests
+ ============================================================================
+
+ Each test is a small program linking the modules it exercises; "make
+ check" builds and runs them all. CHECK() reports a failed condition and
+ carries on, test_exit() turns the count into the exit status. Modules
+ that touch kernel files are pointed at a fake tree made with
+ test_fake_root(), through CLEVO_SYSFS_ROOT.
+ */
+
+#ifndef CLEVO_TEST_H
+#define CLEVO_TEST_H
+
+#include <stdio.h>
+
+extern int test_failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+/* Create an empty temporary directory and make it CLEVO_SYSFS_ROOT. */
+const char* test_fake_root(void);
+
+/* Write content to root/path, creating the directories on the way. */
+void test_write(const char* root, const char* path, const char* content);
+
+/* Make root/path a symlink to target, and remove root/path recursively. */
+void test_symlink(const char* root, const char* path, const char* target);
+void test_remove(const char* root, const char* path);
+
+/* The first line of root/path, or "" when it can't be read. */
+const char* test_read(const char* root, const char* path);
+
+/* Print the outcome and return the exit status for main(). */
+int test_exit(const char* name);
+
+#endif
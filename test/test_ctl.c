@@ -0,0 +1,127 @@
+/*
+ ============================================================================
+ Name        : test_ctl.c
+ Description : Socket clients that stall never hold up the control loop
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "test.h"
+#include "util.h"
+
+#define BIG_REPLY (4 << 20)
+
+static struct sockaddr_un server;
+
+static void echo_command(const char* args, FILE* out) {
+    fprintf(out, "echo %s\n", args);
+}
+
+static void big_command(const char* args, FILE* out) {
+    for (int i = 0; i < BIG_REPLY / 64; i++)
+        fprintf(out, "%063d\n", i);
+}
+
+static int connect_client(void) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &server, sizeof(server)) != 0)
+        return -1;
+    return fd;
+}
+
+/* Milliseconds ctl_wait(timeout_ms) took. */
+static long timed_wait(int timeout_ms) {
+    uint64_t start = util_now_us();
+    ctl_wait(timeout_ms);
+    return (util_now_us() - start) / 1000;
+}
+
+static void test_stalled_clients(void) {
+    // a client that never sends its request
+    int silent = connect_client();
+    CHECK(silent >= 0);
+    // a client that sends half a line
+    int partial = connect_client();
+    CHECK(write(partial, "ech", 3) == 3);
+    // a client that never reads a reply far larger than the socket buffer
+    int reader = connect_client();
+    CHECK(write(reader, "big\n", 4) == 4);
+    // and a well-behaved one
+    int good = connect_client();
+    CHECK(write(good, "echo hi\n", 8) == 8);
+
+    long took = timed_wait(100);
+    CHECK(took >= 100 && took < 150);
+    char reply[64] = "";
+    CHECK(read(good, reply, sizeof(reply) - 1) > 0);
+    CHECK(strcmp(reply, "echo hi\n") == 0);
+
+    // still not done after the client timeout: dropped without a full reply
+    took = timed_wait(1100);
+    CHECK(took >= 1100 && took < 1150);
+    char buffer[65536];
+    long total = 0;
+    ssize_t n;
+    while ((n = read(reader, buffer, sizeof(buffer))) > 0)
+        total += n;
+    CHECK(n == 0 && total < BIG_REPLY);
+    CHECK(read(silent, buffer, sizeof(buffer)) == 0);
+    close(silent);
+    close(partial);
+    close(reader);
+    close(good);
+}
+
+static void test_busy(void) {
+    int clients[9];
+    for (int i = 0; i < 9; i++) {
+        clients[i] = connect_client();
+        CHECK(clients[i] >= 0);
+    }
+    // only so many at once, the rest is turned away rather than queued
+    ctl_wait(20);
+    char buffer[16];
+    CHECK(read(clients[8], buffer, sizeof(buffer)) == 0);
+    for (int i = 0; i < 9; i++)
+        close(clients[i]);
+    ctl_wait(20);
+    int fd = connect_client();
+    CHECK(write(fd, "echo again\n", 11) == 11);
+    ctl_wait(20);
+    char reply[64] = "";
+    CHECK(read(fd, reply, sizeof(reply) - 1) > 0);
+    CHECK(strcmp(reply, "echo again\n") == 0);
+    close(fd);
+}
+
+static void test_wait_fd(void) {
+    int pipe_fds[2];
+    CHECK(pipe(pipe_fds) == 0);
+    CHECK(ctl_wait_fd(pipe_fds[0], 20) == 0);
+    CHECK(write(pipe_fds[1], "x", 1) == 1);
+    uint64_t start = util_now_us();
+    CHECK(ctl_wait_fd(pipe_fds[0], 1000) == 1);
+    CHECK(util_now_us() - start < 50000);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
+
+int main(void) {
+    server.sun_family = AF_UNIX;
+    snprintf(server.sun_path, sizeof(server.sun_path), "%s/ctl.sock", test_fake_root());
+    setenv("CLEVO_SOCKET", server.sun_path, 1);
+    CHECK(ctl_open() == 0);
+    ctl_register("echo", "echo the arguments", &echo_command);
+    ctl_register("big", "a reply larger than the socket buffer", &big_command);
+    test_stalled_clients();
+    test_busy();
+    test_wait_fd();
+    ctl_close();
+    return test_exit("ctl");
+}
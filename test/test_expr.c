@@ -0,0 +1,176 @@
+/*
+ ============================================================================
+ Name        : test_expr.c
+ Description : Fan rule compiler and evaluator
+ ============================================================================
+ */
+
+#include <string.h>
+
+#include "expr.h"
+#include "test.h"
+
+enum { CPU, GPU, NVME, AC };
+
+static expr_env env;
+
+static void test_env(void) {
+    memset(&env, 0, sizeof(env));
+    curve stock, quiet, loud;
+    CHECK(curve_parse(&stock, EXPR_STOCK_CURVE) == 0);
+    CHECK(curve_parse(&quiet, "50:0 60:20 80:60 90:100") == 0);
+    CHECK(curve_parse(&loud, "30:50 40:100") == 0);
+    CHECK(expr_env_curve(&env, "curve", &stock) == 0);
+    CHECK(expr_env_curve(&env, "quiet", &stock) == 1);
+    // a configured curve replaces the one of the same name
+    CHECK(expr_env_curve(&env, "quiet", &quiet) == 1);
+    CHECK(expr_env_curve(&env, "loud", &loud) == 2);
+    CHECK(expr_env_var(&env, "cpu") == CPU);
+    CHECK(expr_env_var(&env, "gpu") == GPU);
+    CHECK(expr_env_var(&env, "nvme") == NVME);
+    CHECK(expr_env_var(&env, "ac") == AC);
+    CHECK(expr_env_var(&env, "cpu") == -1);
+    CHECK(expr_env_var(&env, "a_name_that_is_longer_than_the_limit") == -1);
+    CHECK(env.var_count == 4);
+}
+
+/* Compile text and evaluate it; a failed compile yields -1000. */
+static double eval(const char* text, double cpu, double gpu, double nvme, double ac) {
+    expr_program program;
+    char error[128];
+    if (expr_compile(&program, &env, text, error, sizeof(error)) != 0) {
+        printf("%s: %s\n", text, error);
+        return -1000;
+    }
+    double vars[4] = { cpu, gpu, nvme, ac };
+    return expr_eval(&program, vars);
+}
+
+/* The message of a compile that has to fail. */
+static const char* compile_error(const char* text) {
+    static char error[128];
+    expr_program program;
+    if (expr_compile(&program, &env, text, error, sizeof(error)) == 0)
+        return "";
+    return error;
+}
+
+static void test_arithmetic(void) {
+    CHECK(eval("1 + 2 * 3", 0, 0, 0, 0) == 7);
+    CHECK(eval("(1 + 2) * 3", 0, 0, 0, 0) == 9);
+    CHECK(eval("10 - 4 - 3", 0, 0, 0, 0) == 3);
+    CHECK(eval("10 / 4", 0, 0, 0, 0) == 2.5);
+    CHECK(eval("-2 - -3", 0, 0, 0, 0) == 1);
+    CHECK(eval("cpu * 2 + gpu", 40, 5, 0, 0) == 85);
+    CHECK(eval("0.5 * .5", 0, 0, 0, 0) == 0.25);
+    CHECK(eval("cpu # the rest is a comment", 42, 0, 0, 0) == 42);
+}
+
+static void test_logic(void) {
+    CHECK(eval("cpu >= 80", 80, 0, 0, 0) == 1);
+    CHECK(eval("cpu > 80", 80, 0, 0, 0) == 0);
+    CHECK(eval("cpu < 80", 79, 0, 0, 0) == 1);
+    CHECK(eval("cpu <= 80", 81, 0, 0, 0) == 0);
+    CHECK(eval("cpu == gpu", 60, 60, 0, 0) == 1);
+    CHECK(eval("cpu != gpu", 60, 60, 0, 0) == 0);
+    CHECK(eval("ac and cpu > 50", 60, 0, 0, 1) == 1);
+    CHECK(eval("ac and cpu > 50", 60, 0, 0, 0) == 0);
+    CHECK(eval("not ac or cpu > 90", 60, 0, 0, 0) == 1);
+    CHECK(eval("not ac or cpu > 90", 60, 0, 0, 1) == 0);
+    // comparisons bind tighter than and/or, arithmetic tighter than both
+    CHECK(eval("cpu + 10 > 65 and gpu < 50", 60, 40, 0, 0) == 1);
+}
+
+static void test_conditional(void) {
+    CHECK(eval("50 if ac else 30", 0, 0, 0, 1) == 50);
+    CHECK(eval("50 if ac else 30", 0, 0, 0, 0) == 30);
+    const char* chain = "100 if cpu > 90 else 60 if cpu > 80 else 20";
+    CHECK(eval(chain, 95, 0, 0, 0) == 100);
+    CHECK(eval(chain, 85, 0, 0, 0) == 60);
+    CHECK(eval(chain, 70, 0, 0, 0) == 20);
+    // the branches are full expressions
+    CHECK(eval("max(cpu, gpu) + 1 if ac else min(cpu, gpu) - 1", 60, 70, 0, 1) == 71);
+    CHECK(eval("max(cpu, gpu) + 1 if ac else min(cpu, gpu) - 1", 60, 70, 0, 0) == 59);
+    CHECK(eval("(10 if ac else 20) + 1", 0, 0, 0, 0) == 21);
+}
+
+static void test_functions(void) {
+    CHECK(eval("max(1, 5, 3)", 0, 0, 0, 0) == 5);
+    CHECK(eval("min(4, 2, 9)", 0, 0, 0, 0) == 2);
+    CHECK(eval("max(7)", 0, 0, 0, 0) == 7);
+    CHECK(eval("clamp(cpu, 0, 100)", 150, 0, 0, 0) == 100);
+    CHECK(eval("clamp(cpu, 0, 100)", -5, 0, 0, 0) == 0);
+    CHECK(eval("clamp(cpu, 0, 100)", 42, 0, 0, 0) == 42);
+    // the stock curve: temperature minus 30 between 45 and 75°C
+    CHECK(eval("curve(cpu)", 60, 0, 0, 0) == 30);
+    CHECK(eval("curve(cpu)", 30, 0, 0, 0) == 0);
+    CHECK(eval("curve(cpu)", 95, 0, 0, 0) == 100);
+    CHECK(eval("quiet(cpu)", 70, 0, 0, 0) == 40);
+    CHECK(eval("max(curve(cpu), curve(nvme) + 10) if ac else quiet(cpu) - 5",
+            60, 0, 70, 1) == 50);
+    CHECK(eval("max(curve(cpu), curve(nvme) + 10) if ac else quiet(cpu) - 5",
+            60, 0, 70, 0) == 15);
+}
+
+static void test_program(void) {
+    expr_program program;
+    char error[128];
+    CHECK(expr_compile(&program, &env, "1 + 2 * 3", error, sizeof(error)) == 0);
+    CHECK(program.length == 5 && program.stack == 3);
+    // constants and curves are stored once
+    CHECK(expr_compile(&program, &env, "1 + 1 + cpu * 1", error, sizeof(error)) == 0);
+    CHECK(program.const_count == 1);
+    CHECK(expr_compile(&program, &env, "curve(cpu) + curve(gpu) + loud(nvme)",
+            error, sizeof(error)) == 0);
+    CHECK(program.curve_count == 2);
+    double vars[4] = { 60, 65, 35, 0 };
+    CHECK(expr_eval(&program, vars) == 30 + 35 + 75);
+}
+
+static void test_errors(void) {
+    CHECK(strcmp(compile_error(""), "unexpected end at column 1") == 0);
+    CHECK(strcmp(compile_error("cpu +"), "unexpected end at column 6") == 0);
+    CHECK(strcmp(compile_error("fan"), "unknown variable 'fan' at column 1") == 0);
+    CHECK(strcmp(compile_error("1 + hot(cpu)"),
+            "unknown function or curve 'hot' at column 5") == 0);
+    CHECK(strstr(compile_error("curve(cpu, gpu)"), "curve() takes 1 argument") != NULL);
+    CHECK(strstr(compile_error("clamp(cpu, 0)"), "clamp() takes 3 arguments") != NULL);
+    CHECK(strstr(compile_error("max()"), "max() needs arguments") != NULL);
+    CHECK(strstr(compile_error("50 if ac"), "'if' without 'else'") != NULL);
+    CHECK(strstr(compile_error("(cpu + 1"), "missing ')'") != NULL);
+    CHECK(strcmp(compile_error("cpu gpu"), "unexpected input at column 5") == 0);
+    CHECK(strstr(compile_error("if ac"), "unexpected 'if'") != NULL);
+    CHECK(strstr(compile_error("cpu @ 2"), "unexpected input") != NULL);
+    CHECK(strstr(compile_error("a_name_that_is_longer_than_the_limit"),
+            "name too long") != NULL);
+
+    // 17 values pending at once overflow the evaluation stack
+    char deep[256] = "";
+    for (int i = 0; i < EXPR_STACK + 1; i++)
+        strcat(deep, "cpu + (");
+    strcat(deep, "cpu");
+    for (int i = 0; i < EXPR_STACK + 1; i++)
+        strcat(deep, ")");
+    CHECK(strstr(compile_error(deep), "nested too deeply") != NULL);
+
+    char numbers[512] = "0";
+    for (int i = 1; i <= EXPR_MAX_CONSTS; i++)
+        snprintf(numbers + strlen(numbers), sizeof(numbers) - strlen(numbers), " + %d", i);
+    CHECK(strstr(compile_error(numbers), "too many numbers") != NULL);
+
+    char longest[1024] = "cpu";
+    for (int i = 0; i < EXPR_MAX_CODE; i++)
+        strcat(longest, " + 1");
+    CHECK(strstr(compile_error(longest), "expression too long") != NULL);
+}
+
+int main(void) {
+    test_env();
+    test_arithmetic();
+    test_logic();
+    test_conditional();
+    test_functions();
+    test_program();
+    test_errors();
+    return test_exit("expr");
+}
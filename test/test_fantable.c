@@ -0,0 +1,141 @@
+/*
+ ============================================================================
+ Name        : test_fantable.c
+ Description : Fan table parsing and RPM interpolation
+ ============================================================================
+ */
+
+#include <stdio.h>
+
+#include "backend.h"
+#include "fantable.h"
+#include "test.h"
+
+#define PRODUCT "sys/class/dmi/id/product_name"
+
+static const char* cpu_points =
+        "point cpu 0 0 0 0\n"
+        "point cpu 10 0 0 0\n"
+        "point cpu 20 900 800 60\n"
+        "point cpu 30 1300 600 40\n"
+        "point cpu 40 1700 500 0\n"
+        "point cpu 50 2100 500 0\n"
+        "point cpu 60 2500 450 0\n"
+        "point cpu 70 2900 400 0\n"
+        "point cpu 80 3300 400 0\n"
+        "point cpu 90 3700 350 0\n"
+        "point cpu 100 4200 20 0\n";
+
+/* characterize is not exercised, nothing may reach the fans */
+int backend_read_one(backend_value what, int* value) {
+    return -1;
+}
+
+int backend_write_duty(int fan, int duty_percentage) {
+    return -1;
+}
+
+static const char* table_path(const char* root, const char* name) {
+    static char path[256];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    return path;
+}
+
+static void test_defaults(void) {
+    CHECK(fantable_get(0) == NULL);
+    CHECK(fantable_rpm(0, 50) == -1);
+    CHECK(fantable_max_rpm(0) == FANTABLE_DEFAULT_MAX_RPM);
+    CHECK(fantable_settle_ms(1, 50) == FANTABLE_DEFAULT_SETTLE_MS);
+}
+
+static void test_rejected(const char* root) {
+    CHECK(fantable_load(table_path(root, "missing")) == -1);
+
+    char content[1024];
+    snprintf(content, sizeof(content), "machine Other Laptop\n"
+            "fan cpu min_duty 16 max_rpm 4200 settle_ms 800\n%s"
+            "fan gpu min_duty 20 max_rpm 3000 settle_ms 900\n"
+            "point gpu 100 3000 900 0\n", cpu_points);
+    test_write(root, "other", content);
+    CHECK(fantable_load(table_path(root, "other")) == -1);
+
+    // no GPU points
+    snprintf(content, sizeof(content), "machine P775DM3\n"
+            "fan cpu min_duty 16 max_rpm 4200 settle_ms 800\n%s", cpu_points);
+    test_write(root, "incomplete", content);
+    CHECK(fantable_load(table_path(root, "incomplete")) == -1);
+    CHECK(fantable_get(0) == NULL);
+}
+
+static void test_parse(const char* root) {
+    char content[2048];
+    snprintf(content, sizeof(content), "machine P775DM3\n"
+            "garbage line\n"
+            "fan cpu min_duty 16 max_rpm 4200 settle_ms 800\n"
+            "fan fan min_duty 1 max_rpm 1 settle_ms 1\n"
+            "point cpu 20\n"
+            "point ventilator 50 1 1 1\n"
+            "%s"
+            "point cpu 110 9999 0 0\n"
+            "fan gpu min_duty 20 max_rpm 3000 settle_ms 900\n"
+            "point gpu 0 0 0 0\n"
+            "point gpu 100 3000 900 0\n", cpu_points);
+    test_write(root, "table", content);
+    CHECK(fantable_load(table_path(root, "table")) == 0);
+
+    const fantable_fan* cpu = fantable_get(0);
+    const fantable_fan* gpu = fantable_get(1);
+    CHECK(cpu != NULL && gpu != NULL);
+    if (cpu == NULL || gpu == NULL)
+        return;
+    CHECK(cpu->min_duty == 16 && cpu->max_rpm == 4200 && cpu->settle_ms == 800);
+    // the short point line is skipped, the one past the last slot dropped
+    CHECK(cpu->count == FANTABLE_POINTS);
+    CHECK(cpu->points[2].duty == 20 && cpu->points[2].rpm == 900);
+    CHECK(cpu->points[2].settle_ms == 800 && cpu->points[2].overshoot_rpm == 60);
+    CHECK(cpu->points[FANTABLE_POINTS - 1].duty == 100);
+    CHECK(gpu->min_duty == 20 && gpu->count == 2);
+
+    CHECK(fantable_max_rpm(1) == 3000);
+    CHECK(fantable_settle_ms(0, 22) == 800);
+    CHECK(fantable_settle_ms(0, 27) == 600);
+    // never below the sampling period
+    CHECK(fantable_settle_ms(0, 100) == FANTABLE_SAMPLE_MS);
+}
+
+static void test_rpm(void) {
+    // stopped below the spin-up duty, proportional from there to 20%
+    CHECK(fantable_rpm(0, 0) == 0);
+    CHECK(fantable_rpm(0, 5) == 0);
+    CHECK(fantable_rpm(0, 15) == 0);
+    CHECK(fantable_rpm(0, 18) == 810);
+    CHECK(fantable_rpm(0, 20) == 900);
+    // linear between measured points
+    CHECK(fantable_rpm(0, 25) == 1100);
+    CHECK(fantable_rpm(0, 30) == 1300);
+    CHECK(fantable_rpm(0, 95) == 3950);
+    CHECK(fantable_rpm(0, 100) == 4200);
+    CHECK(fantable_rpm(0, 120) == 4200);
+    CHECK(fantable_rpm(1, 50) == 1500);
+    CHECK(fantable_rpm(2, 50) == -1);
+}
+
+static void test_round_trip(const char* root) {
+    const char* path = table_path(root, "saved/fan-table");
+    CHECK(fantable_save(path) == 0);
+    CHECK(test_read(root, "saved/fan-table.tmp")[0] == '\0');
+    CHECK(fantable_load(path) == 0);
+    CHECK(fantable_get(0)->count == FANTABLE_POINTS);
+    CHECK(fantable_rpm(0, 25) == 1100);
+}
+
+int main(void) {
+    const char* root = test_fake_root();
+    test_write(root, PRODUCT, "P775DM3\n");
+    test_defaults();
+    test_rejected(root);
+    test_parse(root);
+    test_rpm();
+    test_round_trip(root);
+    return test_exit("fantable");
+}
@@ -0,0 +1,81 @@
+/*
+ ============================================================================
+ Name        : test_governor.c
+ Description : Governor against fake intel_pstate and cpufreq trees
+ ============================================================================
+ */
+
+#include <stdlib.h>
+
+#include "governor.h"
+#include "test.h"
+
+#define PSTATE "sys/devices/system/cpu/intel_pstate"
+#define CPUFREQ "sys/devices/system/cpu/cpufreq"
+
+static void test_pstate(void) {
+    const char* root = test_fake_root();
+    test_write(root, PSTATE "/status", "active\n");
+    test_write(root, PSTATE "/max_perf_pct", "90\n");
+    governor_config config = { 88, 80, 5, 60 };
+    CHECK(governor_init(&config) == 0);
+
+    // not at full fan: nothing to do
+    CHECK(governor_update(95, 80) == 100);
+    // full fan and still rising: every step is a share of the user's 90%
+    CHECK(governor_update(96, 100) == 95);
+    CHECK(atoi(test_read(root, PSTATE "/max_perf_pct")) == 85);
+    CHECK(governor_update(98, 100) == 90);
+    CHECK(atoi(test_read(root, PSTATE "/max_perf_pct")) == 81);
+    CHECK(governor_update(100, 100) == 85);
+    CHECK(atoi(test_read(root, PSTATE "/max_perf_pct")) == 76);
+    for (int i = 0; i < 20; i++)
+        governor_update(101 + i, 100);
+    CHECK(governor_update(130, 100) == 60);
+    CHECK(atoi(test_read(root, PSTATE "/max_perf_pct")) == 54);
+    // holding steady between release and trip keeps the cap
+    CHECK(governor_update(85, 100) == 60);
+    // cooled down: given back step by step
+    CHECK(governor_update(70, 100) == 65);
+    CHECK(atoi(test_read(root, PSTATE "/max_perf_pct")) == 58);
+    CHECK(governor_update(70, 100) == 70);
+    CHECK(atoi(test_read(root, PSTATE "/max_perf_pct")) == 63);
+
+    governor_release();
+    CHECK(atoi(test_read(root, PSTATE "/max_perf_pct")) == 90);
+}
+
+static void test_cpufreq(void) {
+    const char* root = test_fake_root();
+    // passive intel_pstate leaves the limits to cpufreq
+    test_write(root, PSTATE "/status", "passive\n");
+    test_write(root, CPUFREQ "/policy0/cpuinfo_min_freq", "800000\n");
+    test_write(root, CPUFREQ "/policy0/scaling_max_freq", "4000000\n");
+    test_write(root, CPUFREQ "/policy1/cpuinfo_min_freq", "1200000\n");
+    test_write(root, CPUFREQ "/policy1/scaling_max_freq", "2000000\n");
+    governor_config config = { 88, 80, 50, 10 };
+    CHECK(governor_init(&config) == 0);
+
+    CHECK(governor_update(90, 100) == 100);
+    CHECK(governor_update(92, 100) == 50);
+    CHECK(atoi(test_read(root, CPUFREQ "/policy0/scaling_max_freq")) == 2000000);
+    // never below the hardware minimum
+    CHECK(atoi(test_read(root, CPUFREQ "/policy1/scaling_max_freq")) == 1200000);
+
+    governor_release();
+    CHECK(atoi(test_read(root, CPUFREQ "/policy0/scaling_max_freq")) == 4000000);
+    CHECK(atoi(test_read(root, CPUFREQ "/policy1/scaling_max_freq")) == 2000000);
+}
+
+static void test_none(void) {
+    test_fake_root();
+    CHECK(governor_init(NULL) != 0);
+    CHECK(governor_update(120, 100) == 100);
+}
+
+int main(void) {
+    test_pstate();
+    test_cpufreq();
+    test_none();
+    return test_exit("governor");
+}
@@ -0,0 +1,153 @@
+/*
+ ============================================================================
+ Name        : test_history.c
+ Description : History tier rollover, persistence and stale slots
+ ============================================================================
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "history.h"
+#include "test.h"
+
+#define HISTORY_ROWS 128
+
+typedef struct {
+    char cells[HISTORY_COLUMNS][32];
+} history_row;
+
+static history_row rows[HISTORY_ROWS];
+
+/* Run a query and split its rows (comments skipped) into their cells.
+ * Returns the number of rows. */
+static int query(const char* path, const char* since, const char* tier) {
+    FILE* out = tmpfile();
+    if (history_query(path, since, tier, 0, 85, out) != 0) {
+        fclose(out);
+        return -1;
+    }
+    rewind(out);
+    char line[256];
+    int n = 0;
+    while (fgets(line, sizeof(line), out) != NULL && n < HISTORY_ROWS) {
+        history_row* r = &rows[n];
+        if (line[0] != '#' && sscanf(line, "%*s %*s %31s %31s %31s %31s", r->cells[0],
+                r->cells[1], r->cells[2], r->cells[3]) == HISTORY_COLUMNS)
+            n++;
+    }
+    fclose(out);
+    return n;
+}
+
+/* Every second of two hours and two minutes, starting two hours back on an
+ * hour boundary: the CPU temperature sweeps 50.0-55.9 within each minute,
+ * the CPU duty is the minute number, the GPU temperature is never read. */
+static void test_rollover(const char* path) {
+    time_t base = (time(NULL) / 3600 - 2) * 3600;
+    CHECK(history_open(path) == 0);
+    for (int s = 0; s < 3600 + 120; s++) {
+        double values[HISTORY_COLUMNS] = { 50 + (s % 60) / 10.0, NAN, s / 60, 100 };
+        history_record_at(values, base + s);
+    }
+    history_close();
+
+    // 61 finished minutes and the one still in the accumulator
+    CHECK(query(path, "3h", "min") == 62);
+    CHECK(strcmp(rows[0].cells[HISTORY_CPU_TEMP], "53.0/50.0/55.9") == 0);
+    CHECK(strcmp(rows[0].cells[HISTORY_GPU_TEMP], "-") == 0);
+    CHECK(strcmp(rows[0].cells[HISTORY_CPU_DUTY], "0.0/0.0/0.0") == 0);
+    CHECK(strcmp(rows[0].cells[HISTORY_GPU_DUTY], "100.0/100.0/100.0") == 0);
+    CHECK(strcmp(rows[59].cells[HISTORY_CPU_DUTY], "59.0/59.0/59.0") == 0);
+    CHECK(strcmp(rows[61].cells[HISTORY_CPU_DUTY], "61.0/61.0/61.0") == 0);
+
+    // the first hour, folded from its minutes, and minute 60 of the second
+    CHECK(query(path, "3h", "hour") == 2);
+    CHECK(strcmp(rows[0].cells[HISTORY_CPU_TEMP], "53.0/50.0/55.9") == 0);
+    CHECK(strcmp(rows[0].cells[HISTORY_CPU_DUTY], "29.5/0.0/59.0") == 0);
+    CHECK(strcmp(rows[1].cells[HISTORY_CPU_DUTY], "60.0/60.0/60.0") == 0);
+
+    // reopened, the intervals in progress carry on
+    CHECK(history_open(path) == 0);
+    for (int s = 3600 + 120; s < 3600 + 180; s++) {
+        double values[HISTORY_COLUMNS] = { 60, 60, s / 60, 100 };
+        history_record_at(values, base + s);
+    }
+    history_close();
+    CHECK(query(path, "3h", "min") == 63);
+    CHECK(strcmp(rows[61].cells[HISTORY_CPU_DUTY], "61.0/61.0/61.0") == 0);
+    CHECK(strcmp(rows[62].cells[HISTORY_GPU_TEMP], "60.0/60.0/60.0") == 0);
+    CHECK(query(path, "3h", "hour") == 2);
+    CHECK(strcmp(rows[1].cells[HISTORY_CPU_DUTY], "60.5/60.0/61.0") == 0);
+}
+
+/* A second slot written a day ago and not since is skipped, one written
+ * again is read with its new value only. */
+static void test_stale_slots(const char* path) {
+    unlink(path);
+    time_t now = time(NULL);
+    CHECK(history_open(path) == 0);
+    double old[HISTORY_COLUMNS] = { 99, 99, 99, 99 };
+    history_record_at(old, now - 86400 - 30);
+    history_record_at(old, now - 86400 - 20);
+    double fresh[HISTORY_COLUMNS] = { 11, 11, 11, 11 };
+    history_record_at(fresh, now - 30);
+    history_record_at(fresh, now - 29);
+    history_close();
+    CHECK(query(path, "1d", "sec") == 2);
+    CHECK(strcmp(rows[0].cells[HISTORY_CPU_TEMP], "11.0") == 0);
+    CHECK(strcmp(rows[1].cells[HISTORY_CPU_TEMP], "11.0") == 0);
+}
+
+/* 100 seconds holding 1.0 to 100.0, shuffled, and one without a reading:
+ * the percentiles through the analytics kernels are exact. */
+static void test_stats(const char* path) {
+    unlink(path);
+    time_t now = time(NULL);
+    CHECK(history_open(path) == 0);
+    for (int s = 0; s < 101; s++) {
+        double v = s == 100 ? NAN : 1 + (s * 37) % 100;
+        double values[HISTORY_COLUMNS] = { v, NAN, 30, 30 };
+        history_record_at(values, now - 200 + s);
+    }
+    history_close();
+    FILE* out = tmpfile();
+    CHECK(history_query(path, "1h", "sec", 1, 85, out) == 0);
+    rewind(out);
+    char line[256];
+    int found = 0;
+    while (fgets(line, sizeof(line), out) != NULL) {
+        if (strncmp(line, "cpu_temp ", 9) == 0) {
+            found = 1;
+            CHECK(strcmp(line, "cpu_temp count 100 min 1.0 max 100.0 mean 50.5 "
+                    "p50 50.0 p95 95.0 p99 99.0 above_85_s 15\n") == 0);
+        } else if (strncmp(line, "gpu_temp ", 9) == 0) {
+            CHECK(strcmp(line, "gpu_temp count 0\n") == 0);
+        }
+    }
+    fclose(out);
+    CHECK(found);
+}
+
+static void test_no_follow(const char* root) {
+    test_write(root, "elsewhere", "keep\n");
+    test_symlink(root, "link", "elsewhere");
+    char link[256];
+    snprintf(link, sizeof(link), "%s/link", root);
+    CHECK(history_open(link) == -1);
+    CHECK(strcmp(test_read(root, "elsewhere"), "keep") == 0);
+    CHECK(history_query(link, "1h", NULL, 0, 85, stdout) == -1);
+}
+
+int main(void) {
+    const char* root = test_fake_root();
+    char path[256];
+    snprintf(path, sizeof(path), "%s/history/history", root);
+    test_rollover(path);
+    test_stale_slots(path);
+    test_stats(path);
+    test_no_follow(root);
+    return test_exit("history");
+}
@@ -0,0 +1,61 @@
+/*
+ ============================================================================
+ Name        : test_hwmon.c
+ Description : hwmon registry order and refs across chip hotplug
+ ============================================================================
+ */
+
+#include <string.h>
+
+#include "hwmon.h"
+#include "test.h"
+
+#define DRIVE_A "sys/devices/pci0000:00/0000:00:1b.0/nvme/nvme0"
+#define DRIVE_B "sys/devices/pci0000:00/0000:00:1d.0/nvme/nvme1"
+
+static void add_chip(const char* root, const char* hwmon, const char* device, const char* temp) {
+    char path[256], target[256];
+    snprintf(path, sizeof(path), "sys/class/hwmon/%s/name", hwmon);
+    test_write(root, path, "nvme\n");
+    snprintf(path, sizeof(path), "sys/class/hwmon/%s/temp1_input", hwmon);
+    test_write(root, path, temp);
+    snprintf(path, sizeof(path), "sys/class/hwmon/%s/device", hwmon);
+    snprintf(target, sizeof(target), "../../../../%s", device);
+    snprintf(path, sizeof(path), "%s/uevent", device);
+    test_write(root, path, "");
+    snprintf(path, sizeof(path), "sys/class/hwmon/%s/device", hwmon);
+    test_symlink(root, path, target);
+}
+
+int main(void) {
+    const char* root = test_fake_root();
+    // hwmon0 is the second drive: the order follows the device paths
+    add_chip(root, "hwmon0", DRIVE_B, "45000\n");
+    add_chip(root, "hwmon1", DRIVE_A, "38000\n");
+    CHECK(hwmon_scan() == 2);
+    const hwmon_chip* first = hwmon_find_chip("nvme", 0);
+    CHECK(first != NULL && strstr(first->device, "nvme0") != NULL);
+    CHECK(hwmon_find_chip("nvme", 2) == NULL);
+
+    hwmon_ref ref;
+    long value = 0;
+    hwmon_ref_init(&ref, "nvme", 0, HWMON_TEMP, 1);
+    CHECK(hwmon_ref_read(&ref, &value) == 0 && value == 38000);
+
+    // the first drive goes away: the ref fails rather than reading the other
+    test_remove(root, "sys/class/hwmon/hwmon1");
+    hwmon_scan();
+    CHECK(hwmon_find_chip("nvme", 0) != NULL);
+    CHECK(hwmon_ref_read(&ref, &value) != 0);
+
+    // and finds it again under a new number
+    add_chip(root, "hwmon2", DRIVE_A, "39000\n");
+    hwmon_scan();
+    CHECK(hwmon_ref_read(&ref, &value) == 0 && value == 39000);
+
+    // a chip only bound once it exists
+    hwmon_ref late;
+    hwmon_ref_init(&late, "nvme", 1, HWMON_TEMP, 1);
+    CHECK(hwmon_ref_read(&late, &value) == 0 && value == 45000);
+    return test_exit("hwmon");
+}
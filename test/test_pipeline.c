@@ -0,0 +1,109 @@
+/*
+ ============================================================================
+ Name        : test_pipeline.c
+ Description : SPSC ring ordering, bounds and wraparound
+ ============================================================================
+ */
+
+#include <limits.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+#include "test.h"
+
+#define THREADED_ITEMS 1000000
+
+typedef struct {
+    unsigned long sequence;
+    int payload[3];
+} test_item;
+
+static void test_bounds(void) {
+    pipeline_queue queue;
+    CHECK(pipeline_queue_init(&queue, sizeof(test_item), 5) == 0);
+    CHECK(queue.mask == 7);
+
+    test_item item = { 0 };
+    CHECK(pipeline_pop(&queue, &item) == -1);
+    for (unsigned long i = 0; i < 8; i++) {
+        item.sequence = i;
+        CHECK(pipeline_push(&queue, &item) == 0);
+    }
+    CHECK(pipeline_push(&queue, &item) == -1);
+    CHECK(pipeline_pending(&queue) == 8);
+
+    for (unsigned long i = 0; i < 8; i++) {
+        CHECK(pipeline_pop(&queue, &item) == 0);
+        CHECK(item.sequence == i);
+        pipeline_done(&queue);
+        CHECK(pipeline_pending(&queue) == 7 - i);
+    }
+    CHECK(pipeline_pop(&queue, &item) == -1);
+}
+
+static void test_wraparound(void) {
+    pipeline_queue queue;
+    CHECK(pipeline_queue_init(&queue, sizeof(test_item), 4) == 0);
+    // the indices are free running, start them just before they overflow
+    queue.head = queue.tail = UINT_MAX - 2;
+    queue.done = UINT_MAX - 2;
+
+    test_item item = { 0 };
+    for (unsigned long i = 0; i < 4; i++) {
+        item.sequence = i;
+        CHECK(pipeline_push(&queue, &item) == 0);
+    }
+    CHECK(pipeline_push(&queue, &item) == -1);
+    CHECK(pipeline_pending(&queue) == 4);
+    for (unsigned long i = 0; i < 4; i++) {
+        CHECK(pipeline_pop(&queue, &item) == 0);
+        CHECK(item.sequence == i);
+        pipeline_done(&queue);
+    }
+    CHECK(queue.head == 1);
+    CHECK(pipeline_pending(&queue) == 0);
+    CHECK(pipeline_pop(&queue, &item) == -1);
+}
+
+static void* test_producer(void* arg) {
+    pipeline_queue* queue = arg;
+    test_item item = { 0 };
+    for (unsigned long i = 0; i < THREADED_ITEMS;) {
+        item.sequence = i;
+        item.payload[0] = item.payload[1] = item.payload[2] = (int) i;
+        if (pipeline_push(queue, &item) == 0)
+            i++;
+    }
+    return NULL;
+}
+
+static void test_threaded(void) {
+    pipeline_queue queue;
+    CHECK(pipeline_queue_init(&queue, sizeof(test_item), 16) == 0);
+    pthread_t producer;
+    pthread_create(&producer, NULL, &test_producer, &queue);
+
+    int ordered = 1;
+    test_item item;
+    for (unsigned long expected = 0; expected < THREADED_ITEMS;) {
+        if (pipeline_pop(&queue, &item) != 0) {
+            pipeline_wait(&queue, 100);
+            continue;
+        }
+        if (item.sequence != expected || item.payload[0] != (int) expected
+                || item.payload[2] != (int) expected)
+            ordered = 0;
+        pipeline_done(&queue);
+        expected++;
+    }
+    pthread_join(producer, NULL);
+    CHECK(ordered);
+    CHECK(pipeline_pending(&queue) == 0);
+}
+
+int main(void) {
+    test_bounds();
+    test_wraparound();
+    test_threaded();
+    return test_exit("pipeline");
+}
@@ -0,0 +1,118 @@
+/*
+ ============================================================================
+ Name        : test_quantile.c
+ Description : Quantile buckets and percentile ranks of the stats command
+ ============================================================================
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "ctl.h"
+#include "quantile.h"
+#include "test.h"
+
+typedef struct {
+    unsigned long count;
+    double p50, p95, p99;
+} quantile_line;
+
+static ctl_handler stats_handler;
+
+/* Takes the place of the socket: the test calls the handler itself. */
+int ctl_register(const char* name, const char* help, ctl_handler handler) {
+    if (strcmp(name, "stats") == 0)
+        stats_handler = handler;
+    return 0;
+}
+
+/* The stats line of a series and window, count 0 when there's none. */
+static quantile_line stats(const char* series, const char* window) {
+    quantile_line result = { 0, -1, -1, -1 };
+    FILE* out = tmpfile();
+    stats_handler("", out);
+    rewind(out);
+    char line[256], prefix[64];
+    snprintf(prefix, sizeof(prefix), "%s %s ", series, window);
+    while (fgets(line, sizeof(line), out) != NULL) {
+        if (strncmp(line, prefix, strlen(prefix)) == 0)
+            sscanf(line + strlen(prefix), "count %lu p50 %lf p95 %lf p99 %lf",
+                    &result.count, &result.p50, &result.p95, &result.p99);
+    }
+    fclose(out);
+    return result;
+}
+
+/* Within the sketch's 1%, plus the rounding of the one decimal printed. */
+static int close_to(double value, double expected) {
+    return fabs(value - expected) <= expected * 0.01 + 0.05;
+}
+
+static void test_ranks(void) {
+    // 1..100 once each: the nth percentile is n
+    for (int v = 100; v >= 1; v--)
+        quantile_add(QUANTILE_CPU_TEMP, v);
+    quantile_line l = stats("cpu_temp", "1m");
+    CHECK(l.count == 100);
+    CHECK(close_to(l.p50, 50));
+    CHECK(close_to(l.p95, 95));
+    CHECK(close_to(l.p99, 99));
+    quantile_line h = stats("cpu_temp", "1h");
+    CHECK(h.count == 100 && h.p50 == l.p50 && h.p99 == l.p99);
+
+    // a single outlier among 200 doesn't move p99, two do
+    for (int i = 0; i < 199; i++)
+        quantile_add(QUANTILE_GPU_DUTY, 40);
+    quantile_add(QUANTILE_GPU_DUTY, 100);
+    l = stats("gpu_duty", "1m");
+    CHECK(close_to(l.p50, 40) && close_to(l.p99, 40));
+    quantile_add(QUANTILE_GPU_DUTY, 100);
+    quantile_add(QUANTILE_GPU_DUTY, 100);
+    l = stats("gpu_duty", "1m");
+    CHECK(close_to(l.p95, 40) && close_to(l.p99, 100));
+}
+
+static void test_buckets(void) {
+    // every value comes back within 1%, over the whole range
+    int precise = 1;
+    for (double v = 1.3; v < 5e8; v *= 1.37) {
+        quantile_add(QUANTILE_EC_LATENCY, v);
+        quantile_line l = stats("ec_latency_us", "1m");
+        // below 100 samples p99 is the largest, the one just added
+        if (!close_to(l.p99, v))
+            precise = 0;
+    }
+    CHECK(precise);
+
+    // below 1 counts as 0, beyond the last bucket as its value
+    for (int i = 0; i < 10; i++)
+        quantile_add(QUANTILE_GPU_TEMP, 0.4);
+    quantile_add(QUANTILE_GPU_TEMP, -3);
+    CHECK(stats("gpu_temp", "1m").p50 == 0);
+    for (int i = 0; i < 20; i++)
+        quantile_add(QUANTILE_LOOP_JITTER, 1e12);
+    quantile_line l = stats("loop_jitter_us", "1m");
+    CHECK(l.p50 > 6e8 && l.p50 < 1e9);
+}
+
+static void test_ignored(void) {
+    for (int i = 0; i < 10; i++)
+        quantile_add(QUANTILE_CPU_DUTY, 37.3);
+    quantile_add(QUANTILE_CPU_DUTY, NAN);
+    quantile_add(QUANTILE_SERIES, 50);
+    quantile_add((quantile_series) -1, 50);
+    quantile_line l = stats("cpu_duty", "1m");
+    CHECK(l.count == 10);
+    CHECK(close_to(l.p50, 37.3) && close_to(l.p99, 37.3));
+}
+
+int main(void) {
+    quantile_register();
+    CHECK(stats_handler != NULL);
+    if (stats_handler == NULL)
+        return test_exit("quantile");
+    test_ranks();
+    test_buckets();
+    test_ignored();
+    return test_exit("quantile");
+}
@@ -0,0 +1,91 @@
+/*
+ ============================================================================
+ Name        : test_rpmtarget.c
+ Description : RPM target seeding and trimming, with and without a fan table
+ ============================================================================
+ */
+
+#include <stdio.h>
+
+#include "backend.h"
+#include "fantable.h"
+#include "rpmtarget.h"
+#include "test.h"
+
+static const char* table =
+        "machine P775DM3\n"
+        "fan cpu min_duty 16 max_rpm 4200 settle_ms 800\n"
+        "point cpu 0 0 0 0\n"
+        "point cpu 10 0 0 0\n"
+        "point cpu 20 900 800 0\n"
+        "point cpu 30 1300 600 0\n"
+        "point cpu 60 2500 450 0\n"
+        "point cpu 90 3700 350 0\n"
+        "point cpu 100 4200 20 0\n"
+        "fan gpu min_duty 20 max_rpm 3000 settle_ms 900\n"
+        "point gpu 0 0 0 0\n"
+        "point gpu 100 3000 900 0\n";
+
+/* the fan table is only loaded, nothing may reach the fans */
+int backend_read_one(backend_value what, int* value) {
+    return -1;
+}
+
+int backend_write_duty(int fan, int duty_percentage) {
+    return -1;
+}
+
+static void test_without_table(void) {
+    rpmtarget_configure(4000);
+    CHECK(rpmtarget_enabled());
+    CHECK(rpmtarget_rpm(60) == 2400);
+
+    // a straight line to FANTABLE_DEFAULT_MAX_RPM
+    CHECK(rpmtarget_seed(0, 0) == 0);
+    CHECK(rpmtarget_seed(0, 2200) == 50);
+    CHECK(rpmtarget_seed(1, 9000) == 100);
+
+    // within the 50 RPM band: settled
+    CHECK(rpmtarget_trim(0, 1000, 40, 960) == 40);
+    // just outside it: at least one step
+    CHECK(rpmtarget_trim(0, 1000, 40, 940) == 41);
+    CHECK(rpmtarget_trim(0, 2200, 50, 1760) == 60);
+    // limited to RPMTARGET_MAX_STEP, and to 0-100%
+    CHECK(rpmtarget_trim(0, 1000, 80, 4000) == 70);
+    CHECK(rpmtarget_trim(0, 4000, 95, 1000) == 100);
+    CHECK(rpmtarget_trim(0, 0, 5, 2000) == 0);
+
+    rpmtarget_configure(-1);
+    CHECK(!rpmtarget_enabled());
+}
+
+static void test_with_table(void) {
+    const char* root = test_fake_root();
+    test_write(root, "sys/class/dmi/id/product_name", "P775DM3\n");
+    test_write(root, "fan-table", table);
+    char path[256];
+    snprintf(path, sizeof(path), "%s/fan-table", root);
+    CHECK(fantable_load(path) == 0);
+
+    // interpolated between the points around the target
+    CHECK(rpmtarget_seed(0, 900) == 20);
+    CHECK(rpmtarget_seed(0, 1100) == 25);
+    CHECK(rpmtarget_seed(0, 1900) == 45);
+    CHECK(rpmtarget_seed(0, 4200) == 100);
+    CHECK(rpmtarget_seed(0, 5000) == 100);
+    // never below the spin-up duty
+    CHECK(rpmtarget_seed(0, 300) == 16);
+    CHECK(rpmtarget_seed(1, 300) == 20);
+    CHECK(rpmtarget_seed(1, 1500) == 50);
+
+    // the step follows the local slope: 10% per 400 RPM around 25%
+    CHECK(rpmtarget_trim(0, 1300, 25, 1100) == 30);
+    // 30% per 1200 RPM around 45%
+    CHECK(rpmtarget_trim(0, 2100, 45, 1900) == 50);
+}
+
+int main(void) {
+    test_without_table();
+    test_with_table();
+    return test_exit("rpmtarget");
+}
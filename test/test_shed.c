@@ -0,0 +1,137 @@
+/*
+ ============================================================================
+ Name        : test_shed.c
+ Description : Thermal shedding against a fake cgroupfs tree
+ ============================================================================
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shed.h"
+#include "test.h"
+
+#define CGROUP "sys/fs/cgroup"
+
+static void add_target(shed_config* config, const char* cgroup, int floor_pct) {
+    shed_target_config* t = &config->targets[config->target_count++];
+    snprintf(t->cgroup, sizeof(t->cgroup), "%s", cgroup);
+    t->floor_pct = floor_pct;
+}
+
+/* The quota written for pct percent of the machine at a 100ms period. */
+static long quota(int pct) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return 100000 * (cpus > 0 ? cpus : 1) * pct / 100;
+}
+
+static long read_quota(const char* root, const char* path) {
+    return atol(test_read(root, path));
+}
+
+static void test_order(void) {
+    const char* root = test_fake_root();
+    test_write(root, CGROUP "/batch/cpu.max", "max 100000\n");
+    test_write(root, CGROUP "/user.slice/idle/cpu.max", "max 100000\n");
+    shed_config config = { 85, 78, 40 };
+    add_target(&config, "batch", 50);
+    add_target(&config, "user.slice/idle", 20);
+    shed_configure(&config);
+
+    // below the trip, or the fan not yet at 100%: nothing happens
+    CHECK(shed_update(80, 100) == 0);
+    CHECK(shed_update(90, 90) == 0);
+    CHECK(strcmp(test_read(root, CGROUP "/batch/cpu.max"), "max 100000") == 0);
+    // the first target goes down to its floor before the second is touched
+    CHECK(shed_update(91, 100) == 1);
+    CHECK(read_quota(root, CGROUP "/batch/cpu.max") == quota(60));
+    CHECK(shed_update(92, 100) == 1);
+    CHECK(read_quota(root, CGROUP "/batch/cpu.max") == quota(50));
+    CHECK(strcmp(test_read(root, CGROUP "/user.slice/idle/cpu.max"), "max 100000") == 0);
+    CHECK(shed_update(93, 100) == 2);
+    CHECK(read_quota(root, CGROUP "/user.slice/idle/cpu.max") == quota(60));
+    // relaxed in reverse order
+    CHECK(shed_update(70, 100) == 1);
+    CHECK(strcmp(test_read(root, CGROUP "/user.slice/idle/cpu.max"), "max 100000") == 0);
+    CHECK(read_quota(root, CGROUP "/batch/cpu.max") == quota(50));
+    CHECK(shed_update(70, 100) == 1);
+    CHECK(read_quota(root, CGROUP "/batch/cpu.max") == quota(90));
+
+    // a target dropped from the configuration gets its cpu.max back
+    shed_config rest = { 85, 78, 40 };
+    add_target(&rest, "user.slice/idle", 20);
+    shed_configure(&rest);
+    CHECK(strcmp(test_read(root, CGROUP "/batch/cpu.max"), "max 100000") == 0);
+    shed_release();
+    shed_configure(&(shed_config) { 85, 78, 10 });
+}
+
+static void test_limited_quota(void) {
+    const char* root = test_fake_root();
+    // never more than the cgroup already had
+    test_write(root, CGROUP "/small/cpu.max", "5000 50000\n");
+    shed_config config = { 85, 78, 10 };
+    add_target(&config, "small", 5);
+    shed_configure(&config);
+    shed_update(90, 100);
+    CHECK(shed_update(91, 100) == 1);
+    CHECK(strcmp(test_read(root, CGROUP "/small/cpu.max"), "5000 50000") == 0);
+    shed_release();
+    CHECK(strcmp(test_read(root, CGROUP "/small/cpu.max"), "5000 50000") == 0);
+    shed_configure(&(shed_config) { 85, 78, 10 });
+}
+
+static void test_escapes(void) {
+    const char* root = test_fake_root();
+    test_write(root, CGROUP "/batch/cpu.max", "max 100000\n");
+    test_write(root, "etc/cpu.max", "untouched\n");
+    test_write(root, CGROUP "/batch/inner/cpu.max", "max 100000\n");
+    char link[1024];
+    snprintf(link, sizeof(link), "%s/" CGROUP "/link", root);
+    CHECK(symlink("../../../etc", link) == 0);
+    static const char* bad[] = { "../../../etc", "/etc", "batch/../../../../etc", ".", "..",
+            "batch/./inner", "batch//inner", "", "link" };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        shed_config config = { 85, 78, 50 };
+        add_target(&config, bad[i], 5);
+        shed_configure(&config);
+        shed_update(90, 100);
+        CHECK(shed_update(95, 100) == 0);
+    }
+    CHECK(strcmp(test_read(root, "etc/cpu.max"), "untouched") == 0);
+    // a nested cgroup is fine
+    shed_config config = { 85, 78, 50 };
+    add_target(&config, "batch/inner", 5);
+    shed_configure(&config);
+    CHECK(shed_update(96, 100) == 1);
+    shed_release();
+    shed_configure(&(shed_config) { 85, 78, 10 });
+}
+
+static void test_duplicate(void) {
+    const char* root = test_fake_root();
+    test_write(root, CGROUP "/batch/cpu.max", "max 100000\n");
+    shed_config config = { 85, 78, 10 };
+    add_target(&config, "batch", 80);
+    shed_configure(&config);
+    shed_update(96, 100);
+    CHECK(shed_update(99, 100) == 1);
+    // the same cgroup turning up twice on a re-read must not take the
+    // tightened cpu.max as a second original
+    add_target(&config, "batch", 80);
+    shed_configure(&config);
+    for (int i = 0; i < 5; i++)
+        shed_update(100 + i, 100);
+    shed_release();
+    CHECK(strcmp(test_read(root, CGROUP "/batch/cpu.max"), "max 100000") == 0);
+    shed_configure(&(shed_config) { 85, 78, 10 });
+}
+
+int main(void) {
+    test_order();
+    test_limited_quota();
+    test_escapes();
+    test_duplicate();
+    return test_exit("shed");
+}